@@ -1,13 +1,66 @@
 #ifndef __NUTEST_H__
 #define __NUTEST_H__
 
+// The runner uses POSIX and GNU extensions (fork, mmap, clock_gettime),
+// request them under strict -std=c11 and c99 too. Only takes effect when this
+// header comes before any system header.
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <time.h>
 #include <float.h>
 #include <math.h>
+#include <errno.h>
+#include <signal.h>
+#include <sched.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+#include <sys/wait.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+#ifdef __linux__
+#include <elf.h>
+#include <linux/perf_event.h>
+#include <sys/auxv.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+// Linkage of the runner. By default a test program is one source file and
+// everything defined here is static to it. A suite split across several
+// files builds each of them with NUTEST_EXTERN, and defines
+// NUTEST_IMPLEMENTATION in exactly one: that file compiles the registry,
+// the runner and the reporters, the others only get the declarations and
+// the inline checks.
+#if defined(NUTEST_IMPLEMENTATION)
+#define NUTEST_API
+#define NUTEST_RUNNER 1
+#elif defined(NUTEST_EXTERN)
+#define NUTEST_API extern
+#define NUTEST_RUNNER 0
+#else
+#define NUTEST_API __attribute__((unused)) static
+#define NUTEST_RUNNER 1
+#endif
 
 // ANSI color codes
 #define COLOR_RESET "\033[0m"
@@ -26,464 +79,8065 @@ typedef enum { TEST_PASS, TEST_FAIL, TEST_SKIP, TEST_ERROR } TestResult;
 // Test case function type
 typedef TestResult (*TestFunc)(void);
 
+// Fuzz target function type
+typedef TestResult (*FuzzFunc)(const uint8_t *data, size_t size);
+
 // Test case structure
 typedef struct {
     const char *name;
     TestFunc function;
     const char *suite_name;
     const char *description;
+    const char *file;
+    int line;
+    long timeout_ms;
+    FuzzFunc fuzz;
 } TestCase;
 
-// Test suite structure
+// State of one PROPERTY or TEST_P case. index counts the cases from 0; the
+// generators record every choice they draw so a failing case can be
+// replayed and shrunk.
+typedef struct {
+    size_t index;
+    size_t cases;
+    uint64_t random[4];
+    uint64_t *choices;
+    size_t choice_count;
+    size_t choice_capacity;
+    const uint64_t *replay;
+    size_t replay_count;
+    FILE *log;
+    void **blocks;
+    size_t block_count;
+    size_t block_capacity;
+} PropState;
+
+// Property body type
+typedef TestResult (*PropFunc)(PropState *prop);
+
+// Fixture hooks of a suite: SUITE_SETUP and SUITE_TEARDOWN run once around
+// its tests, TEST_SETUP and TEST_TEARDOWN around each one of them
+typedef enum {
+    FIXTURE_SUITE_SETUP,
+    FIXTURE_SUITE_TEARDOWN,
+    FIXTURE_TEST_SETUP,
+    FIXTURE_TEST_TEARDOWN,
+    FIXTURE_KINDS
+} TestFixtureKind;
+
+// Fixture hook structure
+typedef struct {
+    const char *suite_name;
+    TestFixtureKind kind;
+    TestFunc function;
+    const char *file;
+    int line;
+} TestFixture;
+
+// Test suite structure, with its fixture hooks and, once the suite has
+// started, the result of its SUITE_SETUP and where its failures were kept
 typedef struct {
     const char *name;
     TestCase *tests;
     size_t test_count;
     const char *description;
+    const TestFixture *fixtures[FIXTURE_KINDS];
+    TestResult setup_result;
+    long failures_begin;
+    long failures_end;
 } TestSuite;
 
-// Test registry
+// Test registry, tests are grouped into contiguous suites before running
 typedef struct {
-    TestSuite *suites;
+    TestCase *tests;
+    size_t test_count;
+    size_t capacity;
     size_t suite_count;
+    int prepared;
+    int selected;
+    TestFixture *fixtures;
+    size_t fixture_count;
+    size_t fixture_capacity;
 } TestRegistry;
 
+// Hardware performance counters of a timed region
+#define PERF_MAX_EVENTS 10
+#define PERF_MAX_GROUPS 2
+
+typedef struct {
+    int leaders[PERF_MAX_GROUPS];
+    int fds[PERF_MAX_EVENTS];
+    int groups[PERF_MAX_EVENTS];
+    size_t events[PERF_MAX_EVENTS];
+    size_t count;
+    double totals[PERF_MAX_EVENTS];
+    int scheduled[PERF_MAX_EVENTS];
+} PerfCounters;
+
+// Start and stop line of the threads of a threaded benchmark
+typedef struct {
+    size_t count;
+    size_t waiting;
+    size_t phase;
+    uint64_t released_ns; // When the last thread arrived, one clock for all
+} BenchBarrier;
+
+// Log-linear histogram of latencies in nanoseconds: exact below 128 ns, then
+// 64 buckets per power of two, so a bucket is within 1.6% of its values
+#define BENCH_HISTOGRAM_BITS 7
+#define BENCH_HISTOGRAM_HALF (1 << (BENCH_HISTOGRAM_BITS - 1))
+#define BENCH_HISTOGRAM_BUCKETS \
+    (2 * BENCH_HISTOGRAM_HALF + \
+     (64 - BENCH_HISTOGRAM_BITS) * BENCH_HISTOGRAM_HALF)
+
+typedef struct {
+    uint64_t counts[BENCH_HISTOGRAM_BUCKETS];
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+} BenchHistogram;
+
+// Benchmark state handed to BENCH bodies; a body may set the bytes and
+// items it processed over all its iterations to get throughput reported.
+// Threaded benchmarks hand each thread its own state.
+typedef struct {
+    size_t iterations;
+    int64_t range;
+    size_t thread_index;
+    size_t threads;
+    uint64_t bytes_processed;
+    uint64_t items_processed;
+    size_t remaining;
+    int started;
+    uint64_t start_ns;
+    uint64_t elapsed_ns;
+    uint64_t released_ns;
+    uint64_t wall_ns;
+    PerfCounters *counters;
+    BenchBarrier *barrier;
+    int latency;
+    size_t latency_left;
+    uint64_t last_tick;
+    BenchHistogram *histogram;
+} BenchState;
+
+// Benchmark function type
+typedef void (*BenchFunc)(BenchState *state);
+
+// Benchmark case structure, a multiplier of 0 means no range; threads is
+// the largest thread count of a threaded benchmark, -1 for one per CPU and
+// 0 when not threaded; latency benchmarks time every iteration
+typedef struct {
+    const char *name;
+    BenchFunc function;
+    const char *suite_name;
+    const char *file;
+    int line;
+    int64_t range_start;
+    int64_t range_limit;
+    int64_t range_multiplier;
+    long threads;
+    int latency;
+} BenchCase;
+
+// Benchmark registry
+typedef struct {
+    BenchCase *benches;
+    size_t bench_count;
+    size_t capacity;
+    int prepared;
+} BenchRegistry;
+
+// Per-iteration timing statistics of one benchmark, in nanoseconds
+typedef struct {
+    size_t iterations;
+    size_t sample_count;
+    double *samples;
+    double mean;
+    double median;
+    double stddev;
+    double mad;
+    double min;
+    double max;
+    double bytes_per_iter;
+    double items_per_iter;
+    size_t threads;
+    double busy_ns;
+    BenchHistogram *histogram;
+} BenchStats;
+
+// Samples of one benchmark as stored in a baseline file
+typedef struct {
+    char *name;
+    double *samples;
+    size_t sample_count;
+} BenchRecord;
+
+// Baseline file contents, with the fingerprints of the machine and
+// compiler that produced it
+typedef struct {
+    char machine[256];
+    char compiler[256];
+    BenchRecord *records;
+    size_t record_count;
+    size_t capacity;
+} BenchBaseline;
+
+// Test run configuration
+typedef struct {
+    int configured;
+    size_t jobs;
+    long timeout_ms;
+    size_t slowest;
+    long bench_min_time_ms;
+    size_t bench_samples;
+    size_t bench_warmup;
+    int bench_counters;
+    const char *bench_out;
+    const char *bench_baseline;
+    double bench_threshold;
+    const char *bench_histogram;
+    int color;
+    const char *output;
+    const char *filter;
+    size_t shard_index;
+    size_t total_shards;
+    const char *shard_durations;
+    const char *save_durations;
+    const char *history;
+    int failed_first;
+    int rerun_failed;
+    int fail_fast;
+    int shortest_first;
+    const char *fuzz;
+    const char *corpus;
+    long fuzz_time_s;
+    size_t fuzz_max_len;
+    int fuzz_minimize;
+    uint64_t seed;
+    size_t prop_cases;
+} TestConfig;
+
+// Test result counters
+typedef struct {
+    size_t tests;
+    size_t passed;
+    size_t failed;
+    size_t skipped;
+    size_t errors;
+    size_t suites; // Suites started, fewer than planned after --fail-fast
+} TestCounts;
+
+// Heap use of one test body, filled in when allocation tracking is on
+typedef struct {
+    int tracked;
+    size_t count;
+    size_t bytes;
+    size_t live;
+    size_t peak;
+    size_t leaked_blocks;
+    size_t leaked_bytes;
+    size_t untracked; // Blocks counted but not followed, the table was full
+} TestAllocStats;
+
+#if NUTEST_RUNNER
 // Global test registry
-static TestRegistry test_registry = {NULL, 0};
-
-#define ASSERT_TRUE(condition)                                       \
-    do {                                                             \
-        if (!(condition)) {                                          \
-            fprintf(stderr,                                          \
-                    "[ " COLOR_RED "FAIL" COLOR_RESET                \
-                    "    ] %s:%d: Expected: %s evaluates to true\n", \
-                    __FILE__,                                        \
-                    __LINE__,                                        \
-                    #condition);                                     \
-            return TEST_FAIL;                                        \
-        }                                                            \
+static TestRegistry test_registry = {NULL, 0, 0, 0, 0, 0, NULL, 0, 0};
+
+// Global benchmark registry
+static BenchRegistry bench_registry = {NULL, 0, 0, 0};
+
+// Global test configuration (0 jobs = serial, a negative timeout means the
+// default: TEST_DEFAULT_TIMEOUT_MS in workers, none in the serial runner;
+// color -1 means on when stdout is a terminal, 0 shards means no sharding,
+// history is kept when a path is given or a history ordering asks for one,
+// fuzzing is off without a --fuzz target filter, the seed is picked when the
+// configuration is loaded)
+static TestConfig test_config = {0, 0, -1, 0, 10, 10, 1, 0, NULL, NULL, 5.0,
+                                 NULL, -1, NULL, NULL, 0, 0, NULL, NULL,
+                                 NULL, 0, 0, 0, 0, NULL,
+                                 "corpus", 60, 4096, 0, 0, 1000};
+#endif
+
+#define TEST_DEFAULT_TIMEOUT_MS 60000
+
+// Report an assertion failure of the running test. Failures are formatted
+// out of line, so a passing check costs one predicted branch.
+__attribute__((cold, noinline, format(printf, 3, 4))) NUTEST_API void
+test_failure(const char *file, int line, const char *format, ...);
+
+__attribute__((cold, noinline)) NUTEST_API void
+test_fail_compare(const char *file,
+                  int line,
+                  const char *lhs,
+                  const char *op,
+                  const char *rhs,
+                  double lhs_value,
+                  double rhs_value);
+
+// What a failed check does: ASSERT_* returns from the test, EXPECT_* lets it
+// go on and the test fails once it returns
+#define NUTEST_FATAL return TEST_FAIL
+#define NUTEST_NONFATAL (void)0
+
+// Checks behind the ASSERT_* and EXPECT_* macros, every operand is
+// evaluated exactly once
+#define NUTEST_CHECK_BOOL(condition, failed, truth, on_failure) \
+    do {                                                        \
+        if (__builtin_expect(failed(condition), 0)) {           \
+            test_failure(__FILE__,                              \
+                         __LINE__,                              \
+                         "Expected: %s evaluates to " truth,    \
+                         #condition);                           \
+            on_failure;                                         \
+        }                                                       \
     } while (0)
 
-#define ASSERT_FALSE(condition)                                       \
-    do {                                                              \
-        if (condition) {                                              \
-            fprintf(stderr,                                           \
-                    "[ " COLOR_RED "FAIL" COLOR_RESET                 \
-                    "    ] %s:%d: Expected: %s evaluates to false\n", \
-                    __FILE__,                                         \
-                    __LINE__,                                         \
-                    #condition);                                      \
-            return TEST_FAIL;                                         \
-        }                                                             \
+#define NUTEST_CHECK_COMPARE(lhs, op, rhs, on_failure) \
+    do {                                               \
+        __typeof__((lhs) + 0) _lhs = (lhs);            \
+        __typeof__((rhs) + 0) _rhs = (rhs);            \
+        if (__builtin_expect(!(_lhs op _rhs), 0)) {    \
+            test_fail_compare(__FILE__,                \
+                              __LINE__,                \
+                              #lhs,                    \
+                              #op,                     \
+                              #rhs,                    \
+                              (double)_lhs,            \
+                              (double)_rhs);           \
+            on_failure;                                \
+        }                                              \
     } while (0)
 
-#define ASSERT_EQ(expected, actual)                                 \
-    do {                                                            \
-        if ((expected) != (actual)) {                               \
-            fprintf(stderr,                                         \
-                    "[ " COLOR_RED "FAIL" COLOR_RESET               \
-                    "    ] %s:%d: Expected: %s == %s (%g vs %g)\n", \
-                    __FILE__,                                       \
-                    __LINE__,                                       \
-                    #expected,                                      \
-                    #actual,                                        \
-                    (double)(expected),                             \
-                    (double)(actual));                              \
-            return TEST_FAIL;                                       \
-        }                                                           \
+#define NUTEST_CHECK_FLOAT_EQ(val1, val2, on_failure)     \
+    do {                                                  \
+        float _val1 = (val1);                             \
+        float _val2 = (val2);                             \
+        float _diff = fabsf(_val1 - _val2);               \
+        if (__builtin_expect(_diff > FLT_EPSILON, 0)) {   \
+            test_failure(__FILE__,                        \
+                         __LINE__,                        \
+                         "val1: %s == %s (%.9g vs %.9g, " \
+                         "diff %.9g)",                    \
+                         #val1,                           \
+                         #val2,                           \
+                         _val1,                           \
+                         _val2,                           \
+                         _diff);                          \
+            on_failure;                                   \
+        }                                                 \
     } while (0)
 
-#define ASSERT_NE(val1, val2)                                          \
-    do {                                                               \
-        if ((val1) == (val2)) {                                        \
-            fprintf(stderr,                                            \
-                    "[ " COLOR_RED "FAIL" COLOR_RESET                  \
-                    "    ] %s:%d: Expected: %s != %s (both are %g)\n", \
-                    __FILE__,                                          \
-                    __LINE__,                                          \
-                    #val1,                                             \
-                    #val2,                                             \
-                    (double)(val1));                                   \
-            return TEST_FAIL;                                          \
-        }                                                              \
+#define NUTEST_CHECK_DOUBLE_EQ(val1, val2, on_failure)      \
+    do {                                                    \
+        double _val1 = (val1);                              \
+        double _val2 = (val2);                              \
+        double _diff = fabs(_val1 - _val2);                 \
+        if (__builtin_expect(_diff > DBL_EPSILON, 0)) {     \
+            test_failure(__FILE__,                          \
+                         __LINE__,                          \
+                         "val1: %s == %s (%.17g vs %.17g, " \
+                         "diff %.17g)",                     \
+                         #val1,                             \
+                         #val2,                             \
+                         _val1,                             \
+                         _val2,                             \
+                         _diff);                            \
+            on_failure;                                     \
+        }                                                   \
     } while (0)
 
-#define ASSERT_GT(val1, val2)                                      \
-    do {                                                           \
-        if ((val1) <= (val2)) {                                    \
-            fprintf(stderr,                                        \
-                    "[ " COLOR_RED "FAIL" COLOR_RESET              \
-                    "    ] %s:%d: Expected: %s > %s (%g vs %g)\n", \
-                    __FILE__,                                      \
-                    __LINE__,                                      \
-                    #val1,                                         \
-                    #val2,                                         \
-                    (double)(val1),                                \
-                    (double)(val2));                               \
-            return TEST_FAIL;                                      \
-        }                                                          \
+#define NUTEST_CHECK_NEAR(val1, val2, tolerance, on_failure) \
+    do {                                                     \
+        double _val1 = (val1);                               \
+        double _val2 = (val2);                               \
+        double _tolerance = (tolerance);                     \
+        double _diff = fabs(_val1 - _val2);                  \
+        if (__builtin_expect(_diff > _tolerance, 0)) {       \
+            test_failure(__FILE__,                           \
+                         __LINE__,                           \
+                         "val1: %s ~= %s (%.17g vs %.17g, "  \
+                         "diff %.17g > tol %.17g)",          \
+                         #val1,                              \
+                         #val2,                              \
+                         _val1,                              \
+                         _val2,                              \
+                         _diff,                              \
+                         _tolerance);                        \
+            on_failure;                                      \
+        }                                                    \
     } while (0)
 
-#define ASSERT_LT(val1, val2)                                      \
-    do {                                                           \
-        if ((val1) >= (val2)) {                                    \
-            fprintf(stderr,                                        \
-                    "[ " COLOR_RED "FAIL" COLOR_RESET              \
-                    "    ] %s:%d: Expected: %s < %s (%g vs %g)\n", \
-                    __FILE__,                                      \
-                    __LINE__,                                      \
-                    #val1,                                         \
-                    #val2,                                         \
-                    (double)(val1),                                \
-                    (double)(val2));                               \
-            return TEST_FAIL;                                      \
-        }                                                          \
+#define NUTEST_CHECK_STREQ(str1, str2, on_failure)             \
+    do {                                                       \
+        const char *_str1 = (str1);                            \
+        const char *_str2 = (str2);                            \
+        if (__builtin_expect(strcmp(_str1, _str2) != 0, 0)) {  \
+            test_failure(__FILE__,                             \
+                         __LINE__,                             \
+                         "Expected: %s == %s\n"                \
+                         "                  \"%s\" vs \"%s\"", \
+                         #str1,                                \
+                         #str2,                                \
+                         _str1,                                \
+                         _str2);                               \
+            on_failure;                                        \
+        }                                                      \
     } while (0)
 
-#define ASSERT_GE(val1, val2)                                       \
-    do {                                                            \
-        if ((val1) < (val2)) {                                      \
-            fprintf(stderr,                                         \
-                    "[ " COLOR_RED "FAIL" COLOR_RESET               \
-                    "    ] %s:%d: Expected: %s >= %s (%g vs %g)\n", \
-                    __FILE__,                                       \
-                    __LINE__,                                       \
-                    #val1,                                          \
-                    #val2,                                          \
-                    (double)(val1),                                 \
-                    (double)(val2));                                \
-            return TEST_FAIL;                                       \
-        }                                                           \
+#define NUTEST_CHECK_STRNE(str1, str2, on_failure)                 \
+    do {                                                           \
+        const char *_str1 = (str1);                                \
+        const char *_str2 = (str2);                                \
+        if (__builtin_expect(strcmp(_str1, _str2) == 0, 0)) {      \
+            test_failure(__FILE__,                                 \
+                         __LINE__,                                 \
+                         "Expected: %s != %s\n"                    \
+                         "                  Both equal to \"%s\"", \
+                         #str1,                                    \
+                         #str2,                                    \
+                         _str1);                                   \
+            on_failure;                                            \
+        }                                                          \
     } while (0)
 
-#define ASSERT_LE(val1, val2)                                       \
-    do {                                                            \
-        if ((val1) > (val2)) {                                      \
-            fprintf(stderr,                                         \
-                    "[ " COLOR_RED "FAIL" COLOR_RESET               \
-                    "    ] %s:%d: Expected: %s <= %s (%g vs %g)\n", \
-                    __FILE__,                                       \
-                    __LINE__,                                       \
-                    #val1,                                          \
-                    #val2,                                          \
-                    (double)(val1),                                 \
-                    (double)(val2));                                \
-            return TEST_FAIL;                                       \
-        }                                                           \
+#define NUTEST_CHECK_NULL(ptr, on_failure)                              \
+    do {                                                                \
+        const void *_ptr = (ptr);                                       \
+        if (__builtin_expect(_ptr != NULL, 0)) {                        \
+            test_failure(                                               \
+                __FILE__, __LINE__, "%s is not NULL (%p)", #ptr, _ptr); \
+            on_failure;                                                 \
+        }                                                               \
     } while (0)
 
-#define ASSERT_FLOAT_EQ(val1, val2)                               \
+#define NUTEST_CHECK_NOT_NULL(ptr, on_failure)                    \
     do {                                                          \
-        float _val1 = (val1);                                     \
-        float _val2 = (val2);                                     \
-        float _diff = fabsf(_val1 - _val2);                       \
-        if (_diff > FLT_EPSILON) {                                \
-            fprintf(stderr,                                       \
-                    "[ " COLOR_RED "FAIL" COLOR_RESET             \
-                    "    ] %s:%d: val1: %s == %s (%.9g vs %.9g, " \
-                    "diff %.9g)\n",                               \
-                    __FILE__,                                     \
-                    __LINE__,                                     \
-                    #val1,                                        \
-                    #val2,                                        \
-                    _val1,                                        \
-                    _val2,                                        \
-                    _diff);                                       \
-            return TEST_FAIL;                                     \
+        if (__builtin_expect((ptr) == NULL, 0)) {                 \
+            test_failure(__FILE__, __LINE__, "%s is NULL", #ptr); \
+            on_failure;                                           \
         }                                                         \
     } while (0)
 
-#define ASSERT_DOUBLE_EQ(val1, val2)                                \
-    do {                                                            \
-        double _val1 = (val1);                                      \
-        double _val2 = (val2);                                      \
-        double _diff = fabs(_val1 - _val2);                         \
-        if (_diff > DBL_EPSILON) {                                  \
-            fprintf(stderr,                                         \
-                    "[ " COLOR_RED "FAIL" COLOR_RESET               \
-                    "    ] %s:%d: val1: %s == %s (%.17g vs %.17g, " \
-                    "diff %.17g)\n",                                \
-                    __FILE__,                                       \
-                    __LINE__,                                       \
-                    #val1,                                          \
-                    #val2,                                          \
-                    _val1,                                          \
-                    _val2,                                          \
-                    _diff);                                         \
-            return TEST_FAIL;                                       \
-        }                                                           \
+#define NUTEST_CHECK_MEM_EQ(expected, actual, size, on_failure)  \
+    do {                                                         \
+        if (__builtin_expect(                                    \
+                memcmp((expected), (actual), (size)) != 0, 0)) { \
+            test_failure(__FILE__,                               \
+                         __LINE__,                               \
+                         "Memory differs for %s and %s",         \
+                         #expected,                              \
+                         #actual);                               \
+            on_failure;                                          \
+        }                                                        \
     } while (0)
 
-#define ASSERT_NEAR(val1, val2, tolerance)                          \
-    do {                                                            \
-        double _val1 = (val1);                                      \
-        double _val2 = (val2);                                      \
-        double _diff = fabs(_val1 - _val2);                         \
-        if (_diff > (tolerance)) {                                  \
-            fprintf(stderr,                                         \
-                    "[ " COLOR_RED "FAIL" COLOR_RESET               \
-                    "    ] %s:%d: val1: %s ~= %s (%.17g vs %.17g, " \
-                    "diff %.17g > tol %.17g)\n",                    \
-                    __FILE__,                                       \
-                    __LINE__,                                       \
-                    #val1,                                          \
-                    #val2,                                          \
-                    _val1,                                          \
-                    _val2,                                          \
-                    _diff,                                          \
-                    (tolerance));                                   \
-            return TEST_FAIL;                                       \
-        }                                                           \
-    } while (0)
+// Fatal assertions, the test stops at the first failure
+#define ASSERT_TRUE(condition) \
+    NUTEST_CHECK_BOOL(condition, !, "true", NUTEST_FATAL)
+#define ASSERT_FALSE(condition) \
+    NUTEST_CHECK_BOOL(condition, !!, "false", NUTEST_FATAL)
+#define ASSERT_EQ(expected, actual) \
+    NUTEST_CHECK_COMPARE(expected, ==, actual, NUTEST_FATAL)
+#define ASSERT_NE(val1, val2) NUTEST_CHECK_COMPARE(val1, !=, val2, NUTEST_FATAL)
+#define ASSERT_GT(val1, val2) NUTEST_CHECK_COMPARE(val1, >, val2, NUTEST_FATAL)
+#define ASSERT_LT(val1, val2) NUTEST_CHECK_COMPARE(val1, <, val2, NUTEST_FATAL)
+#define ASSERT_GE(val1, val2) NUTEST_CHECK_COMPARE(val1, >=, val2, NUTEST_FATAL)
+#define ASSERT_LE(val1, val2) NUTEST_CHECK_COMPARE(val1, <=, val2, NUTEST_FATAL)
+#define ASSERT_FLOAT_EQ(val1, val2) \
+    NUTEST_CHECK_FLOAT_EQ(val1, val2, NUTEST_FATAL)
+#define ASSERT_DOUBLE_EQ(val1, val2) \
+    NUTEST_CHECK_DOUBLE_EQ(val1, val2, NUTEST_FATAL)
+#define ASSERT_NEAR(val1, val2, tolerance) \
+    NUTEST_CHECK_NEAR(val1, val2, tolerance, NUTEST_FATAL)
+#define ASSERT_STREQ(str1, str2) NUTEST_CHECK_STREQ(str1, str2, NUTEST_FATAL)
+#define ASSERT_STRNE(str1, str2) NUTEST_CHECK_STRNE(str1, str2, NUTEST_FATAL)
+#define ASSERT_NULL(ptr) NUTEST_CHECK_NULL(ptr, NUTEST_FATAL)
+#define ASSERT_NOT_NULL(ptr) NUTEST_CHECK_NOT_NULL(ptr, NUTEST_FATAL)
+#define ASSERT_MEM_EQ(expected, actual, size) \
+    NUTEST_CHECK_MEM_EQ(expected, actual, size, NUTEST_FATAL)
 
-#define ASSERT_STREQ(str1, str2)                            \
-    do {                                                    \
-        const char *_str1 = (str1);                         \
-        const char *_str2 = (str2);                         \
-        if (strcmp(_str1, _str2) != 0) {                    \
-            fprintf(stderr,                                 \
-                    "[ " COLOR_RED "FAIL" COLOR_RESET       \
-                    "    ] %s:%d: Expected: %s == %s\n"     \
-                    "                  \"%s\" vs \"%s\"\n", \
-                    __FILE__,                               \
-                    __LINE__,                               \
-                    #str1,                                  \
-                    #str2,                                  \
-                    _str1,                                  \
-                    _str2);                                 \
-            return TEST_FAIL;                               \
-        }                                                   \
-    } while (0)
+// Non-fatal expectations, the test reports every failure and keeps going
+#define EXPECT_TRUE(condition) \
+    NUTEST_CHECK_BOOL(condition, !, "true", NUTEST_NONFATAL)
+#define EXPECT_FALSE(condition) \
+    NUTEST_CHECK_BOOL(condition, !!, "false", NUTEST_NONFATAL)
+#define EXPECT_EQ(expected, actual) \
+    NUTEST_CHECK_COMPARE(expected, ==, actual, NUTEST_NONFATAL)
+#define EXPECT_NE(val1, val2) \
+    NUTEST_CHECK_COMPARE(val1, !=, val2, NUTEST_NONFATAL)
+#define EXPECT_GT(val1, val2) \
+    NUTEST_CHECK_COMPARE(val1, >, val2, NUTEST_NONFATAL)
+#define EXPECT_LT(val1, val2) \
+    NUTEST_CHECK_COMPARE(val1, <, val2, NUTEST_NONFATAL)
+#define EXPECT_GE(val1, val2) \
+    NUTEST_CHECK_COMPARE(val1, >=, val2, NUTEST_NONFATAL)
+#define EXPECT_LE(val1, val2) \
+    NUTEST_CHECK_COMPARE(val1, <=, val2, NUTEST_NONFATAL)
+#define EXPECT_FLOAT_EQ(val1, val2) \
+    NUTEST_CHECK_FLOAT_EQ(val1, val2, NUTEST_NONFATAL)
+#define EXPECT_DOUBLE_EQ(val1, val2) \
+    NUTEST_CHECK_DOUBLE_EQ(val1, val2, NUTEST_NONFATAL)
+#define EXPECT_NEAR(val1, val2, tolerance) \
+    NUTEST_CHECK_NEAR(val1, val2, tolerance, NUTEST_NONFATAL)
+#define EXPECT_STREQ(str1, str2) NUTEST_CHECK_STREQ(str1, str2, NUTEST_NONFATAL)
+#define EXPECT_STRNE(str1, str2) NUTEST_CHECK_STRNE(str1, str2, NUTEST_NONFATAL)
+#define EXPECT_NULL(ptr) NUTEST_CHECK_NULL(ptr, NUTEST_NONFATAL)
+#define EXPECT_NOT_NULL(ptr) NUTEST_CHECK_NOT_NULL(ptr, NUTEST_NONFATAL)
+#define EXPECT_MEM_EQ(expected, actual, size) \
+    NUTEST_CHECK_MEM_EQ(expected, actual, size, NUTEST_NONFATAL)
 
-#define ASSERT_STRNE(str1, str2)                                \
-    do {                                                        \
-        const char *_str1 = (str1);                             \
-        const char *_str2 = (str2);                             \
-        if (strcmp(_str1, _str2) == 0) {                        \
-            fprintf(stderr,                                     \
-                    "[ " COLOR_RED "FAIL" COLOR_RESET           \
-                    "    ] %s:%d: Expected: %s != %s\n"         \
-                    "                  Both equal to \"%s\"\n", \
-                    __FILE__,                                   \
-                    __LINE__,                                   \
-                    #str1,                                      \
-                    #str2,                                      \
-                    _str1);                                     \
-            return TEST_FAIL;                                   \
-        }                                                       \
-    } while (0)
+// Allocation tracking
+//
+// Defining NUTEST_TRACK_ALLOCS before including nutest.h in one source file
+// of a test program (glibc only) replaces malloc, calloc, realloc and free
+// with versions that count what each test body allocates. The counts are
+// shown next to the test's result, and a block the test allocated and did
+// not free fails it as a leak. The runner's own allocations are not counted.
+// Sanitizers replace malloc themselves, under one the replacements are left
+// out and tracking stays off.
+#define TEST_ALLOC_BLOCKS (1 << 16) // Initial size of the block table
 
-#define ASSERT_NULL(ptr)                                  \
-    do {                                                  \
-        if (ptr != NULL) {                                \
-            fprintf(stderr,                               \
-                    "[ " COLOR_RED "FAIL" COLOR_RESET     \
-                    "    ] %s:%d: %s is not NULL (%p)\n", \
-                    __FILE__,                             \
-                    __LINE__,                             \
-                    #ptr,                                 \
-                    (void *)(ptr));                       \
-            return TEST_FAIL;                             \
-        }                                                 \
-    } while (0)
+#if defined(__SANITIZE_ADDRESS__) || defined(__SANITIZE_HWADDRESS__) || \
+    defined(__SANITIZE_THREAD__)
+#define NUTEST_SANITIZED 1
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer) || __has_feature(memory_sanitizer) || \
+    __has_feature(thread_sanitizer) || __has_feature(hwaddress_sanitizer)
+#define NUTEST_SANITIZED 1
+#endif
+#endif
+#ifndef NUTEST_SANITIZED
+#define NUTEST_SANITIZED 0
+#endif
 
-#define ASSERT_NOT_NULL(ptr)                          \
-    do {                                              \
-        if (ptr == NULL) {                            \
-            fprintf(stderr,                           \
-                    "[ " COLOR_RED "FAIL" COLOR_RESET \
-                    "    ] %s:%d: %s is NULL\n",      \
-                    __FILE__,                         \
-                    __LINE__,                         \
-                    #ptr);                            \
-            return TEST_FAIL;                         \
-        }                                             \
-    } while (0)
+typedef struct {
+    void *ptr;
+    size_t size;
+} TestAllocBlock;
 
-#define ASSERT_MEM_EQ(expected, actual, size)                      \
-    do {                                                           \
-        if (memcmp((expected), (actual), (size))) {                \
-            fprintf(stderr,                                        \
-                    "[ " COLOR_RED "FAIL" COLOR_RESET              \
-                    "    ] %s:%d: Memory differs for %s and %s\n", \
-                    __FILE__,                                      \
-                    __LINE__,                                      \
-                    #expected,                                     \
-                    #actual);                                      \
-            return TEST_FAIL;                                      \
-        }                                                          \
-    } while (0)
+// Tracker state, shared by every source file of the program; blocks the
+// running test allocated are kept in an open-addressed table that doubles
+// when 3/4 full
+typedef struct {
+    int sanitized; // Built under a sanitizer, nothing is tracked
+    int lock;
+    int active;
+    int paused;
+    TestAllocStats stats;
+    size_t block_count;
+    size_t capacity;
+    TestAllocBlock *blocks;
+} TestAllocTracker;
 
-// Test registration macros
-#define TEST_F(test_suite_name, test_name)                          \
+#ifdef __cplusplus
+extern "C" {
+#endif
+extern TestAllocTracker nutest_alloc_tracker __attribute__((weak));
+#ifdef __cplusplus
+}
+#endif
+
+#if NUTEST_RUNNER || defined(NUTEST_TRACK_ALLOCS)
+static void lock_test_allocs(TestAllocTracker *tracker) {
+    while (__atomic_test_and_set(&tracker->lock, __ATOMIC_ACQUIRE)) {
+        sched_yield();
+    }
+}
+
+static void unlock_test_allocs(TestAllocTracker *tracker) {
+    __atomic_clear(&tracker->lock, __ATOMIC_RELEASE);
+}
+#endif
+
+#if NUTEST_RUNNER
+// The tracker, or NULL if no source file defines NUTEST_TRACK_ALLOCS or it
+// was built under a sanitizer
+static TestAllocTracker *test_alloc_tracker(void) {
+    TestAllocTracker *tracker = &nutest_alloc_tracker;
+    return tracker && !tracker->sanitized ? tracker : NULL;
+}
+
+// Whether NUTEST_TRACK_ALLOCS is defined but a sanitizer keeps tracking off
+static int test_allocs_sanitized(void) {
+    TestAllocTracker *tracker = &nutest_alloc_tracker;
+    return tracker && tracker->sanitized;
+}
+
+// Start counting the allocations of a test body
+static void begin_test_allocs(void) {
+    TestAllocTracker *tracker = test_alloc_tracker();
+
+    if (!tracker) {
+        return;
+    }
+    lock_test_allocs(tracker);
+    memset(&tracker->stats, 0, sizeof(tracker->stats));
+    // Blocks a previous test leaked are forgotten
+    if (tracker->block_count > 0) {
+        memset(tracker->blocks, 0, tracker->capacity * sizeof(TestAllocBlock));
+        tracker->block_count = 0;
+    }
+    unlock_test_allocs(tracker);
+    __atomic_store_n(&tracker->active, 1, __ATOMIC_RELEASE);
+}
+
+static void print_test_label(FILE *out, const char *color, const char *label);
+
+// Stop counting, fail the test if it leaked
+static void end_test_allocs(const TestCase *test, TestAllocStats *stats) {
+    TestAllocTracker *tracker = test_alloc_tracker();
+
+    memset(stats, 0, sizeof(*stats));
+    if (!tracker) {
+        return;
+    }
+    __atomic_store_n(&tracker->active, 0, __ATOMIC_RELEASE);
+    lock_test_allocs(tracker);
+    *stats = tracker->stats;
+    stats->tracked = 1;
+    stats->leaked_blocks = tracker->block_count;
+    stats->leaked_bytes = tracker->stats.live;
+    unlock_test_allocs(tracker);
+
+    if (stats->leaked_blocks > 0) {
+        test_failure(test->file,
+                     test->line,
+                     "leaked %zu blocks (%zu bytes)",
+                     stats->leaked_blocks,
+                     stats->leaked_bytes);
+    }
+    if (stats->untracked > 0) {
+        print_test_label(stderr, COLOR_YELLOW, "WARN");
+        fprintf(stderr,
+                "%s.%s: out of memory for the allocation table, %zu blocks "
+                "were not followed, leaks and peak are incomplete\n",
+                test->suite_name,
+                test->name,
+                stats->untracked);
+    }
+}
+
+// Keep the runner's own allocations out of the counts of a running test
+static void pause_test_allocs(int pause) {
+    TestAllocTracker *tracker = test_alloc_tracker();
+
+    if (tracker) {
+        __atomic_add_fetch(&tracker->paused, pause ? 1 : -1, __ATOMIC_RELAXED);
+    }
+}
+#endif
+
+// State of an ASSERT_NO_ALLOC or ASSERT_ALLOCS_LE block
+typedef struct {
+    int state;
+    size_t limit;
+    size_t count;
+} TestAllocScope;
+
+NUTEST_API TestAllocScope begin_test_alloc_scope(size_t limit);
+NUTEST_API int test_alloc_scope_failed(const TestAllocScope *scope,
+                                       const char *file,
+                                       int line);
+
+#if NUTEST_RUNNER
+NUTEST_API TestAllocScope begin_test_alloc_scope(size_t limit) {
+    TestAllocTracker *tracker = test_alloc_tracker();
+    TestAllocScope scope = {0, limit, 0};
+
+    if (tracker) {
+        scope.count = __atomic_load_n(&tracker->stats.count, __ATOMIC_RELAXED);
+    }
+    return scope;
+}
+
+NUTEST_API int test_alloc_scope_failed(const TestAllocScope *scope,
+                                       const char *file,
+                                       int line) {
+    TestAllocTracker *tracker = test_alloc_tracker();
+    size_t count;
+
+    if (!tracker) {
+        // Checked in the builds without a sanitizer
+        if (test_allocs_sanitized()) {
+            return 0;
+        }
+        test_failure(file,
+                     line,
+                     "allocation tracking is off, define NUTEST_TRACK_ALLOCS "
+                     "in one source file");
+        return 1;
+    }
+    count = __atomic_load_n(&tracker->stats.count, __ATOMIC_RELAXED) -
+            scope->count;
+    if (__builtin_expect(count <= scope->limit, 1)) {
+        return 0;
+    }
+    test_failure(file,
+                 line,
+                 "Expected: at most %zu allocations in block, made %zu",
+                 scope->limit,
+                 count);
+    return 1;
+}
+#endif
+
+// Run the block that follows once, then check how many allocations it made
+#define NUTEST_CHECK_ALLOCS(limit, on_failure)                                \
+    for (TestAllocScope _alloc_scope = begin_test_alloc_scope(limit);;        \
+         _alloc_scope.state = 2)                                              \
+        if (_alloc_scope.state == 2) {                                        \
+            if (test_alloc_scope_failed(&_alloc_scope, __FILE__, __LINE__)) { \
+                on_failure;                                                   \
+            }                                                                 \
+            break;                                                            \
+        } else                                                                \
+            for (; _alloc_scope.state == 0; _alloc_scope.state = 1)
+
+#define ASSERT_NO_ALLOC NUTEST_CHECK_ALLOCS(0, NUTEST_FATAL)
+#define ASSERT_ALLOCS_LE(limit) NUTEST_CHECK_ALLOCS(limit, NUTEST_FATAL)
+#define EXPECT_NO_ALLOC NUTEST_CHECK_ALLOCS(0, NUTEST_NONFATAL)
+#define EXPECT_ALLOCS_LE(limit) NUTEST_CHECK_ALLOCS(limit, NUTEST_NONFATAL)
+
+#ifdef NUTEST_TRACK_ALLOCS
+#ifndef __GLIBC__
+#error "NUTEST_TRACK_ALLOCS needs glibc"
+#endif
+
+#ifdef __cplusplus
+#define NUTEST_THROW __THROW
+extern "C" {
+#else
+#define NUTEST_THROW
+#endif
+
+#if NUTEST_SANITIZED
+TestAllocTracker nutest_alloc_tracker = {
+    1, 0, 0, 0, {0, 0, 0, 0, 0, 0, 0, 0}, 0, 0, NULL};
+#else
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+TestAllocTracker nutest_alloc_tracker;
+
+static int test_allocs_counting(void) {
+    return __atomic_load_n(&nutest_alloc_tracker.active, __ATOMIC_ACQUIRE) &&
+           !__atomic_load_n(&nutest_alloc_tracker.paused, __ATOMIC_RELAXED);
+}
+
+static size_t test_alloc_home(const void *ptr, size_t capacity) {
+    uint64_t hash = (uint64_t)(uintptr_t)ptr * 0x9e3779b97f4a7c15u;
+    return (size_t)(hash >> 32) & (capacity - 1);
+}
+
+static void insert_test_alloc(TestAllocBlock *blocks,
+                              size_t capacity,
+                              void *ptr,
+                              size_t size) {
+    size_t i = test_alloc_home(ptr, capacity);
+
+    while (blocks[i].ptr) {
+        i = (i + 1) & (capacity - 1);
+    }
+    blocks[i].ptr = ptr;
+    blocks[i].size = size;
+}
+
+// Double the block table, mapped directly so the tracker never calls the
+// malloc it replaces
+static int grow_test_allocs(TestAllocTracker *tracker) {
+    size_t capacity =
+        tracker->capacity ? tracker->capacity * 2 : TEST_ALLOC_BLOCKS;
+    void *mapped = mmap(NULL,
+                        capacity * sizeof(TestAllocBlock),
+                        PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS,
+                        -1,
+                        0);
+    TestAllocBlock *blocks = (TestAllocBlock *)mapped;
+
+    if (mapped == MAP_FAILED) {
+        return -1;
+    }
+    for (size_t i = 0; i < tracker->capacity; i++) {
+        if (tracker->blocks[i].ptr) {
+            insert_test_alloc(blocks,
+                              capacity,
+                              tracker->blocks[i].ptr,
+                              tracker->blocks[i].size);
+        }
+    }
+    if (tracker->blocks) {
+        munmap(tracker->blocks, tracker->capacity * sizeof(TestAllocBlock));
+    }
+    tracker->blocks = blocks;
+    tracker->capacity = capacity;
+    return 0;
+}
+
+static void track_test_alloc(void *ptr, size_t size) {
+    TestAllocTracker *tracker = &nutest_alloc_tracker;
+
+    lock_test_allocs(tracker);
+    tracker->stats.count++;
+    tracker->stats.bytes += size;
+    if (tracker->block_count >= tracker->capacity / 4 * 3 &&
+        grow_test_allocs(tracker) != 0) {
+        tracker->stats.untracked++;
+    } else {
+        insert_test_alloc(tracker->blocks, tracker->capacity, ptr, size);
+        tracker->block_count++;
+        tracker->stats.live += size;
+        if (tracker->stats.live > tracker->stats.peak) {
+            tracker->stats.peak = tracker->stats.live;
+        }
+    }
+    unlock_test_allocs(tracker);
+}
+
+// Forget a freed block; blocks from before the test are not in the table
+static void untrack_test_alloc(void *ptr) {
+    TestAllocTracker *tracker = &nutest_alloc_tracker;
+    size_t mask, i;
+
+    lock_test_allocs(tracker);
+    if (tracker->block_count == 0) {
+        unlock_test_allocs(tracker);
+        return;
+    }
+    mask = tracker->capacity - 1;
+    i = test_alloc_home(ptr, tracker->capacity);
+    while (tracker->blocks[i].ptr && tracker->blocks[i].ptr != ptr) {
+        i = (i + 1) & mask;
+    }
+    if (tracker->blocks[i].ptr) {
+        tracker->stats.live -= tracker->blocks[i].size;
+        tracker->block_count--;
+        // Shift later blocks of the probe run back into the hole
+        for (size_t j = (i + 1) & mask; tracker->blocks[j].ptr;
+             j = (j + 1) & mask) {
+            size_t home =
+                test_alloc_home(tracker->blocks[j].ptr, tracker->capacity);
+
+            if (((j - home) & mask) >= ((j - i) & mask)) {
+                tracker->blocks[i] = tracker->blocks[j];
+                i = j;
+            }
+        }
+        tracker->blocks[i].ptr = NULL;
+    }
+    unlock_test_allocs(tracker);
+}
+
+void *malloc(size_t size) NUTEST_THROW {
+    void *ptr = __libc_malloc(size);
+
+    if (ptr && test_allocs_counting()) {
+        track_test_alloc(ptr, size);
+    }
+    return ptr;
+}
+
+void *calloc(size_t count, size_t size) NUTEST_THROW {
+    void *ptr = __libc_calloc(count, size);
+
+    if (ptr && test_allocs_counting()) {
+        track_test_alloc(ptr, count * size);
+    }
+    return ptr;
+}
+
+void *realloc(void *ptr, size_t size) NUTEST_THROW {
+    void *moved = __libc_realloc(ptr, size);
+
+    // A failed realloc leaves the old block in place
+    if ((moved || size == 0) && test_allocs_counting()) {
+        if (ptr) {
+            untrack_test_alloc(ptr);
+        }
+        if (moved) {
+            track_test_alloc(moved, size);
+        }
+    }
+    return moved;
+}
+
+void free(void *ptr) NUTEST_THROW {
+    if (ptr && test_allocs_counting()) {
+        untrack_test_alloc(ptr);
+    }
+    __libc_free(ptr);
+}
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+#endif
+
+// Coverage feedback for FUZZ_TEST
+//
+// Defining NUTEST_FUZZ before including nutest.h in one source file adds the
+// callbacks of -fsanitize-coverage=trace-pc-guard (clang) and
+// -fsanitize-coverage=trace-pc (gcc). Each instrumented edge the fuzzed code
+// reaches bumps a saturating 8-bit counter of a fixed map, which --fuzz reads
+// after every input to keep those that reach something new.
+#define FUZZ_MAP_SIZE (1 << 16)
+
+typedef struct {
+    uint32_t guards;
+    uintptr_t previous;
+    uint8_t hits[FUZZ_MAP_SIZE];
+} FuzzCoverage;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+extern FuzzCoverage nutest_fuzz_coverage __attribute__((weak));
+#ifdef __cplusplus
+}
+#endif
+
+// The coverage callbacks must not call themselves
+#if defined(__clang__)
+#define NUTEST_NO_COVERAGE __attribute__((no_sanitize("coverage")))
+#elif defined(__GNUC__) && __GNUC__ >= 12
+#define NUTEST_NO_COVERAGE __attribute__((no_sanitize_coverage))
+#else
+#define NUTEST_NO_COVERAGE
+#endif
+
+#if NUTEST_RUNNER
+// The coverage map, or NULL if no source file defines NUTEST_FUZZ
+static FuzzCoverage *fuzz_coverage(void) {
+    return &nutest_fuzz_coverage;
+}
+#endif
+
+#ifdef NUTEST_FUZZ
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+FuzzCoverage nutest_fuzz_coverage;
+
+// Number the guards of each module, index 0 of the map stays unused
+NUTEST_NO_COVERAGE void __sanitizer_cov_trace_pc_guard_init(uint32_t *start,
+                                                            uint32_t *stop) {
+    if (start == stop || *start) {
+        return;
+    }
+    for (uint32_t *guard = start; guard < stop; guard++) {
+        *guard = 1 + nutest_fuzz_coverage.guards++ % (FUZZ_MAP_SIZE - 1);
+    }
+}
+
+NUTEST_NO_COVERAGE void __sanitizer_cov_trace_pc_guard(uint32_t *guard) {
+    uint8_t *hit = &nutest_fuzz_coverage.hits[*guard];
+
+    *hit += *hit != UINT8_MAX;
+}
+
+// gcc only reports blocks, pair each with the one before to get edges
+NUTEST_NO_COVERAGE void __sanitizer_cov_trace_pc(void) {
+    uintptr_t pc = (uintptr_t)__builtin_return_address(0);
+    uintptr_t block = (pc ^ (pc >> 15)) * 0x9e3779b1u;
+    uint8_t *hit = &nutest_fuzz_coverage
+                        .hits[(block ^ nutest_fuzz_coverage.previous) &
+                              (FUZZ_MAP_SIZE - 1)];
+
+    nutest_fuzz_coverage.previous = block >> 1;
+    *hit += *hit != UINT8_MAX;
+}
+
+#ifdef __cplusplus
+}
+#endif
+#endif
+
+// Test registration
+//
+// On ELF targets each test is a static TestCase placed in the nutest_tests
+// section and found through the linker's __start_/__stop_ symbols, so
+// registration costs no constructors and no allocations. Elsewhere, or with
+// NUTEST_NO_SECTIONS defined, a constructor appends it to the registry.
+#if !defined(NUTEST_NO_SECTIONS) && defined(__ELF__) && defined(__GNUC__)
+#define NUTEST_USE_SECTIONS 1
+#else
+#define NUTEST_USE_SECTIONS 0
+#endif
+
+#if NUTEST_USE_SECTIONS
+extern TestCase __start_nutest_tests[] __attribute__((weak));
+extern TestCase __stop_nutest_tests[] __attribute__((weak));
+
+#define NUTEST_REGISTER(                                      \
+    test_suite_name, test_name, description, timeout, fuzz)   \
+    static TestResult test_suite_name##_##test_name(void);    \
+    static TestCase test_case_##test_suite_name##_##test_name \
+        __attribute__((used,                                  \
+                       section("nutest_tests"),               \
+                       aligned(__alignof__(TestCase)))) = {   \
+            #test_name,                                       \
+            test_suite_name##_##test_name,                    \
+            #test_suite_name,                                 \
+            description,                                      \
+            __FILE__,                                         \
+            __LINE__,                                         \
+            timeout,                                          \
+            fuzz};                                            \
+    static TestResult test_suite_name##_##test_name(void)
+#else
+#define NUTEST_REGISTER(                                            \
+    test_suite_name, test_name, description, timeout, fuzz)         \
     static TestResult test_suite_name##_##test_name(void);          \
     __attribute__((constructor)) static void                        \
     register_##test_suite_name##_##test_name(void) {                \
         static TestCase test_case = {#test_name,                    \
                                      test_suite_name##_##test_name, \
                                      #test_suite_name,              \
-                                     NULL};                         \
+                                     description,                   \
+                                     __FILE__,                      \
+                                     __LINE__,                      \
+                                     timeout,                       \
+                                     fuzz};                         \
         register_test_case(&test_case);                             \
     }                                                               \
     static TestResult test_suite_name##_##test_name(void)
+#endif
+
+// Test registration macros
+#define TEST_F(test_suite_name, test_name) \
+    NUTEST_REGISTER(test_suite_name, test_name, NULL, 0, NULL)
 
 #define TEST(test_suite_name, test_name) TEST_F(test_suite_name, test_name)
 
-#define TEST_F_DESC(test_suite_name, test_name, description)        \
-    static TestResult test_suite_name##_##test_name(void);          \
-    __attribute__((constructor)) static void                        \
-    register_##test_suite_name##_##test_name(void) {                \
-        static TestCase test_case = {#test_name,                    \
-                                     test_suite_name##_##test_name, \
-                                     #test_suite_name,              \
-                                     description};                  \
-        register_test_case(&test_case);                             \
-    }                                                               \
-    static TestResult test_suite_name##_##test_name(void)
+#define TEST_F_DESC(test_suite_name, test_name, description) \
+    NUTEST_REGISTER(test_suite_name, test_name, description, 0, NULL)
 
-// Skip test macro
-#define SKIP() return TEST_SKIP
+// Test with its own timeout in milliseconds, overriding --timeout
+#define TEST_F_TIMEOUT(test_suite_name, test_name, timeout_ms) \
+    NUTEST_REGISTER(test_suite_name, test_name, NULL, timeout_ms, NULL)
 
-// Benchmarking macros
-#define BENCHMARK_START(name)                               \
-    struct timespec _bench_start_##name, _bench_end_##name; \
-    clock_gettime(CLOCK_MONOTONIC, &_bench_start_##name)
-
-#define BENCHMARK_END(name)                                               \
-    clock_gettime(CLOCK_MONOTONIC, &_bench_end_##name);                   \
-    double _bench_time_##name =                                           \
-        (_bench_end_##name.tv_sec - _bench_start_##name.tv_sec) +         \
-        (_bench_end_##name.tv_nsec - _bench_start_##name.tv_nsec) / 1e9;  \
-    printf("[ " COLOR_CYAN "BENCH" COLOR_RESET "   ] %s: %.9f seconds\n", \
-           #name,                                                         \
-           _bench_time_##name)
+// Fixture hooks, registered like tests. Each returns TEST_PASS once done,
+// the state it builds lives in variables of the suite's source file:
+//
+//     static Table *table;
+//
+//     SUITE_SETUP(Lookup) {
+//         table = load_table("words.tsv");
+//         return table ? TEST_PASS : TEST_ERROR;
+//     }
+//
+//     SUITE_TEARDOWN(Lookup) {
+//         free_table(table);
+//         return TEST_PASS;
+//     }
+//
+// SUITE_SETUP runs once, in the runner's process, before the suite's first
+// test; tests forked into workers see what it built. The tests of a suite
+// whose setup fails or skips are not run. TEST_SETUP runs before each test
+// of the suite, and TEST_TEARDOWN after each one whose setup passed.
+#if NUTEST_USE_SECTIONS
+extern TestFixture __start_nutest_fixtures[] __attribute__((weak));
+extern TestFixture __stop_nutest_fixtures[] __attribute__((weak));
 
-#define BENCHMARK_FUNCTION(func, name, iterations)           \
-    do {                                                     \
-        BENCHMARK_START(name);                               \
-        for (int _iter = 0; _iter < (iterations); _iter++) { \
-            func;                                            \
-        }                                                    \
-        BENCHMARK_END(name);                                 \
-    } while (0)
+#define NUTEST_REGISTER_FIXTURE(test_suite_name, kind, hook)   \
+    static TestResult hook##_##test_suite_name(void);          \
+    static TestFixture fixture_##hook##_##test_suite_name      \
+        __attribute__((used,                                   \
+                       section("nutest_fixtures"),             \
+                       aligned(__alignof__(TestFixture)))) = { \
+            #test_suite_name,                                  \
+            kind,                                              \
+            hook##_##test_suite_name,                          \
+            __FILE__,                                          \
+            __LINE__};                                         \
+    static TestResult hook##_##test_suite_name(void)
+#else
+#define NUTEST_REGISTER_FIXTURE(test_suite_name, kind, hook)    \
+    static TestResult hook##_##test_suite_name(void);           \
+    __attribute__((constructor)) static void                    \
+    register_##hook##_##test_suite_name(void) {                 \
+        static TestFixture fixture = {#test_suite_name,         \
+                                      kind,                     \
+                                      hook##_##test_suite_name, \
+                                      __FILE__,                 \
+                                      __LINE__};                \
+        register_test_fixture(&fixture);                        \
+    }                                                           \
+    static TestResult hook##_##test_suite_name(void)
+#endif
 
-// Test registration function
-static void register_test_case(TestCase *test_case) {
-    // Find or create the test suite
-    TestSuite *suite = NULL;
-    for (size_t i = 0; i < test_registry.suite_count; i++) {
-        if (strcmp(test_registry.suites[i].name, test_case->suite_name) == 0) {
-            suite = &test_registry.suites[i];
-            break;
-        }
-    }
+#define SUITE_SETUP(test_suite_name) \
+    NUTEST_REGISTER_FIXTURE(test_suite_name, FIXTURE_SUITE_SETUP, suite_setup)
 
-    if (!suite) {
-        // Create new suite
-        test_registry.suite_count++;
-        test_registry.suites =
-            (TestSuite *)realloc(test_registry.suites,
-                                 test_registry.suite_count * sizeof(TestSuite));
-        suite = &test_registry.suites[test_registry.suite_count - 1];
-        *suite = (TestSuite){test_case->suite_name, NULL, 0, NULL};
-    }
+#define SUITE_TEARDOWN(test_suite_name) \
+    NUTEST_REGISTER_FIXTURE(            \
+        test_suite_name, FIXTURE_SUITE_TEARDOWN, suite_teardown)
 
-    // Add test to suite
-    suite->test_count++;
-    suite->tests =
-        (TestCase *)realloc(suite->tests, suite->test_count * sizeof(TestCase));
-    suite->tests[suite->test_count - 1] = *test_case;
-}
+#define TEST_SETUP(test_suite_name) \
+    NUTEST_REGISTER_FIXTURE(test_suite_name, FIXTURE_TEST_SETUP, test_setup)
 
-// Test runner
-static int RUN_ALL_TESTS(void) {
-    printf("[=========] Running %zu test suites\n", test_registry.suite_count);
+#define TEST_TEARDOWN(test_suite_name) \
+    NUTEST_REGISTER_FIXTURE(           \
+        test_suite_name, FIXTURE_TEST_TEARDOWN, test_teardown)
 
-    size_t total_tests = 0;
-    size_t total_passed = 0;
-    size_t total_failed = 0;
-    size_t total_skipped = 0;
-    size_t total_errors = 0;
+// Scratch memory of the running test, aligned for any type and released all
+// at once when the test ends, so blocks need no free and cannot outlive it;
+// NULL when out of memory. TEST_SETUP may allocate from it too.
+NUTEST_API void *test_arena_alloc(size_t size);
 
-    for (size_t i = 0; i < test_registry.suite_count; i++) {
-        TestSuite *suite = &test_registry.suites[i];
-        printf(
-            "[---------] %zu tests from %s\n", suite->test_count, suite->name);
+NUTEST_API TestResult run_fuzz_corpus(const char *name,
+                                      FuzzFunc fuzz,
+                                      const char *file,
+                                      int line);
 
-        size_t suite_passed = 0;
-        size_t suite_failed = 0;
-        size_t suite_skipped = 0;
-        size_t suite_errors = 0;
+// Fuzz target, declared with its parameters:
+//   FUZZ_TEST(Parser, Json, const uint8_t *data, size_t size) { ... }
+// A normal run tests it on every input saved in its corpus directory,
+// --fuzz mutates those inputs guided by coverage
+#define FUZZ_TEST(test_suite_name, test_name, ...)                       \
+    static TestResult fuzz_##test_suite_name##_##test_name(__VA_ARGS__); \
+    NUTEST_REGISTER(test_suite_name,                                     \
+                    test_name,                                           \
+                    NULL,                                                \
+                    0,                                                   \
+                    fuzz_##test_suite_name##_##test_name) {              \
+        return run_fuzz_corpus(#test_suite_name "." #test_name,          \
+                               fuzz_##test_suite_name##_##test_name,     \
+                               __FILE__,                                 \
+                               __LINE__);                                \
+    }                                                                    \
+    static TestResult fuzz_##test_suite_name##_##test_name(__VA_ARGS__)
 
-        for (size_t j = 0; j < suite->test_count; j++) {
-            TestCase *test = &suite->tests[j];
-            printf("[ RUN     ] %s.%s\n", suite->name, test->name);
+NUTEST_API TestResult run_property(const char *name,
+                                   PropFunc body,
+                                   size_t cases,
+                                   int table,
+                                   const char *file,
+                                   int line);
 
-            TestResult result = test->function();
+// Property test, the body receives `prop` to draw values from. It runs on
+// --prop-cases generated cases; the first failing one is shrunk and
+// reported with the seed that reproduces it.
+#define PROPERTY(test_suite_name, test_name)                                 \
+    static TestResult prop_##test_suite_name##_##test_name(PropState *prop); \
+    NUTEST_REGISTER(test_suite_name, test_name, NULL, 0, NULL) {             \
+        return run_property(#test_suite_name "." #test_name,                 \
+                            prop_##test_suite_name##_##test_name,            \
+                            0,                                               \
+                            0,                                               \
+                            __FILE__,                                        \
+                            __LINE__);                                       \
+    }                                                                        \
+    static TestResult prop_##test_suite_name##_##test_name(PropState *prop)
 
-            switch (result) {
-            case TEST_PASS:
-                printf("[ " COLOR_GREEN "PASS" COLOR_RESET "    ] %s.%s\n",
-                       suite->name,
-                       test->name);
-                suite_passed++;
-                break;
-            case TEST_FAIL:
-                printf("[ " COLOR_RED "FAIL" COLOR_RESET "    ] %s.%s\n",
-                       suite->name,
-                       test->name);
-                suite_failed++;
-                break;
-            case TEST_SKIP:
-                printf("[ " COLOR_YELLOW "SKIP" COLOR_RESET "    ] %s.%s\n",
-                       suite->name,
-                       test->name);
-                suite_skipped++;
-                break;
-            case TEST_ERROR:
-                printf("[ " COLOR_MAGENTA "ERROR" COLOR_RESET "   ] %s.%s\n",
-                       suite->name,
-                       test->name);
-                suite_errors++;
-                break;
-            }
-        }
+// Parameterized test, the body runs once for every prop->index below cases,
+// e.g. once per row of a table, and each failing case is reported
+#define TEST_P(test_suite_name, test_name, cases)                            \
+    static TestResult prop_##test_suite_name##_##test_name(PropState *prop); \
+    NUTEST_REGISTER(test_suite_name, test_name, NULL, 0, NULL) {             \
+        return run_property(#test_suite_name "." #test_name,                 \
+                            prop_##test_suite_name##_##test_name,            \
+                            cases,                                           \
+                            1,                                               \
+                            __FILE__,                                        \
+                            __LINE__);                                       \
+    }                                                                        \
+    static TestResult prop_##test_suite_name##_##test_name(PropState *prop)
 
-        printf("[---------] %zu tests from %s (%d ms total)\n\n",
-               suite->test_count,
-               suite->name,
-               0);
+// Skip test macro
+#define SKIP() return TEST_SKIP
 
-        total_tests += suite->test_count;
-        total_passed += suite_passed;
-        total_failed += suite_failed;
-        total_skipped += suite_skipped;
-        total_errors += suite_errors;
-    }
+#if NUTEST_RUNNER
+// Monotonic clock in nanoseconds
+static uint64_t test_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
 
-    printf("[=========] %zu tests from %zu test suites ran.\n",
-           total_tests,
-           test_registry.suite_count);
+static void load_test_config(void);
 
-    if (total_passed > 0) {
-        printf("[ " COLOR_GREEN "PASSED" COLOR_RESET "  ] %zu tests.\n",
-               total_passed);
-    }
-    if (total_failed > 0) {
-        printf("[ " COLOR_RED "FAILED" COLOR_RESET "  ] %zu tests.\n",
-               total_failed);
-    }
-    if (total_skipped > 0) {
-        printf("[ " COLOR_YELLOW "SKIPPED" COLOR_RESET " ] %zu tests.\n",
-               total_skipped);
-    }
-    if (total_errors > 0) {
-        printf("[ " COLOR_MAGENTA "ERRORS" COLOR_RESET "  ] %zu tests.\n",
-               total_errors);
+// Color escape for console output, empty when color is off
+static const char *test_color(const char *code) {
+    load_test_config();
+    if (test_config.color < 0) {
+        const char *term = getenv("TERM");
+        test_config.color = isatty(STDOUT_FILENO) && !getenv("NO_COLOR") &&
+                            !(term && strcmp(term, "dumb") == 0);
     }
+    return test_config.color ? code : "";
+}
+
+// Print a "[ LABEL   ] " status column
+static void print_test_label(FILE *out, const char *color, const char *label) {
+    fprintf(out,
+            "[ %s%s%s%*s] ",
+            test_color(color),
+            label,
+            test_color(COLOR_RESET),
+            (int)(8 - strlen(label)),
+            "");
+}
 
-    return (total_failed == 0 && total_errors == 0) ? EXIT_SUCCESS
-                                                    : EXIT_FAILURE;
+// Open a temporary file to be renamed over path once written, named after
+// this process so concurrent runs never write the same one
+static FILE *open_test_temp(const char *path, char *temp, size_t size) {
+    snprintf(temp, size, "%s.%ld.tmp", path, (long)getpid());
+    return fopen(temp, "w");
 }
 
+// Hardware counters, enabled with --bench-counters; "extended" adds L1d and
+// LLC load events in a second group since one group rarely fits them all
+#ifdef __linux__
+typedef struct {
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+    int group;
+} PerfEvent;
+
+#define PERF_CACHE_EVENT(cache, result) \
+    ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | ((result) << 16))
+
+static const PerfEvent perf_events[PERF_MAX_EVENTS] = {
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, 0},
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, 0},
+    {"cache-references",
+     PERF_TYPE_HARDWARE,
+     PERF_COUNT_HW_CACHE_REFERENCES,
+     0},
+    {"cache-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, 0},
+    {"branches", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS, 0},
+    {"branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, 0},
+    {"L1d-loads",
+     PERF_TYPE_HW_CACHE,
+     PERF_CACHE_EVENT(PERF_COUNT_HW_CACHE_L1D,
+                      PERF_COUNT_HW_CACHE_RESULT_ACCESS),
+     1},
+    {"L1d-load-misses",
+     PERF_TYPE_HW_CACHE,
+     PERF_CACHE_EVENT(PERF_COUNT_HW_CACHE_L1D,
+                      PERF_COUNT_HW_CACHE_RESULT_MISS),
+     1},
+    {"LLC-loads",
+     PERF_TYPE_HW_CACHE,
+     PERF_CACHE_EVENT(PERF_COUNT_HW_CACHE_LL,
+                      PERF_COUNT_HW_CACHE_RESULT_ACCESS),
+     1},
+    {"LLC-load-misses",
+     PERF_TYPE_HW_CACHE,
+     PERF_CACHE_EVENT(PERF_COUNT_HW_CACHE_LL, PERF_COUNT_HW_CACHE_RESULT_MISS),
+     1},
+};
+
+static int open_perf_event(const PerfEvent *event, int group_fd) {
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = event->type;
+    attr.config = event->config;
+    attr.disabled = group_fd == -1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                       PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+#endif
+
+// Tell once why counters are missing, then fall back to time only
+static void warn_perf_unavailable(void) {
+    static int warned = 0;
+    const char *reason = strerror(errno);
+    char paranoid[16] = "?";
+    FILE *file;
+
+    if (warned) {
+        return;
+    }
+    warned = 1;
+    if ((file = fopen("/proc/sys/kernel/perf_event_paranoid", "r"))) {
+        if (fscanf(file, "%15s", paranoid) != 1) {
+            strcpy(paranoid, "?");
+        }
+        fclose(file);
+    }
+    print_test_label(stderr, COLOR_YELLOW, "WARN");
+    fprintf(stderr,
+            "hardware counters unavailable (%s, perf_event_paranoid %s), "
+            "reporting time only\n",
+            reason,
+            paranoid);
+}
+
+// Open the counter groups if counters are enabled, returns -1 otherwise
+static int perf_counters_open(PerfCounters *counters) {
+    memset(counters, 0, sizeof(*counters));
+    for (size_t g = 0; g < PERF_MAX_GROUPS; g++) {
+        counters->leaders[g] = -1;
+    }
+
+    load_test_config();
+    if (!test_config.bench_counters) {
+        return -1;
+    }
+
+#ifdef __linux__
+    for (size_t i = 0; i < PERF_MAX_EVENTS; i++) {
+        const PerfEvent *event = &perf_events[i];
+        int group = event->group;
+        int fd;
+
+        if (group > 0 && test_config.bench_counters < 2) {
+            break;
+        }
+        fd = open_perf_event(event, counters->leaders[group]);
+        if (fd < 0) {
+            if (i == 0) {
+                warn_perf_unavailable();
+                return -1;
+            }
+            continue;
+        }
+        if (counters->leaders[group] == -1) {
+            counters->leaders[group] = fd;
+        }
+        counters->fds[counters->count] = fd;
+        counters->groups[counters->count] = group;
+        counters->events[counters->count] = i;
+        counters->count++;
+    }
+    return 0;
+#else
+    errno = ENOSYS;
+    warn_perf_unavailable();
+    return -1;
+#endif
+}
+
+static void perf_counters_close(PerfCounters *counters) {
+    for (size_t i = 0; i < counters->count; i++) {
+        close(counters->fds[i]);
+    }
+    counters->count = 0;
+}
+
+static void perf_counters_start(PerfCounters *counters) {
+#ifdef __linux__
+    for (size_t g = 0; g < PERF_MAX_GROUPS; g++) {
+        if (counters->leaders[g] >= 0) {
+            ioctl(counters->leaders[g],
+                  PERF_EVENT_IOC_RESET,
+                  PERF_IOC_FLAG_GROUP);
+            ioctl(counters->leaders[g],
+                  PERF_EVENT_IOC_ENABLE,
+                  PERF_IOC_FLAG_GROUP);
+        }
+    }
+#else
+    (void)counters;
+#endif
+}
+
+// Stop counting and add the region's counts, scaled for multiplexing
+static void perf_counters_stop(PerfCounters *counters) {
+#ifdef __linux__
+    for (size_t g = 0; g < PERF_MAX_GROUPS; g++) {
+        uint64_t data[3 + PERF_MAX_EVENTS];
+        size_t member = 0;
+
+        if (counters->leaders[g] < 0) {
+            continue;
+        }
+        ioctl(
+            counters->leaders[g], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+        if (read(counters->leaders[g], data, sizeof(data)) <
+                (ssize_t)(3 * sizeof(uint64_t)) ||
+            data[2] == 0) {
+            continue;
+        }
+        for (size_t i = 0; i < counters->count && member < data[0]; i++) {
+            if (counters->groups[i] != (int)g) {
+                continue;
+            }
+            counters->totals[i] +=
+                (double)data[3 + member++] * (double)data[1] / (double)data[2];
+            counters->scheduled[i] = 1;
+        }
+    }
+#else
+    (void)counters;
+#endif
+}
+
+// Counter total of an event per unit, negative if it was not counted
+static double perf_counter_value(const PerfCounters *counters,
+                                 const char *name,
+                                 double divisor) {
+#ifdef __linux__
+    for (size_t i = 0; i < counters->count; i++) {
+        if (counters->scheduled[i] &&
+            strcmp(perf_events[counters->events[i]].name, name) == 0) {
+            return counters->totals[i] / divisor;
+        }
+    }
+#else
+    (void)counters;
+    (void)name;
+    (void)divisor;
+#endif
+    return -1.0;
+}
+
+// Print counters per unit with IPC and miss rates
+static void print_perf_counters(const char *name,
+                                const PerfCounters *counters,
+                                double divisor,
+                                const char *unit) {
+    static const char *const ratios[][2] = {
+        {"cache-misses", "cache-references"},
+        {"branch-misses", "branches"},
+        {"L1d-load-misses", "L1d-loads"},
+        {"LLC-load-misses", "LLC-loads"},
+    };
+    double cycles = perf_counter_value(counters, "cycles", divisor);
+    double instructions = perf_counter_value(counters, "instructions", divisor);
+
+    if (counters->count == 0) {
+        return;
+    }
+
+    print_test_label(stdout, COLOR_CYAN, "PERF");
+    printf("%s:", name);
+    if (cycles > 0 && instructions >= 0) {
+        printf(" IPC %.2f,", instructions / cycles);
+    }
+#ifdef __linux__
+    for (size_t i = 0; i < counters->count; i++) {
+        const char *event = perf_events[counters->events[i]].name;
+        double value = perf_counter_value(counters, event, divisor);
+
+        if (value < 0) {
+            printf(" %s n/a", event);
+        } else {
+            printf(" %s %.2f", event, value);
+            for (size_t r = 0; r < sizeof(ratios) / sizeof(ratios[0]); r++) {
+                double total;
+                if (strcmp(ratios[r][0], event) == 0 &&
+                    (total = perf_counter_value(
+                         counters, ratios[r][1], divisor)) > 0) {
+                    printf(" (%.2f%%)", 100.0 * value / total);
+                }
+            }
+        }
+        printf(i + 1 < counters->count ? "," : "");
+    }
+#endif
+    printf(" %s\n", unit);
+}
+#endif
+
+// Timed region of BENCHMARK_START/BENCHMARK_END
+typedef struct {
+    struct timespec start;
+    PerfCounters counters;
+} BenchRegion;
+
+NUTEST_API void bench_region_begin(BenchRegion *region);
+NUTEST_API void bench_region_end(BenchRegion *region, const char *name);
+
+#if NUTEST_RUNNER
+NUTEST_API void bench_region_begin(BenchRegion *region) {
+    if (perf_counters_open(&region->counters) == 0) {
+        perf_counters_start(&region->counters);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &region->start);
+}
+
+NUTEST_API void bench_region_end(BenchRegion *region, const char *name) {
+    struct timespec end;
+    double seconds;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    perf_counters_stop(&region->counters);
+    seconds = (double)(end.tv_sec - region->start.tv_sec) +
+              (double)(end.tv_nsec - region->start.tv_nsec) / 1e9;
+    print_test_label(stdout, COLOR_CYAN, "BENCH");
+    printf("%s: %.9f seconds\n", name, seconds);
+    print_perf_counters(name, &region->counters, 1.0, "total");
+    perf_counters_close(&region->counters);
+}
+#endif
+
+// Benchmarking macros
+#define BENCHMARK_START(name)         \
+    BenchRegion _bench_region_##name; \
+    bench_region_begin(&_bench_region_##name)
+
+#define BENCHMARK_END(name) bench_region_end(&_bench_region_##name, #name)
+
+#define BENCHMARK_FUNCTION(func, name, iterations)           \
+    do {                                                     \
+        BENCHMARK_START(name);                               \
+        for (int _iter = 0; _iter < (iterations); _iter++) { \
+            func;                                            \
+            CLOBBER_MEMORY();                                \
+        }                                                    \
+        BENCHMARK_END(name);                                 \
+    } while (0)
+
+// Optimizer barriers: DO_NOT_OPTIMIZE forces a value to be materialized,
+// CLOBBER_MEMORY forces pending writes to memory to be performed
+#define DO_NOT_OPTIMIZE(value) \
+    __asm__ __volatile__("" : : "r,m"(value) : "memory")
+
+#define CLOBBER_MEMORY() __asm__ __volatile__("" : : : "memory")
+
+// Out of line parts of the benchmark loop
+__attribute__((noinline)) NUTEST_API void bench_start_timing(BenchState *state);
+__attribute__((noinline)) NUTEST_API void bench_stop_timing(BenchState *state);
+__attribute__((noinline)) NUTEST_API int bench_next_latency(BenchState *state);
+
+#if NUTEST_RUNNER
+// Wait for every thread, returns the time the last one arrived. The thread
+// releasing the others reads the clock for all of them, so a thread that is
+// descheduled on its way out still measures from the common release.
+static uint64_t wait_bench_barrier(BenchBarrier *barrier) {
+    size_t phase = __atomic_load_n(&barrier->phase, __ATOMIC_ACQUIRE);
+
+    if (__atomic_add_fetch(&barrier->waiting, 1, __ATOMIC_ACQ_REL) ==
+        __atomic_load_n(&barrier->count, __ATOMIC_ACQUIRE)) {
+        uint64_t now = test_now_ns();
+
+        __atomic_store_n(&barrier->released_ns, now, __ATOMIC_RELAXED);
+        __atomic_store_n(&barrier->waiting, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&barrier->phase, phase + 1, __ATOMIC_RELEASE);
+        return now;
+    }
+    while (__atomic_load_n(&barrier->phase, __ATOMIC_ACQUIRE) == phase) {
+        sched_yield();
+    }
+    // Not overwritten before this thread reaches the barrier again
+    return __atomic_load_n(&barrier->released_ns, __ATOMIC_RELAXED);
+}
+
+// Threads of a threaded benchmark start together, and the run lasts from
+// their release at the start line until the last of them is done
+__attribute__((noinline)) NUTEST_API void
+bench_start_timing(BenchState *state) {
+    if (state->barrier) {
+        state->released_ns = wait_bench_barrier(state->barrier);
+    }
+    state->started = 1;
+    if (state->counters) {
+        perf_counters_start(state->counters);
+    }
+    state->start_ns = test_now_ns();
+}
+
+__attribute__((noinline)) NUTEST_API void
+bench_stop_timing(BenchState *state) {
+    state->elapsed_ns = test_now_ns() - state->start_ns;
+    if (state->counters) {
+        perf_counters_stop(state->counters);
+    }
+    if (state->barrier) {
+        state->wall_ns =
+            wait_bench_barrier(state->barrier) - state->released_ns;
+    }
+}
+
+// Clock of latency benchmarks: the cycle counter when it ticks at a constant
+// rate, CLOCK_MONOTONIC otherwise
+typedef struct {
+    int calibrated;
+    int cycles;
+    double ns_per_tick;
+    uint64_t overhead_ticks;
+    double overhead_ns;
+} BenchClock;
+
+static BenchClock bench_clock = {0, 0, 1.0, 0, 0.0};
+
+#if defined(__x86_64__) || defined(__i386__)
+#define NUTEST_CYCLE_COUNTER "rdtscp"
+#elif defined(__aarch64__)
+#define NUTEST_CYCLE_COUNTER "cntvct"
+#else
+#define NUTEST_CYCLE_COUNTER NULL
+#endif
+
+__attribute__((always_inline)) static inline uint64_t read_bench_cycles(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    uint32_t low, high, cpu;
+    __asm__ __volatile__("rdtscp" : "=a"(low), "=d"(high), "=c"(cpu));
+    return (uint64_t)high << 32 | low;
+#elif defined(__aarch64__)
+    uint64_t ticks;
+    __asm__ __volatile__("isb\n\tmrs %0, cntvct_el0" : "=r"(ticks));
+    return ticks;
+#else
+    return test_now_ns();
+#endif
+}
+
+__attribute__((always_inline)) static inline uint64_t read_bench_clock(void) {
+    return bench_clock.cycles ? read_bench_cycles() : test_now_ns();
+}
+
+static size_t bench_histogram_index(uint64_t ns) {
+    int shift;
+
+    if (ns < 2 * BENCH_HISTOGRAM_HALF) {
+        return (size_t)ns;
+    }
+    shift = 63 - __builtin_clzll(ns) - (BENCH_HISTOGRAM_BITS - 1);
+    return 2 * BENCH_HISTOGRAM_HALF +
+           (size_t)(shift - 1) * BENCH_HISTOGRAM_HALF +
+           (size_t)((ns >> shift) - BENCH_HISTOGRAM_HALF);
+}
+
+// Smallest and largest value of a bucket
+static uint64_t bench_histogram_lower(size_t index) {
+    size_t offset;
+
+    if (index < 2 * BENCH_HISTOGRAM_HALF) {
+        return index;
+    }
+    offset = index - 2 * BENCH_HISTOGRAM_HALF;
+    return (uint64_t)(offset % BENCH_HISTOGRAM_HALF + BENCH_HISTOGRAM_HALF)
+           << (offset / BENCH_HISTOGRAM_HALF + 1);
+}
+
+static uint64_t bench_histogram_upper(size_t index) {
+    if (index + 1 == BENCH_HISTOGRAM_BUCKETS) {
+        return UINT64_MAX;
+    }
+    return bench_histogram_lower(index + 1) - 1;
+}
+
+static void record_bench_latency(BenchHistogram *histogram, uint64_t ns) {
+    histogram->counts[bench_histogram_index(ns)]++;
+    if (histogram->total++ == 0 || ns < histogram->min) {
+        histogram->min = ns;
+    }
+    if (ns > histogram->max) {
+        histogram->max = ns;
+    }
+}
+
+// Latency mode: every loop check lands here and times the iteration that
+// just ended, minus the timer's own overhead
+__attribute__((noinline)) NUTEST_API int
+bench_next_latency(BenchState *state) {
+    uint64_t now = read_bench_clock();
+
+    if (state->started) {
+        uint64_t ticks = now - state->last_tick;
+        uint64_t ns;
+
+        ticks = ticks > bench_clock.overhead_ticks
+                    ? ticks - bench_clock.overhead_ticks
+                    : 0;
+        ns = (uint64_t)((double)ticks * bench_clock.ns_per_tick + 0.5);
+        state->elapsed_ns += ns;
+        if (state->histogram) {
+            record_bench_latency(state->histogram, ns);
+        }
+    } else {
+        state->started = 1;
+        if (state->counters) {
+            perf_counters_start(state->counters);
+        }
+    }
+    if (state->latency_left == 0) {
+        if (state->counters) {
+            perf_counters_stop(state->counters);
+        }
+        return 0;
+    }
+    state->latency_left--;
+    state->last_tick = read_bench_clock();
+    return 1;
+}
+#endif
+
+// Benchmark loop, times every iteration from the first check to the last:
+//
+//     BENCH(suite, name) {
+//         setup();
+//         while (bench_keep_running(state)) {
+//             DO_NOT_OPTIMIZE(work());
+//         }
+//     }
+__attribute__((always_inline)) static inline int
+bench_keep_running(BenchState *state) {
+    if (__builtin_expect(state->remaining > 0, 1)) {
+        if (__builtin_expect(!state->started, 0)) {
+            bench_start_timing(state);
+        }
+        state->remaining--;
+        return 1;
+    }
+    if (__builtin_expect(state->latency, 0)) {
+        return bench_next_latency(state);
+    }
+    bench_stop_timing(state);
+    return 0;
+}
+
+#define BENCH_LOOP(state) while (bench_keep_running(state))
+
+// Benchmark registration, same scheme as tests
+#if NUTEST_USE_SECTIONS
+extern BenchCase __start_nutest_benches[] __attribute__((weak));
+extern BenchCase __stop_nutest_benches[] __attribute__((weak));
+
+#define NUTEST_REGISTER_BENCH(                                                \
+    bench_suite_name, bench_name, start, limit, multiplier, threads, latency) \
+    static void bench_suite_name##_##bench_name##_bench(BenchState *);        \
+    static BenchCase bench_case_##bench_suite_name##_##bench_name             \
+        __attribute__((used,                                                  \
+                       section("nutest_benches"),                             \
+                       aligned(__alignof__(BenchCase)))) = {                  \
+            #bench_name,                                                      \
+            bench_suite_name##_##bench_name##_bench,                          \
+            #bench_suite_name,                                                \
+            __FILE__,                                                         \
+            __LINE__,                                                         \
+            start,                                                            \
+            limit,                                                            \
+            multiplier,                                                       \
+            threads,                                                          \
+            latency};                                                         \
+    static void bench_suite_name##_##bench_name##_bench(                      \
+        __attribute__((unused)) BenchState *state)
+#else
+#define NUTEST_REGISTER_BENCH(                                                \
+    bench_suite_name, bench_name, start, limit, multiplier, threads, latency) \
+    static void bench_suite_name##_##bench_name##_bench(BenchState *);        \
+    __attribute__((constructor)) static void                                  \
+    register_##bench_suite_name##_##bench_name##_bench(void) {                \
+        static BenchCase bench_case = {                                       \
+            #bench_name,                                                      \
+            bench_suite_name##_##bench_name##_bench,                          \
+            #bench_suite_name,                                                \
+            __FILE__,                                                         \
+            __LINE__,                                                         \
+            start,                                                            \
+            limit,                                                            \
+            multiplier,                                                       \
+            threads,                                                          \
+            latency};                                                         \
+        register_bench_case(&bench_case);                                     \
+    }                                                                         \
+    static void bench_suite_name##_##bench_name##_bench(                      \
+        __attribute__((unused)) BenchState *state)
+#endif
+
+#define BENCH(bench_suite_name, bench_name) \
+    NUTEST_REGISTER_BENCH(bench_suite_name, bench_name, 0, 0, 0, 0, 0)
+
+// Benchmark run once per value of a geometric range, from start up to and
+// including limit, each value multiplier times the previous; the body reads
+// the value from state->range
+#define BENCH_RANGE(bench_suite_name, bench_name, start, limit, multiplier) \
+    NUTEST_REGISTER_BENCH(                                                  \
+        bench_suite_name, bench_name, start, limit, multiplier, 0, 0)
+
+// Benchmark run on 1, 2, 4 ... max_threads threads at once, each pinned to
+// its own CPU, 0 for one thread per CPU; every thread runs the whole body
+// with its own state, state->thread_index tells them apart
+#define BENCH_THREADS(bench_suite_name, bench_name, max_threads)  \
+    NUTEST_REGISTER_BENCH(bench_suite_name,                       \
+                          bench_name,                             \
+                          0,                                      \
+                          0,                                      \
+                          0,                                      \
+                          (max_threads) > 0 ? (max_threads) : -1, \
+                          0)
+
+// Benchmark timing every iteration of its loop on its own, for latency
+// percentiles; the timer's overhead is measured and subtracted
+#define BENCH_LATENCY(bench_suite_name, bench_name) \
+    NUTEST_REGISTER_BENCH(bench_suite_name, bench_name, 0, 0, 0, 0, 1)
+
+// Entry points of the runner
+NUTEST_API void INIT_TESTS(int argc, char **argv);
+NUTEST_API int RUN_ALL_TESTS(void);
+NUTEST_API int RUN_ALL_BENCHMARKS(void);
+
+#if !NUTEST_USE_SECTIONS
+NUTEST_API void register_test_case(TestCase *test_case);
+NUTEST_API void register_bench_case(BenchCase *bench_case);
+NUTEST_API void register_test_fixture(TestFixture *fixture);
+#endif
+
+// Value generators of property tests
+NUTEST_API int64_t prop_int(PropState *prop, int64_t min, int64_t max);
+NUTEST_API uint64_t prop_uint(PropState *prop, uint64_t min, uint64_t max);
+NUTEST_API int prop_bool(PropState *prop);
+NUTEST_API double prop_double(PropState *prop, double min, double max);
+NUTEST_API size_t prop_pick(PropState *prop, size_t count);
+NUTEST_API const uint8_t *prop_bytes(PropState *prop,
+                                     size_t min,
+                                     size_t max,
+                                     size_t *size);
+NUTEST_API const char *prop_string(PropState *prop, size_t min, size_t max);
+
+// Page kinds of bench_alloc_huge
+typedef enum {
+    BENCH_PAGES_TRANSPARENT, // Transparent huge pages, when the kernel has them
+    BENCH_PAGES_EXPLICIT     // Reserved hugetlbfs pages, fails without them
+} BenchPages;
+
+// Control of the benchmark environment
+NUTEST_API int bench_pin_cpu(int cpu);
+NUTEST_API void bench_evict_caches(void);
+NUTEST_API void *bench_alloc_huge(size_t size, BenchPages pages);
+NUTEST_API void bench_free_huge(void *ptr, size_t size);
+
+#if NUTEST_RUNNER
+#if !NUTEST_USE_SECTIONS
+// Double a registry array, starting at initial records. Registration runs
+// in constructors before main, so running out of memory ends the program.
+static void *grow_registry(void *records,
+                           size_t *capacity,
+                           size_t initial,
+                           size_t size) {
+    size_t grown = *capacity ? *capacity * 2 : initial;
+    void *moved = realloc(records, grown * size);
+
+    if (!moved) {
+        fprintf(stderr, "nutest: out of memory registering tests\n");
+        exit(EXIT_FAILURE);
+    }
+    *capacity = grown;
+    return moved;
+}
+
+// Test registration function, used when tests are not in a linker section
+NUTEST_API void register_test_case(TestCase *test_case) {
+    if (test_registry.test_count == test_registry.capacity) {
+        test_registry.tests = (TestCase *)grow_registry(test_registry.tests,
+                                                        &test_registry.capacity,
+                                                        64,
+                                                        sizeof(TestCase));
+    }
+    test_registry.tests[test_registry.test_count++] = *test_case;
+}
+
+// Benchmark registration function
+NUTEST_API void register_bench_case(BenchCase *bench_case) {
+    if (bench_registry.bench_count == bench_registry.capacity) {
+        bench_registry.benches =
+            (BenchCase *)grow_registry(bench_registry.benches,
+                                       &bench_registry.capacity,
+                                       16,
+                                       sizeof(BenchCase));
+    }
+    bench_registry.benches[bench_registry.bench_count++] = *bench_case;
+}
+
+// Fixture registration function
+NUTEST_API void register_test_fixture(TestFixture *fixture) {
+    if (test_registry.fixture_count == test_registry.fixture_capacity) {
+        test_registry.fixtures =
+            (TestFixture *)grow_registry(test_registry.fixtures,
+                                         &test_registry.fixture_capacity,
+                                         16,
+                                         sizeof(TestFixture));
+    }
+    test_registry.fixtures[test_registry.fixture_count++] = *fixture;
+}
+#endif
+
+static int same_test_suite(const TestCase *a, const TestCase *b) {
+    return a->suite_name == b->suite_name ||
+           strcmp(a->suite_name, b->suite_name) == 0;
+}
+
+#define RECORD_AT(records, size, i) ((char *)(records) + (i) * (size))
+#define RECORD_FILE(record, offset) (*(const char **)((record) + (offset)))
+#define RECORD_LINE(record, offset) (*(const int *)((record) + (offset)))
+
+static void swap_records(char *a, char *b, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        char swap = a[i];
+        a[i] = b[i];
+        b[i] = swap;
+    }
+}
+
+// Put each file's records back in definition order, compilers are free to
+// emit section records in reverse. Works on any record type with file and
+// line members, given their offsets.
+static void order_records(void *records,
+                          size_t count,
+                          size_t size,
+                          size_t file_offset,
+                          size_t line_offset) {
+    for (size_t begin = 0, end; begin < count; begin = end) {
+        const char *file =
+            RECORD_FILE(RECORD_AT(records, size, begin), file_offset);
+
+        for (end = begin + 1; end < count; end++) {
+            const char *other =
+                RECORD_FILE(RECORD_AT(records, size, end), file_offset);
+            if (other != file && strcmp(other, file) != 0) {
+                break;
+            }
+        }
+
+        if (RECORD_LINE(RECORD_AT(records, size, begin), line_offset) >
+            RECORD_LINE(RECORD_AT(records, size, end - 1), line_offset)) {
+            for (size_t i = begin, j = end - 1; i < j; i++, j--) {
+                swap_records(RECORD_AT(records, size, i),
+                             RECORD_AT(records, size, j),
+                             size);
+            }
+        }
+
+        // Insertion sort, linear for the already ordered common case
+        for (size_t i = begin + 1; i < end; i++) {
+            for (size_t j = i;
+                 j > begin &&
+                 RECORD_LINE(RECORD_AT(records, size, j - 1), line_offset) >
+                     RECORD_LINE(RECORD_AT(records, size, j), line_offset);
+                 j--) {
+                swap_records(RECORD_AT(records, size, j - 1),
+                             RECORD_AT(records, size, j),
+                             size);
+            }
+        }
+    }
+}
+
+// Place of a test while grouping: its suite, where that suite first appears
+// and where the test itself is
+typedef struct {
+    const char *suite_name;
+    size_t first;
+    size_t index;
+} TestGroupKey;
+
+static int compare_test_suite_names(const void *a, const void *b) {
+    const TestGroupKey *x = (const TestGroupKey *)a;
+    const TestGroupKey *y = (const TestGroupKey *)b;
+    int order = x->suite_name == y->suite_name
+                    ? 0
+                    : strcmp(x->suite_name, y->suite_name);
+
+    if (order != 0) {
+        return order;
+    }
+    return (x->index > y->index) - (x->index < y->index);
+}
+
+static int compare_test_groups(const void *a, const void *b) {
+    const TestGroupKey *x = (const TestGroupKey *)a;
+    const TestGroupKey *y = (const TestGroupKey *)b;
+
+    if (x->first != y->first) {
+        return x->first < y->first ? -1 : 1;
+    }
+    return (x->index > y->index) - (x->index < y->index);
+}
+
+// Gather every suite into one contiguous run, keeping the order in which
+// suites and tests first appear. Sorting by suite name finds where each
+// suite first appears, sorting by that then gathers them in O(n log n).
+// Returns -1 when out of memory.
+static int group_test_cases(TestCase *tests, size_t count, size_t *suites) {
+    TestGroupKey *keys;
+    TestCase *grouped;
+
+    *suites = 0;
+    if (count == 0) {
+        return 0;
+    }
+    keys = (TestGroupKey *)malloc(count * sizeof(TestGroupKey));
+    grouped = (TestCase *)malloc(count * sizeof(TestCase));
+    if (!keys || !grouped) {
+        free(grouped);
+        free(keys);
+        return -1;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        keys[i].suite_name = tests[i].suite_name;
+        keys[i].index = i;
+    }
+    qsort(keys, count, sizeof(TestGroupKey), compare_test_suite_names);
+    for (size_t i = 0; i < count; i++) {
+        if (i == 0 || !same_test_suite(&tests[keys[i].index],
+                                       &tests[keys[i - 1].index])) {
+            keys[i].first = keys[i].index;
+            (*suites)++;
+        } else {
+            keys[i].first = keys[i - 1].first;
+        }
+    }
+    qsort(keys, count, sizeof(TestGroupKey), compare_test_groups);
+
+    for (size_t i = 0; i < count; i++) {
+        grouped[i] = tests[keys[i].index];
+    }
+    memcpy(tests, grouped, count * sizeof(TestCase));
+    free(grouped);
+    free(keys);
+    return 0;
+}
+
+// Duration of a registered test, for sorting; ties keep registry order
+typedef struct {
+    size_t index;
+    uint64_t duration_ns;
+} TestDuration;
+
+static int compare_test_durations(const void *a, const void *b) {
+    const TestDuration *x = (const TestDuration *)a;
+    const TestDuration *y = (const TestDuration *)b;
+
+    if (x->duration_ns != y->duration_ns) {
+        return x->duration_ns < y->duration_ns ? 1 : -1;
+    }
+    return (x->index > y->index) - (x->index < y->index);
+}
+
+// Full "Suite.name" of a test
+static const char *format_test_name(const TestCase *test,
+                                    char *buffer,
+                                    size_t size) {
+    snprintf(buffer, size, "%s.%s", test->suite_name, test->name);
+    return buffer;
+}
+
+// Match a glob of * and ? ending at end against the whole text
+static int match_test_glob(const char *pattern,
+                           const char *end,
+                           const char *text) {
+    const char *star = NULL;
+    const char *resume = NULL;
+
+    while (*text) {
+        if (pattern < end && (*pattern == '?' || *pattern == *text)) {
+            pattern++;
+            text++;
+        } else if (pattern < end && *pattern == '*') {
+            star = pattern++;
+            resume = text;
+        } else if (star) {
+            pattern = star + 1;
+            text = ++resume;
+        } else {
+            return 0;
+        }
+    }
+    while (pattern < end && *pattern == '*') {
+        pattern++;
+    }
+    return pattern == end;
+}
+
+// Whether any glob of a ':'-separated list matches
+static int match_test_globs(const char *begin,
+                            const char *end,
+                            const char *text) {
+    while (begin < end) {
+        const char *stop = (const char *)memchr(begin, ':', end - begin);
+        if (!stop) {
+            stop = end;
+        }
+        if (match_test_glob(begin, stop, text)) {
+            return 1;
+        }
+        begin = stop + 1;
+    }
+    return 0;
+}
+
+// gtest-style filter POSITIVE[-NEGATIVE] over "Suite.name", both parts
+// ':'-separated globs; an empty positive part selects every test
+static int match_test_filter(const char *filter, const char *name) {
+    const char *dash = strchr(filter, '-');
+    const char *end = dash ? dash : filter + strlen(filter);
+
+    if (end > filter && !match_test_globs(filter, end, name)) {
+        return 0;
+    }
+    return !dash || !match_test_globs(dash + 1, dash + strlen(dash), name);
+}
+
+// FNV-1a of a test name, stable across runs, builds and platforms
+static uint64_t hash_test_name(const char *name) {
+    uint64_t hash = UINT64_C(14695981039346656037);
+
+    for (; *name; name++) {
+        hash ^= (unsigned char)*name;
+        hash *= UINT64_C(1099511628211);
+    }
+    // The low bits only depend on the low bits of each byte, fold in the
+    // well mixed high half before it is taken modulo a shard count
+    return hash ^ (hash >> 32);
+}
+
+static int compare_test_names(const void *a, const void *b) {
+    const TestCase *x = *(const TestCase *const *)a;
+    const TestCase *y = *(const TestCase *const *)b;
+    int order = strcmp(x->suite_name, y->suite_name);
+    return order ? order : strcmp(x->name, y->name);
+}
+
+// bsearch comparison of a "Suite.name" key against a test, consistent with
+// compare_test_names for identifier names
+static int find_test_name(const void *key, const void *element) {
+    const char *name = (const char *)key;
+    const TestCase *test = *(const TestCase *const *)element;
+    size_t length = strlen(test->suite_name);
+    int order = strncmp(name, test->suite_name, length);
+
+    if (order) {
+        return order;
+    }
+    if (name[length] != '.') {
+        return name[length] ? 1 : -1;
+    }
+    return strcmp(name + length + 1, test->name);
+}
+
+// Read a durations file from --save-durations into recorded, indexed like
+// tests, leaving UINT64_MAX for tests it does not list. Files of several
+// shards may be concatenated, later entries win.
+static int load_test_durations(const char *path,
+                               const TestCase *tests,
+                               size_t count,
+                               uint64_t *recorded) {
+    const TestCase **order;
+    const TestCase **found;
+    char word[512];
+    unsigned long long duration;
+    FILE *file;
+
+    for (size_t i = 0; i < count; i++) {
+        recorded[i] = UINT64_MAX;
+    }
+    if (!(file = fopen(path, "r"))) {
+        return -1;
+    }
+    if (!(order = (const TestCase **)malloc((count ? count : 1) *
+                                            sizeof(const TestCase *)))) {
+        fclose(file);
+        return -1;
+    }
+    for (size_t i = 0; i < count; i++) {
+        order[i] = &tests[i];
+    }
+    qsort(order, count, sizeof(const TestCase *), compare_test_names);
+
+    while (fscanf(file, "%511s", word) == 1) {
+        if (strcmp(word, "nutest-durations") == 0) {
+            if (fscanf(file, "%*d") == EOF) {
+                break;
+            }
+        } else if (strcmp(word, "test") == 0 &&
+                   fscanf(file, "%511s %llu", word, &duration) == 2) {
+            found = (const TestCase **)bsearch(word,
+                                               order,
+                                               count,
+                                               sizeof(const TestCase *),
+                                               find_test_name);
+            if (found) {
+                recorded[*found - tests] = (uint64_t)duration;
+            }
+        } else {
+            break;
+        }
+    }
+
+    free(order);
+    fclose(file);
+    return 0;
+}
+
+// Write the durations of a run through a temporary file
+static int save_test_durations(const char *path, const uint64_t *durations) {
+    char temp[4096];
+    char name[512];
+    FILE *file;
+
+    if (!(file = open_test_temp(path, temp, sizeof(temp)))) {
+        return -1;
+    }
+    fprintf(file, "nutest-durations 1\n");
+    for (size_t i = 0; i < test_registry.test_count; i++) {
+        fprintf(file,
+                "test %s %llu\n",
+                format_test_name(&test_registry.tests[i], name, sizeof(name)),
+                (unsigned long long)durations[i]);
+    }
+    if (fclose(file) != 0 || rename(temp, path) != 0) {
+        remove(temp);
+        return -1;
+    }
+    return 0;
+}
+
+// Lower-case result names of reports and the run history
+static const char *const test_result_names[] = {
+    "pass", "fail", "skip", "error"};
+
+// Result of a test that did not run, in the results of a run
+#define TEST_NOT_RUN 0xff
+
+// Last result of a test in the run history
+typedef struct {
+    char *name;
+    unsigned char result;
+    unsigned char registered;
+    unsigned char written;
+    uint64_t duration_ns;
+} TestHistoryEntry;
+
+// Run history of this executable, sorted by name, and the sections of
+// other executables sharing the file, copied through verbatim
+typedef struct {
+    int loaded;
+    char build_id[128];
+    char path[4096];
+    TestHistoryEntry *entries;
+    size_t count;
+    size_t capacity;
+    size_t registered; // Tests registered, selected or not
+    char *others;
+    size_t others_size;
+} TestHistory;
+
+static TestHistory test_history;
+
+#if defined(__linux__) && defined(AT_PHDR) && defined(NT_GNU_BUILD_ID)
+#if UINTPTR_MAX > 0xffffffffu
+typedef Elf64_Phdr TestElfPhdr;
+#else
+typedef Elf32_Phdr TestElfPhdr;
+#endif
+
+// Hex GNU build ID of the running executable, read from its note segments
+// in memory; returns 0 without one
+static int read_test_build_id(char *buffer, size_t size) {
+    const TestElfPhdr *phdrs = (const TestElfPhdr *)getauxval(AT_PHDR);
+    size_t count = (size_t)getauxval(AT_PHNUM);
+    uintptr_t base = 0;
+    int found = 0;
+
+    for (size_t i = 0; phdrs && i < count; i++) {
+        if (phdrs[i].p_type == PT_PHDR) {
+            base = (uintptr_t)phdrs - (uintptr_t)phdrs[i].p_vaddr;
+            found = 1;
+        }
+    }
+    for (size_t i = 0; found && i < count; i++) {
+        const char *note = (const char *)(base + phdrs[i].p_vaddr);
+        const char *end = note + phdrs[i].p_memsz;
+        size_t align = phdrs[i].p_align == 8 ? 8 : 4;
+
+        if (phdrs[i].p_type != PT_NOTE) {
+            continue;
+        }
+        while (note + sizeof(Elf32_Nhdr) <= end) {
+            const Elf32_Nhdr *header = (const Elf32_Nhdr *)note;
+            const unsigned char *name = (const unsigned char *)(header + 1);
+            const unsigned char *desc =
+                name + ((header->n_namesz + align - 1) & ~(align - 1));
+
+            if (header->n_type == NT_GNU_BUILD_ID && header->n_namesz == 4 &&
+                memcmp(name, "GNU", 4) == 0 &&
+                (const char *)desc + header->n_descsz <= end &&
+                header->n_descsz > 0 && 2 * header->n_descsz < size) {
+                for (size_t j = 0; j < header->n_descsz; j++) {
+                    snprintf(buffer + 2 * j, 3, "%02x", desc[j]);
+                }
+                return 1;
+            }
+            note = (const char *)desc +
+                   ((header->n_descsz + align - 1) & ~(align - 1));
+        }
+    }
+    return 0;
+}
+#else
+static int read_test_build_id(char *buffer, size_t size) {
+    (void)buffer;
+    (void)size;
+    return 0;
+}
+#endif
+
+static int compare_test_history(const void *a, const void *b) {
+    return strcmp(((const TestHistoryEntry *)a)->name,
+                  ((const TestHistoryEntry *)b)->name);
+}
+
+// History entry of a test, or NULL when the history has none
+static TestHistoryEntry *find_test_history(const TestCase *test) {
+    TestHistoryEntry key;
+    char name[512];
+
+    if (test_history.count == 0) {
+        return NULL;
+    }
+    key.name = (char *)format_test_name(test, name, sizeof(name));
+    return (TestHistoryEntry *)bsearch(&key,
+                                       test_history.entries,
+                                       test_history.count,
+                                       sizeof(TestHistoryEntry),
+                                       compare_test_history);
+}
+
+// Append a line to the sections of other executables
+static int keep_test_history_line(const char *line) {
+    size_t length = strlen(line);
+    char *others = (char *)realloc(test_history.others,
+                                   test_history.others_size + length + 1);
+
+    if (!others) {
+        return -1;
+    }
+    memcpy(others + test_history.others_size, line, length + 1);
+    test_history.others = others;
+    test_history.others_size += length;
+    return 0;
+}
+
+// Add a "test NAME RESULT NS" line of this executable's section
+static int add_test_history(const char *line) {
+    TestHistoryEntry *entry;
+    char name[512], result[16];
+    unsigned long long duration;
+    size_t r;
+
+    if (sscanf(line, "test %511s %15s %llu", name, result, &duration) != 3) {
+        return 0;
+    }
+    for (r = 0; r < 4 && strcmp(result, test_result_names[r]) != 0; r++) {
+    }
+    if (r == 4) {
+        return 0;
+    }
+    if (test_history.count == test_history.capacity) {
+        size_t capacity = test_history.capacity ? test_history.capacity * 2
+                                                : 64;
+        entry = (TestHistoryEntry *)realloc(
+            test_history.entries, capacity * sizeof(TestHistoryEntry));
+        if (!entry) {
+            return -1;
+        }
+        test_history.entries = entry;
+        test_history.capacity = capacity;
+    }
+    entry = &test_history.entries[test_history.count];
+    if (!(entry->name = strdup(name))) {
+        return -1;
+    }
+    entry->result = (unsigned char)r;
+    entry->registered = 0;
+    entry->written = 0;
+    entry->duration_ns = (uint64_t)duration;
+    test_history.count++;
+    return 0;
+}
+
+// Read the history file, replacing what an earlier read kept. The section of
+// this executable is found by its build ID, or failing that by its path, so a
+// rebuilt binary keeps its history.
+static int read_test_history(void) {
+    char line[8192];
+    char build_id[128];
+    int ours = 0;
+    FILE *file;
+
+    for (size_t i = 0; i < test_history.count; i++) {
+        free(test_history.entries[i].name);
+    }
+    test_history.count = 0;
+    free(test_history.others);
+    test_history.others = NULL;
+    test_history.others_size = 0;
+
+    if (!(file = fopen(test_config.history, "r"))) {
+        return 0;
+    }
+    while (fgets(line, sizeof(line), file)) {
+        if (strncmp(line, "binary ", 7) == 0 &&
+            sscanf(line, "binary %127s", build_id) == 1) {
+            const char *path = line + 7 + strlen(build_id);
+            size_t size;
+
+            path += *path == ' ';
+            size = strcspn(path, "\n");
+            ours = (*test_history.path && size == strlen(test_history.path) &&
+                    strncmp(path, test_history.path, size) == 0) ||
+                   (strcmp(build_id, "unknown") != 0 &&
+                    strcmp(build_id, test_history.build_id) == 0);
+        } else if (strncmp(line, "nutest-history ", 15) == 0) {
+            continue;
+        }
+        if (!ours ? keep_test_history_line(line) != 0
+                  : add_test_history(line) != 0) {
+            fclose(file);
+            return -1;
+        }
+    }
+    fclose(file);
+
+    // Sorted for lookups, of duplicates one wins
+    if (test_history.count > 0) {
+        qsort(test_history.entries,
+              test_history.count,
+              sizeof(TestHistoryEntry),
+              compare_test_history);
+    }
+    for (size_t i = 0; i < test_history.registered; i++) {
+        TestHistoryEntry *entry = find_test_history(&test_registry.tests[i]);
+        if (entry) {
+            entry->registered = 1;
+        }
+    }
+    return 0;
+}
+
+// Load the run history, done once before the first selection. Without a
+// --history path the history orderings keep one in .nutest-history.
+static int load_test_history(void) {
+    ssize_t length;
+
+    if (!test_config.history &&
+        (test_config.failed_first || test_config.rerun_failed ||
+         test_config.shortest_first)) {
+        test_config.history = ".nutest-history";
+    }
+    if (test_history.loaded || !test_config.history ||
+        !*test_config.history) {
+        return 0;
+    }
+    test_history.loaded = 1;
+    test_history.registered = test_registry.test_count;
+
+    if (!read_test_build_id(test_history.build_id,
+                            sizeof(test_history.build_id))) {
+        snprintf(test_history.build_id,
+                 sizeof(test_history.build_id),
+                 "unknown");
+    }
+    length = readlink("/proc/self/exe",
+                      test_history.path,
+                      sizeof(test_history.path) - 1);
+    test_history.path[length > 0 ? length : 0] = '\0';
+    return read_test_history();
+}
+
+// Lock the history file against other runs saving theirs. The file at the
+// path may have been renamed over while waiting, then lock again until the
+// one locked is the one there. Returns NULL when it cannot be opened.
+static FILE *lock_test_history(void) {
+    struct stat locked, current;
+    FILE *lock;
+
+    for (;;) {
+        if (!(lock = fopen(test_config.history, "a"))) {
+            return NULL;
+        }
+        if (flock(fileno(lock), LOCK_EX) != 0 ||
+            fstat(fileno(lock), &locked) != 0) {
+            fclose(lock);
+            return NULL;
+        }
+        if (stat(test_config.history, &current) == 0 &&
+            current.st_dev == locked.st_dev &&
+            current.st_ino == locked.st_ino) {
+            return lock;
+        }
+        fclose(lock);
+    }
+}
+
+// Write the run history through a temporary file: the sections of other
+// executables, then this one with the result of every test that ran and the
+// recorded result of every other registered test. The file is read again
+// under the lock, so runs saving at once all keep their results.
+static int save_test_history(const unsigned char *results,
+                             const uint64_t *durations) {
+    char temp[4096];
+    char name[512];
+    int status = -1, error;
+    FILE *lock, *file;
+
+    if (!test_history.loaded) {
+        return 0;
+    }
+    if (!(lock = lock_test_history())) {
+        return -1;
+    }
+    if (read_test_history() != 0 ||
+        !(file = open_test_temp(test_config.history, temp, sizeof(temp)))) {
+        goto cleanup;
+    }
+    fprintf(file, "nutest-history 1\n");
+    if (test_history.others) {
+        fputs(test_history.others, file);
+    }
+    fprintf(file, "binary %s %s\n", test_history.build_id, test_history.path);
+
+    for (size_t i = 0; i < test_history.count; i++) {
+        test_history.entries[i].written = !test_history.entries[i].registered;
+    }
+    for (size_t i = 0; i < test_registry.test_count; i++) {
+        TestHistoryEntry *entry = find_test_history(&test_registry.tests[i]);
+
+        if (results[i] != TEST_NOT_RUN) {
+            fprintf(file,
+                    "test %s %s %llu\n",
+                    format_test_name(
+                        &test_registry.tests[i], name, sizeof(name)),
+                    test_result_names[results[i]],
+                    (unsigned long long)durations[i]);
+            if (entry) {
+                entry->result = results[i];
+                entry->duration_ns = durations[i];
+                entry->written = 1;
+            }
+        }
+    }
+    for (size_t i = 0; i < test_history.count; i++) {
+        const TestHistoryEntry *entry = &test_history.entries[i];
+        if (!entry->written) {
+            fprintf(file,
+                    "test %s %s %llu\n",
+                    entry->name,
+                    test_result_names[entry->result],
+                    (unsigned long long)entry->duration_ns);
+        }
+    }
+    if (fclose(file) != 0 || rename(temp, test_config.history) != 0) {
+        remove(temp);
+        goto cleanup;
+    }
+    status = 0;
+
+cleanup:
+    // Closing drops the lock, errno stays that of the failure
+    error = errno;
+    fclose(lock);
+    errno = error;
+    return status;
+}
+
+// Whether a test failed the last time it ran, given its history entry
+static int failed_before(const TestHistoryEntry *entry) {
+    return entry && (entry->result == TEST_FAIL || entry->result == TEST_ERROR);
+}
+
+// Whether --fail-fast ends the run after a test with this result
+static int stop_after_test(TestResult result) {
+    return test_config.fail_fast &&
+           (result == TEST_FAIL || result == TEST_ERROR);
+}
+
+// Run order of a selected test: with --failed-first, suites then tests that
+// failed last time come first; with --shortest-first, suites then tests go
+// by recorded duration, unknown ones counting as the mean. Otherwise, and
+// between equals, registry order.
+typedef struct {
+    size_t index;
+    size_t suite;
+    int suite_failed;
+    int failed;
+    uint64_t suite_ns;
+    uint64_t duration_ns;
+} TestRank;
+
+static int compare_test_ranks(const void *a, const void *b) {
+    const TestRank *x = (const TestRank *)a;
+    const TestRank *y = (const TestRank *)b;
+
+    if (x->suite_failed != y->suite_failed) {
+        return y->suite_failed - x->suite_failed;
+    }
+    if (x->suite_ns != y->suite_ns) {
+        return x->suite_ns < y->suite_ns ? -1 : 1;
+    }
+    if (x->suite != y->suite) {
+        return x->suite < y->suite ? -1 : 1;
+    }
+    if (x->failed != y->failed) {
+        return y->failed - x->failed;
+    }
+    if (x->duration_ns != y->duration_ns) {
+        return x->duration_ns < y->duration_ns ? -1 : 1;
+    }
+    return (x->index > y->index) - (x->index < y->index);
+}
+
+// Rank the selected tests of a registry grouped by suite, returns how many
+static size_t rank_test_cases(const TestCase *tests,
+                              size_t count,
+                              const unsigned char *selected,
+                              TestRank *ranks) {
+    uint64_t known = 0, total = 0, mean;
+    size_t ranked = 0;
+
+    for (size_t i = 0; i < count && test_config.shortest_first; i++) {
+        const TestHistoryEntry *entry = find_test_history(&tests[i]);
+        if (selected[i] && entry) {
+            known++;
+            total += entry->duration_ns;
+        }
+    }
+    mean = known ? total / known : 0;
+
+    for (size_t begin = 0, end; begin < count; begin = end) {
+        size_t first = ranked;
+        int suite_failed = 0;
+        uint64_t suite_ns = 0;
+
+        for (end = begin;
+             end < count && same_test_suite(&tests[end], &tests[begin]);
+             end++) {
+            const TestHistoryEntry *entry;
+            TestRank *rank = &ranks[ranked];
+
+            if (!selected[end]) {
+                continue;
+            }
+            entry = find_test_history(&tests[end]);
+            rank->index = end;
+            rank->suite = begin;
+            rank->failed = test_config.failed_first && failed_before(entry);
+            rank->duration_ns = 0;
+            if (test_config.shortest_first) {
+                rank->duration_ns = entry ? entry->duration_ns : mean;
+            }
+            suite_failed |= rank->failed;
+            suite_ns += rank->duration_ns;
+            ranked++;
+        }
+        for (size_t i = first; i < ranked; i++) {
+            ranks[i].suite_failed = suite_failed;
+            ranks[i].suite_ns = suite_ns;
+        }
+    }
+    qsort(ranks, ranked, sizeof(TestRank), compare_test_ranks);
+    return ranked;
+}
+
+// Keep the selected tests of this shard. By default a test belongs to the
+// shard its name hashes to. With recorded durations, tests go longest first
+// to the least loaded shard, and tests missing from the file count as the
+// mean. Every shard computes the same plan from the same inputs, so shards
+// never overlap and together cover every selected test.
+static int plan_test_shards(const TestCase *tests,
+                            size_t count,
+                            unsigned char *selected) {
+    size_t shards = test_config.total_shards;
+    TestDuration *plan;
+    uint64_t *recorded;
+    uint64_t *loads;
+    uint64_t known = 0, total = 0, mean;
+    size_t planned = 0;
+    char name[512];
+
+    recorded = (uint64_t *)malloc((count ? count : 1) * sizeof(uint64_t));
+    if (!recorded) {
+        return -1;
+    }
+    if (!test_config.shard_durations ||
+        load_test_durations(
+            test_config.shard_durations, tests, count, recorded) != 0) {
+        if (test_config.shard_durations) {
+            print_test_label(stderr, COLOR_YELLOW, "WARN");
+            fprintf(stderr,
+                    "no durations in %s, sharding by name\n",
+                    test_config.shard_durations);
+        }
+        for (size_t i = 0; i < count; i++) {
+            format_test_name(&tests[i], name, sizeof(name));
+            if (hash_test_name(name) % shards != test_config.shard_index) {
+                selected[i] = 0;
+            }
+        }
+        free(recorded);
+        return 0;
+    }
+
+    plan = (TestDuration *)malloc((count ? count : 1) * sizeof(TestDuration));
+    loads = (uint64_t *)calloc(shards, sizeof(uint64_t));
+    if (!plan || !loads) {
+        free(loads);
+        free(plan);
+        free(recorded);
+        return -1;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        if (selected[i] && recorded[i] != UINT64_MAX) {
+            known++;
+            total += recorded[i];
+        }
+    }
+    mean = known ? total / known : 0;
+    for (size_t i = 0; i < count; i++) {
+        if (selected[i]) {
+            plan[planned].index = i;
+            plan[planned].duration_ns =
+                recorded[i] != UINT64_MAX ? recorded[i] : mean;
+            planned++;
+        }
+    }
+    qsort(plan, planned, sizeof(TestDuration), compare_test_durations);
+
+    for (size_t i = 0; i < planned; i++) {
+        size_t lightest = 0;
+        for (size_t s = 1; s < shards; s++) {
+            if (loads[s] < loads[lightest]) {
+                lightest = s;
+            }
+        }
+        // Count every test at least once so instant tests still spread
+        loads[lightest] += plan[i].duration_ns + 1;
+        if (lightest != test_config.shard_index) {
+            selected[plan[i].index] = 0;
+        }
+    }
+
+    free(loads);
+    free(plan);
+    free(recorded);
+    return 0;
+}
+
+// Narrow the registry to the tests --filter, --rerun-failed and the shard
+// select, in the order of rank_test_cases; the rest are moved past the end.
+// Returns -1 when out of memory.
+static int select_test_cases(void) {
+    TestCase *tests = test_registry.tests;
+    size_t count = test_registry.test_count;
+    unsigned char *selected;
+    TestCase *sorted;
+    TestRank *ranks;
+    size_t kept = 0, failed = 0;
+    char name[512];
+
+    if (test_registry.selected || count == 0 ||
+        (!test_config.filter && test_config.total_shards <= 1 &&
+         !test_config.rerun_failed && !test_config.failed_first &&
+         !test_config.shortest_first)) {
+        return 0;
+    }
+    test_registry.selected = 1;
+
+    selected = (unsigned char *)malloc(count);
+    sorted = (TestCase *)malloc(count * sizeof(TestCase));
+    ranks = (TestRank *)malloc(count * sizeof(TestRank));
+    if (!selected || !sorted || !ranks) {
+        free(ranks);
+        free(sorted);
+        free(selected);
+        return -1;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        selected[i] = !test_config.filter ||
+                      match_test_filter(
+                          test_config.filter,
+                          format_test_name(&tests[i], name, sizeof(name)));
+    }
+    for (size_t i = 0; i < count && test_config.rerun_failed; i++) {
+        failed += selected[i] && failed_before(find_test_history(&tests[i]));
+    }
+    if (test_config.rerun_failed && failed == 0) {
+        print_test_label(stderr, COLOR_YELLOW, "WARN");
+        fprintf(stderr, "no recorded failures, running every selected test\n");
+    }
+    for (size_t i = 0; i < count && failed > 0; i++) {
+        selected[i] =
+            selected[i] && failed_before(find_test_history(&tests[i]));
+    }
+    if (test_config.total_shards > 1 &&
+        plan_test_shards(tests, count, selected) != 0) {
+        free(ranks);
+        free(sorted);
+        free(selected);
+        return -1;
+    }
+
+    kept = rank_test_cases(tests, count, selected, ranks);
+    for (size_t i = 0; i < kept; i++) {
+        sorted[i] = tests[ranks[i].index];
+    }
+    for (size_t i = 0, k = kept; i < count; i++) {
+        if (!selected[i]) {
+            sorted[k++] = tests[i];
+        }
+    }
+    memcpy(tests, sorted, count * sizeof(TestCase));
+    test_registry.test_count = kept;
+
+    free(ranks);
+    free(sorted);
+    free(selected);
+    return group_test_cases(tests, kept, &test_registry.suite_count);
+}
+
+// Collect registered tests, done once on the first run. Returns -1 when out
+// of memory.
+static int prepare_test_registry(void) {
+    if (test_registry.prepared) {
+        return 0;
+    }
+    test_registry.prepared = 1;
+
+#if NUTEST_USE_SECTIONS
+    TestCase *begin = __start_nutest_tests;
+    TestCase *end = __stop_nutest_tests;
+    if (begin && end > begin) {
+        test_registry.tests = begin;
+        test_registry.test_count = (size_t)(end - begin);
+    }
+    TestFixture *fixtures = __start_nutest_fixtures;
+    TestFixture *fixtures_end = __stop_nutest_fixtures;
+    if (fixtures && fixtures_end > fixtures) {
+        test_registry.fixtures = fixtures;
+        test_registry.fixture_count = (size_t)(fixtures_end - fixtures);
+    }
+#endif
+
+    order_records(test_registry.tests,
+                  test_registry.test_count,
+                  sizeof(TestCase),
+                  offsetof(TestCase, file),
+                  offsetof(TestCase, line));
+    return group_test_cases(test_registry.tests,
+                            test_registry.test_count,
+                            &test_registry.suite_count);
+}
+
+// Look up the fixture hooks of a suite, the first one of each kind wins
+static void find_test_fixtures(TestSuite *suite) {
+    memset(suite->fixtures, 0, sizeof(suite->fixtures));
+    for (size_t i = 0; i < test_registry.fixture_count; i++) {
+        const TestFixture *fixture = &test_registry.fixtures[i];
+
+        if (!suite->fixtures[fixture->kind] &&
+            strcmp(fixture->suite_name, suite->name) == 0) {
+            suite->fixtures[fixture->kind] = fixture;
+        }
+    }
+}
+
+// Advance to the next suite of the prepared registry, start from a zeroed
+// TestSuite; returns 0 after the last suite
+static int next_test_suite(TestSuite *suite) {
+    TestCase *begin = suite->tests ? suite->tests + suite->test_count
+                                   : test_registry.tests;
+    TestCase *end = test_registry.tests + test_registry.test_count;
+    size_t count = 1;
+
+    if (!begin || begin >= end) {
+        return 0;
+    }
+    while (begin + count < end && same_test_suite(begin + count, begin)) {
+        count++;
+    }
+    suite->name = begin->suite_name;
+    suite->tests = begin;
+    suite->test_count = count;
+    suite->description = NULL;
+    suite->setup_result = TEST_PASS;
+    suite->failures_begin = suite->failures_end = 0;
+    find_test_fixtures(suite);
+    return 1;
+}
+
+// Parse a non-negative integer option value, returns -1 on error
+static long parse_test_number(const char *value) {
+    char *end = NULL;
+    long number;
+
+    if (!value || !*value) {
+        return -1;
+    }
+    errno = 0;
+    number = strtol(value, &end, 10);
+    if (errno || *end || number < 0) {
+        return -1;
+    }
+    return number;
+}
+
+// Match "--name=value", "--name value", "-xvalue" and "-x value"
+static const char *match_test_option(int argc,
+                                     char **argv,
+                                     int *index,
+                                     const char *long_name,
+                                     const char *short_name) {
+    const char *arg = argv[*index];
+    size_t len;
+
+    if (long_name) {
+        len = strlen(long_name);
+        if (strncmp(arg, long_name, len) == 0) {
+            if (arg[len] == '=') {
+                return arg + len + 1;
+            }
+            if (arg[len] == '\0') {
+                return (*index + 1 < argc) ? argv[++*index] : "";
+            }
+        }
+    }
+    if (short_name) {
+        len = strlen(short_name);
+        if (strncmp(arg, short_name, len) == 0) {
+            if (arg[len] != '\0') {
+                return arg + len;
+            }
+            return (*index + 1 < argc) ? argv[++*index] : "";
+        }
+    }
+    return NULL;
+}
+
+// Resolve a job count, 0 means one job per online CPU
+static size_t resolve_test_jobs(long jobs) {
+    if (jobs == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        return cpus > 0 ? (size_t)cpus : 1;
+    }
+    return (size_t)jobs;
+}
+
+// Parse a --color value, -1 for auto and -2 if invalid
+static int parse_test_color(const char *value) {
+    if (strcmp(value, "auto") == 0) {
+        return -1;
+    }
+    if (strcmp(value, "always") == 0) {
+        return 1;
+    }
+    if (strcmp(value, "never") == 0) {
+        return 0;
+    }
+    return -2;
+}
+
+// Machine-readable formats of --output=FORMAT[:PATH]
+typedef enum {
+    TEST_OUTPUT_JUNIT,
+    TEST_OUTPUT_TAP,
+    TEST_OUTPUT_JSONL
+} TestOutput;
+
+static const char *const test_output_formats[] = {"junit", "tap", "jsonl"};
+
+// Format named by an --output value, -1 if unknown
+static int parse_test_output(const char *spec) {
+    size_t len = strcspn(spec, ":");
+
+    for (size_t i = 0;
+         i < sizeof(test_output_formats) / sizeof(test_output_formats[0]);
+         i++) {
+        if (strlen(test_output_formats[i]) == len &&
+            strncmp(spec, test_output_formats[i], len) == 0) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+// Load configuration from the environment
+static void load_test_config(void) {
+    const char *value;
+    long number;
+
+    if (test_config.configured) {
+        return;
+    }
+    test_config.configured = 1;
+
+    value = getenv("NUTEST_JOBS");
+    if (value && (number = parse_test_number(value)) >= 0) {
+        test_config.jobs = resolve_test_jobs(number);
+    }
+    value = getenv("NUTEST_TIMEOUT");
+    if (value && (number = parse_test_number(value)) >= 0) {
+        test_config.timeout_ms = number * 1000;
+    }
+    value = getenv("NUTEST_SLOWEST");
+    if (value && (number = parse_test_number(value)) >= 0) {
+        test_config.slowest = (size_t)number;
+    }
+    value = getenv("NUTEST_BENCH_MIN_TIME");
+    if (value && (number = parse_test_number(value)) > 0) {
+        test_config.bench_min_time_ms = number;
+    }
+    value = getenv("NUTEST_BENCH_SAMPLES");
+    if (value && (number = parse_test_number(value)) > 0) {
+        test_config.bench_samples = (size_t)number;
+    }
+    value = getenv("NUTEST_BENCH_COUNTERS");
+    if (value && *value) {
+        test_config.bench_counters = strcmp(value, "extended") == 0 ? 2
+                                     : strcmp(value, "0") == 0      ? 0
+                                                                    : 1;
+    }
+    value = getenv("NUTEST_BENCH_OUT");
+    if (value && *value) {
+        test_config.bench_out = value;
+    }
+    value = getenv("NUTEST_BENCH_BASELINE");
+    if (value && *value) {
+        test_config.bench_baseline = value;
+    }
+    value = getenv("NUTEST_BENCH_HISTOGRAM");
+    if (value && *value) {
+        test_config.bench_histogram = value;
+    }
+    value = getenv("NUTEST_BENCH_THRESHOLD");
+    if (value && (number = parse_test_number(value)) >= 0) {
+        test_config.bench_threshold = (double)number;
+    }
+    value = getenv("NUTEST_BENCH_WARMUP");
+    if (value && (number = parse_test_number(value)) >= 0) {
+        test_config.bench_warmup = (size_t)number;
+    }
+    value = getenv("NUTEST_COLOR");
+    if (value && (number = parse_test_color(value)) >= -1) {
+        test_config.color = (int)number;
+    }
+    value = getenv("NUTEST_OUTPUT");
+    if (value && parse_test_output(value) >= 0) {
+        test_config.output = value;
+    }
+    value = getenv("NUTEST_FILTER");
+    if (value && *value) {
+        test_config.filter = value;
+    }
+    value = getenv("NUTEST_SHARD_INDEX");
+    if (value && (number = parse_test_number(value)) >= 0) {
+        test_config.shard_index = (size_t)number;
+    }
+    value = getenv("NUTEST_TOTAL_SHARDS");
+    if (value && (number = parse_test_number(value)) >= 0) {
+        test_config.total_shards = (size_t)number;
+    }
+    value = getenv("NUTEST_SHARD_DURATIONS");
+    if (value && *value) {
+        test_config.shard_durations = value;
+    }
+    value = getenv("NUTEST_SAVE_DURATIONS");
+    if (value && *value) {
+        test_config.save_durations = value;
+    }
+    value = getenv("NUTEST_HISTORY");
+    if (value) {
+        test_config.history = value;
+    }
+    value = getenv("NUTEST_FAILED_FIRST");
+    if (value && *value && strcmp(value, "0") != 0) {
+        test_config.failed_first = 1;
+    }
+    value = getenv("NUTEST_RERUN_FAILED");
+    if (value && *value && strcmp(value, "0") != 0) {
+        test_config.rerun_failed = 1;
+    }
+    value = getenv("NUTEST_FAIL_FAST");
+    if (value && *value && strcmp(value, "0") != 0) {
+        test_config.fail_fast = 1;
+    }
+    value = getenv("NUTEST_SHORTEST_FIRST");
+    if (value && *value && strcmp(value, "0") != 0) {
+        test_config.shortest_first = 1;
+    }
+    value = getenv("NUTEST_FUZZ");
+    if (value) {
+        test_config.fuzz = value;
+    }
+    value = getenv("NUTEST_CORPUS");
+    if (value && *value) {
+        test_config.corpus = value;
+    }
+    value = getenv("NUTEST_FUZZ_TIME");
+    if (value && (number = parse_test_number(value)) >= 0) {
+        test_config.fuzz_time_s = number;
+    }
+    value = getenv("NUTEST_FUZZ_MAX_LEN");
+    if (value && (number = parse_test_number(value)) > 0) {
+        test_config.fuzz_max_len = (size_t)number;
+    }
+    value = getenv("NUTEST_FUZZ_MINIMIZE");
+    if (value && *value && strcmp(value, "0") != 0) {
+        test_config.fuzz_minimize = 1;
+    }
+    value = getenv("NUTEST_SEED");
+    if (value && (number = parse_test_number(value)) >= 0) {
+        test_config.seed = (uint64_t)number;
+    } else {
+        test_config.seed =
+            (test_now_ns() ^ ((uint64_t)getpid() << 16)) & 0xffffffffu;
+    }
+    value = getenv("NUTEST_PROP_CASES");
+    if (value && (number = parse_test_number(value)) > 0) {
+        test_config.prop_cases = (size_t)number;
+    }
+}
+
+// Parse command line options, these override the environment
+NUTEST_API void INIT_TESTS(int argc, char **argv) {
+    const char *value;
+    long number;
+
+    load_test_config();
+
+    for (int i = 1; i < argc; i++) {
+        if ((value = match_test_option(argc, argv, &i, "--jobs", "-j"))) {
+            number = *value ? parse_test_number(value) : 0;
+            if (number < 0) {
+                fprintf(stderr, "nutest: invalid job count '%s'\n", value);
+                exit(EXIT_FAILURE);
+            }
+            test_config.jobs = resolve_test_jobs(number);
+        } else if ((value = match_test_option(
+                        argc, argv, &i, "--timeout", NULL))) {
+            number = parse_test_number(value);
+            if (number < 0) {
+                fprintf(stderr, "nutest: invalid timeout '%s'\n", value);
+                exit(EXIT_FAILURE);
+            }
+            test_config.timeout_ms = number * 1000;
+        } else if ((value = match_test_option(
+                        argc, argv, &i, "--slowest", NULL))) {
+            number = parse_test_number(value);
+            if (number < 0) {
+                fprintf(stderr, "nutest: invalid count '%s'\n", value);
+                exit(EXIT_FAILURE);
+            }
+            test_config.slowest = (size_t)number;
+        } else if ((value = match_test_option(
+                        argc, argv, &i, "--bench-min-time", NULL))) {
+            number = parse_test_number(value);
+            if (number <= 0) {
+                fprintf(stderr, "nutest: invalid minimum time '%s'\n", value);
+                exit(EXIT_FAILURE);
+            }
+            test_config.bench_min_time_ms = number;
+        } else if ((value = match_test_option(
+                        argc, argv, &i, "--bench-samples", NULL))) {
+            number = parse_test_number(value);
+            if (number <= 0) {
+                fprintf(stderr, "nutest: invalid sample count '%s'\n", value);
+                exit(EXIT_FAILURE);
+            }
+            test_config.bench_samples = (size_t)number;
+        } else if ((value = match_test_option(
+                        argc, argv, &i, "--bench-warmup", NULL))) {
+            number = parse_test_number(value);
+            if (number < 0) {
+                fprintf(stderr, "nutest: invalid warmup count '%s'\n", value);
+                exit(EXIT_FAILURE);
+            }
+            test_config.bench_warmup = (size_t)number;
+        } else if ((value = match_test_option(
+                        argc, argv, &i, "--bench-out", NULL))) {
+            test_config.bench_out = value;
+        } else if ((value = match_test_option(
+                        argc, argv, &i, "--bench-baseline", NULL))) {
+            test_config.bench_baseline = value;
+        } else if ((value = match_test_option(
+                        argc, argv, &i, "--bench-histogram", NULL))) {
+            test_config.bench_histogram = value;
+        } else if ((value = match_test_option(
+                        argc, argv, &i, "--bench-threshold", NULL))) {
+            number = parse_test_number(value);
+            if (number < 0) {
+                fprintf(stderr, "nutest: invalid threshold '%s'\n", value);
+                exit(EXIT_FAILURE);
+            }
+            test_config.bench_threshold = (double)number;
+        } else if ((value = match_test_option(
+                        argc, argv, &i, "--color", NULL))) {
+            number = parse_test_color(value);
+            if (number < -1) {
+                fprintf(stderr, "nutest: invalid color mode '%s'\n", value);
+                exit(EXIT_FAILURE);
+            }
+            test_config.color = (int)number;
+        } else if ((value = match_test_option(
+                        argc, argv, &i, "--output", NULL))) {
+            if (parse_test_output(value) < 0) {
+                fprintf(stderr, "nutest: invalid output format '%s'\n", value);
+                exit(EXIT_FAILURE);
+            }
+            test_config.output = value;
+        } else if ((value = match_test_option(
+                        argc, argv, &i, "--filter", NULL))) {
+            test_config.filter = *value ? value : NULL;
+        } else if ((value = match_test_option(
+                        argc, argv, &i, "--shard-index", NULL))) {
+            number = parse_test_number(value);
+            if (number < 0) {
+                fprintf(stderr, "nutest: invalid shard index '%s'\n", value);
+                exit(EXIT_FAILURE);
+            }
+            test_config.shard_index = (size_t)number;
+        } else if ((value = match_test_option(
+                        argc, argv, &i, "--total-shards", NULL))) {
+            number = parse_test_number(value);
+            if (number < 0) {
+                fprintf(stderr, "nutest: invalid shard count '%s'\n", value);
+                exit(EXIT_FAILURE);
+            }
+            test_config.total_shards = (size_t)number;
+        } else if ((value = match_test_option(
+                        argc, argv, &i, "--shard-durations", NULL))) {
+            test_config.shard_durations = value;
+        } else if ((value = match_test_option(
+                        argc, argv, &i, "--save-durations", NULL))) {
+            test_config.save_durations = value;
+        } else if ((value = match_test_option(
+                        argc, argv, &i, "--history", NULL))) {
+            test_config.history = value;
+        } else if ((value = match_test_option(
+                        argc, argv, &i, "--corpus", NULL))) {
+            test_config.corpus = *value ? value : "corpus";
+        } else if ((value = match_test_option(
+                        argc, argv, &i, "--fuzz-time", NULL))) {
+            number = parse_test_number(value);
+            if (number < 0) {
+                fprintf(stderr, "nutest: invalid fuzz time '%s'\n", value);
+                exit(EXIT_FAILURE);
+            }
+            test_config.fuzz_time_s = number;
+        } else if ((value = match_test_option(
+                        argc, argv, &i, "--fuzz-max-len", NULL))) {
+            number = parse_test_number(value);
+            if (number <= 0) {
+                fprintf(stderr, "nutest: invalid input length '%s'\n", value);
+                exit(EXIT_FAILURE);
+            }
+            test_config.fuzz_max_len = (size_t)number;
+        } else if ((value = match_test_option(
+                        argc, argv, &i, "--seed", NULL))) {
+            number = parse_test_number(value);
+            if (number < 0) {
+                fprintf(stderr, "nutest: invalid seed '%s'\n", value);
+                exit(EXIT_FAILURE);
+            }
+            test_config.seed = (uint64_t)number;
+        } else if ((value = match_test_option(
+                        argc, argv, &i, "--prop-cases", NULL))) {
+            number = parse_test_number(value);
+            if (number <= 0) {
+                fprintf(stderr, "nutest: invalid case count '%s'\n", value);
+                exit(EXIT_FAILURE);
+            }
+            test_config.prop_cases = (size_t)number;
+        } else if (strcmp(argv[i], "--failed-first") == 0) {
+            test_config.failed_first = 1;
+        } else if (strcmp(argv[i], "--rerun-failed") == 0) {
+            test_config.rerun_failed = 1;
+        } else if (strcmp(argv[i], "--fail-fast") == 0) {
+            test_config.fail_fast = 1;
+        } else if (strcmp(argv[i], "--shortest-first") == 0) {
+            test_config.shortest_first = 1;
+        } else if (strcmp(argv[i], "--fuzz-minimize") == 0) {
+            test_config.fuzz_minimize = 1;
+        } else if (strcmp(argv[i], "--fuzz") == 0) {
+            test_config.fuzz = "";
+        } else if (strncmp(argv[i], "--fuzz=", 7) == 0) {
+            test_config.fuzz = argv[i] + 7;
+        } else if (strcmp(argv[i], "--bench-counters") == 0) {
+            test_config.bench_counters = 1;
+        } else if (strcmp(argv[i], "--bench-counters=extended") == 0) {
+            test_config.bench_counters = 2;
+        }
+    }
+}
+
+// Effective timeout of a test in milliseconds, 0 for none
+static long test_timeout_ms(const TestCase *test, int isolated) {
+    if (test->timeout_ms > 0) {
+        return test->timeout_ms;
+    }
+    if (test_config.timeout_ms >= 0) {
+        return test_config.timeout_ms;
+    }
+    return isolated ? TEST_DEFAULT_TIMEOUT_MS : 0;
+}
+
+// Accumulate a test result
+static void count_test_result(TestCounts *counts, TestResult result) {
+    counts->tests++;
+    switch (result) {
+    case TEST_PASS:
+        counts->passed++;
+        break;
+    case TEST_FAIL:
+        counts->failed++;
+        break;
+    case TEST_SKIP:
+        counts->skipped++;
+        break;
+    case TEST_ERROR:
+        counts->errors++;
+        break;
+    }
+}
+
+// Allocate zeroed memory shared with forked workers
+static void *map_test_shared(size_t size) {
+    void *ptr = mmap(NULL,
+                     size ? size : 1,
+                     PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS,
+                     -1,
+                     0);
+    return ptr == MAP_FAILED ? NULL : ptr;
+}
+
+// Print the slowest tests, longest first
+static void print_slowest_tests(FILE *out,
+                                const uint64_t *durations,
+                                size_t count) {
+    size_t shown = count < test_config.slowest ? count : test_config.slowest;
+    TestDuration *order;
+
+    if (shown == 0 ||
+        !(order = (TestDuration *)malloc(count * sizeof(TestDuration)))) {
+        return;
+    }
+    for (size_t i = 0; i < count; i++) {
+        order[i].index = i;
+        order[i].duration_ns = durations[i];
+    }
+    qsort(order, count, sizeof(TestDuration), compare_test_durations);
+
+    fprintf(out, "[=========] %zu slowest tests:\n", shown);
+    for (size_t i = 0; i < shown; i++) {
+        const TestCase *test = &test_registry.tests[order[i].index];
+        print_test_label(out, COLOR_YELLOW, "SLOW");
+        fprintf(out,
+                "%8lu ms  %s.%s\n",
+                (unsigned long)(order[i].duration_ns / 1000000u),
+                test->suite_name,
+                test->name);
+    }
+    free(order);
+}
+
+// Growable in-memory text buffer of a reporter
+typedef struct {
+    FILE *file;
+    char *data;
+    size_t size;
+} TestBuffer;
+
+static int open_test_buffer(TestBuffer *buffer) {
+    buffer->data = NULL;
+    buffer->size = 0;
+    buffer->file = open_memstream(&buffer->data, &buffer->size);
+    return buffer->file ? 0 : -1;
+}
+
+// Bytes written since the buffer was last emptied, data stays valid until
+// the next write
+static size_t test_buffer_length(TestBuffer *buffer) {
+    fflush(buffer->file);
+    return (size_t)ftell(buffer->file);
+}
+
+// Copy a buffer to a stream and empty it
+static void flush_test_buffer(TestBuffer *buffer, FILE *out) {
+    fwrite(buffer->data, 1, test_buffer_length(buffer), out);
+    rewind(buffer->file);
+}
+
+static void close_test_buffer(TestBuffer *buffer) {
+    if (buffer->file) {
+        fclose(buffer->file);
+        buffer->file = NULL;
+    }
+    free(buffer->data);
+    buffer->data = NULL;
+}
+
+// Write text escaped for XML element content or attribute values
+static void write_xml_escaped(FILE *out, const char *text, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        unsigned char c = (unsigned char)text[i];
+
+        switch (c) {
+        case '&':
+            fputs("&amp;", out);
+            break;
+        case '<':
+            fputs("&lt;", out);
+            break;
+        case '>':
+            fputs("&gt;", out);
+            break;
+        case '"':
+            fputs("&quot;", out);
+            break;
+        case '\t':
+        case '\n':
+        case '\r':
+            fprintf(out, "&#%d;", c);
+            break;
+        default:
+            // Other control characters cannot appear in XML 1.0 at all
+            fputc(c < 0x20 ? '?' : c, out);
+            break;
+        }
+    }
+}
+
+// Write text as a JSON string, which is also a valid YAML scalar
+static void write_json_string(FILE *out, const char *text, size_t length) {
+    fputc('"', out);
+    for (size_t i = 0; i < length; i++) {
+        unsigned char c = (unsigned char)text[i];
+
+        if (c == '"' || c == '\\') {
+            fputc('\\', out);
+            fputc(c, out);
+        } else if (c == '\n') {
+            fputs("\\n", out);
+        } else if (c == '\t') {
+            fputs("\\t", out);
+        } else if (c < 0x20) {
+            fprintf(out, "\\u%04x", c);
+        } else {
+            fputc(c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+// Test event reporter. The runner calls every active reporter in registry
+// order, whichever process ran the test; events a format has no use for are
+// left NULL.
+typedef struct TestReporter TestReporter;
+
+struct TestReporter {
+    void (*run_start)(TestReporter *reporter,
+                      size_t suite_count,
+                      size_t test_count);
+    void (*suite_start)(TestReporter *reporter, const TestSuite *suite);
+    void (*test_start)(TestReporter *reporter, const TestCase *test);
+    void (*test_output)(TestReporter *reporter, const char *data, size_t size);
+    void (*test_failure)(TestReporter *reporter,
+                         TestResult kind,
+                         const char *file,
+                         int line,
+                         const char *message);
+    void (*test_end)(TestReporter *reporter,
+                     const TestCase *test,
+                     TestResult result,
+                     uint64_t duration_ns,
+                     const TestAllocStats *allocs);
+    void (*suite_end)(TestReporter *reporter,
+                      const TestSuite *suite,
+                      uint64_t duration_ns);
+    void (*run_end)(TestReporter *reporter,
+                    const TestCounts *totals,
+                    const uint64_t *durations,
+                    uint64_t duration_ns);
+    FILE *out;
+    char *out_buffer;
+    TestBuffer suite;    // Test cases of the current suite
+    TestBuffer failures; // Failures of the current test
+    TestBuffer output;   // Output of the current test
+    TestCounts counts;   // Results of the current suite
+    size_t failure_count;
+    size_t test_number;
+};
+
+// Console reporter, the human-readable default
+static void console_run_start(TestReporter *reporter,
+                              size_t suite_count,
+                              size_t test_count) {
+    (void)test_count;
+    if (test_config.filter) {
+        fprintf(reporter->out, "[=========] Filter: %s\n", test_config.filter);
+    }
+    if (test_config.total_shards > 1) {
+        fprintf(reporter->out,
+                "[=========] Shard %zu of %zu\n",
+                test_config.shard_index + 1,
+                test_config.total_shards);
+    }
+    fprintf(reporter->out,
+            "[=========] Running %s%zu test suites\n",
+            test_config.fail_fast ? "up to " : "",
+            suite_count);
+}
+
+static void console_suite_start(TestReporter *reporter,
+                                const TestSuite *suite) {
+    fprintf(reporter->out,
+            "[---------] %zu tests from %s\n",
+            suite->test_count,
+            suite->name);
+}
+
+static void console_test_start(TestReporter *reporter, const TestCase *test) {
+    fprintf(reporter->out, "[ RUN     ] %s.%s\n", test->suite_name, test->name);
+}
+
+static void console_test_output(TestReporter *reporter,
+                                const char *data,
+                                size_t size) {
+    fwrite(data, 1, size, reporter->out);
+}
+
+static void console_test_failure(TestReporter *reporter,
+                                 TestResult kind,
+                                 const char *file,
+                                 int line,
+                                 const char *message) {
+    if (kind == TEST_ERROR) {
+        print_test_label(reporter->out, COLOR_MAGENTA, "ERROR");
+    } else {
+        print_test_label(reporter->out, COLOR_RED, "FAIL");
+    }
+    fprintf(reporter->out, "%s:%d: %s\n", file, line, message);
+}
+
+static void console_test_end(TestReporter *reporter,
+                             const TestCase *test,
+                             TestResult result,
+                             uint64_t duration_ns,
+                             const TestAllocStats *allocs) {
+    static const char *const colors[] = {
+        COLOR_GREEN, COLOR_RED, COLOR_YELLOW, COLOR_MAGENTA};
+    static const char *const labels[] = {"PASS", "FAIL", "SKIP", "ERROR"};
+
+    print_test_label(reporter->out, colors[result], labels[result]);
+    fprintf(reporter->out,
+            "%s.%s (%lu ms",
+            test->suite_name,
+            test->name,
+            (unsigned long)(duration_ns / 1000000u));
+    if (allocs->tracked) {
+        fprintf(reporter->out,
+                ", %zu allocs, %zu bytes, peak %zu bytes",
+                allocs->count,
+                allocs->bytes,
+                allocs->peak);
+        if (allocs->untracked > 0) {
+            fprintf(reporter->out, ", %zu untracked", allocs->untracked);
+        }
+    }
+    fputs(")\n", reporter->out);
+}
+
+static void console_suite_end(TestReporter *reporter,
+                              const TestSuite *suite,
+                              uint64_t duration_ns) {
+    fprintf(reporter->out,
+            "[---------] %zu tests from %s (%lu ms total)\n\n",
+            suite->test_count,
+            suite->name,
+            (unsigned long)(duration_ns / 1000000u));
+}
+
+static void console_run_end(TestReporter *reporter,
+                            const TestCounts *totals,
+                            const uint64_t *durations,
+                            uint64_t duration_ns) {
+    FILE *out = reporter->out;
+
+    (void)duration_ns;
+    print_slowest_tests(out, durations, test_registry.test_count);
+
+    fprintf(out,
+            "[=========] %zu tests from %zu test suites ran.\n",
+            totals->tests,
+            totals->suites);
+
+    if (totals->passed > 0) {
+        print_test_label(out, COLOR_GREEN, "PASSED");
+        fprintf(out, "%zu tests.\n", totals->passed);
+    }
+    if (totals->failed > 0) {
+        print_test_label(out, COLOR_RED, "FAILED");
+        fprintf(out, "%zu tests.\n", totals->failed);
+    }
+    if (totals->skipped > 0) {
+        print_test_label(out, COLOR_YELLOW, "SKIPPED");
+        fprintf(out, "%zu tests.\n", totals->skipped);
+    }
+    if (totals->errors > 0) {
+        print_test_label(out, COLOR_MAGENTA, "ERRORS");
+        fprintf(out, "%zu tests.\n", totals->errors);
+    }
+}
+
+// Shared by the machine-readable formats, which hold a test's output and
+// failures until its result is known
+static void buffered_test_start(TestReporter *reporter, const TestCase *test) {
+    (void)test;
+    rewind(reporter->failures.file);
+    rewind(reporter->output.file);
+    reporter->failure_count = 0;
+}
+
+static void buffered_test_output(TestReporter *reporter,
+                                 const char *data,
+                                 size_t size) {
+    fwrite(data, 1, size, reporter->output.file);
+}
+
+// JUnit XML reporter; a suite is written when it ends so that its counts
+// can go in the opening tag
+static void junit_run_start(TestReporter *reporter,
+                            size_t suite_count,
+                            size_t test_count) {
+    (void)suite_count;
+    (void)test_count;
+    fputs("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<testsuites>\n",
+          reporter->out);
+}
+
+static void junit_suite_start(TestReporter *reporter, const TestSuite *suite) {
+    (void)suite;
+    memset(&reporter->counts, 0, sizeof(reporter->counts));
+    rewind(reporter->suite.file);
+}
+
+static void junit_test_failure(TestReporter *reporter,
+                               TestResult kind,
+                               const char *file,
+                               int line,
+                               const char *message) {
+    FILE *out = reporter->failures.file;
+    const char *tag = kind == TEST_ERROR ? "error" : "failure";
+
+    fprintf(out, "      <%s message=\"", tag);
+    write_xml_escaped(out, message, strlen(message));
+    fputs("\">", out);
+    write_xml_escaped(out, file, strlen(file));
+    fprintf(out, ":%d: ", line);
+    write_xml_escaped(out, message, strlen(message));
+    fprintf(out, "</%s>\n", tag);
+    reporter->failure_count++;
+}
+
+static void junit_test_end(TestReporter *reporter,
+                           const TestCase *test,
+                           TestResult result,
+                           uint64_t duration_ns,
+                           const TestAllocStats *allocs) {
+    FILE *out = reporter->suite.file;
+    size_t length;
+
+    (void)allocs;
+    count_test_result(&reporter->counts, result);
+    fputs("    <testcase classname=\"", out);
+    write_xml_escaped(out, test->suite_name, strlen(test->suite_name));
+    fputs("\" name=\"", out);
+    write_xml_escaped(out, test->name, strlen(test->name));
+    fputs("\" file=\"", out);
+    write_xml_escaped(out, test->file, strlen(test->file));
+    fprintf(out,
+            "\" line=\"%d\" time=\"%.6f\">\n",
+            test->line,
+            (double)duration_ns / 1e9);
+
+    if (result == TEST_SKIP) {
+        fputs("      <skipped/>\n", out);
+    } else if (result != TEST_PASS && reporter->failure_count == 0) {
+        fprintf(
+            out, "      <%s/>\n", result == TEST_ERROR ? "error" : "failure");
+    }
+    flush_test_buffer(&reporter->failures, out);
+    if ((length = test_buffer_length(&reporter->output)) > 0) {
+        fputs("      <system-out>", out);
+        write_xml_escaped(out, reporter->output.data, length);
+        fputs("</system-out>\n", out);
+    }
+    fputs("    </testcase>\n", out);
+}
+
+static void junit_suite_end(TestReporter *reporter,
+                            const TestSuite *suite,
+                            uint64_t duration_ns) {
+    FILE *out = reporter->out;
+
+    fputs("  <testsuite name=\"", out);
+    write_xml_escaped(out, suite->name, strlen(suite->name));
+    fprintf(out,
+            "\" tests=\"%zu\" failures=\"%zu\" errors=\"%zu\" "
+            "skipped=\"%zu\" time=\"%.6f\">\n",
+            reporter->counts.tests,
+            reporter->counts.failed,
+            reporter->counts.errors,
+            reporter->counts.skipped,
+            (double)duration_ns / 1e9);
+    flush_test_buffer(&reporter->suite, out);
+    fputs("  </testsuite>\n", out);
+}
+
+static void junit_run_end(TestReporter *reporter,
+                          const TestCounts *totals,
+                          const uint64_t *durations,
+                          uint64_t duration_ns) {
+    (void)totals;
+    (void)durations;
+    (void)duration_ns;
+    fputs("</testsuites>\n", reporter->out);
+}
+
+// TAP version 13 reporter, failures go in a YAML block after "not ok"
+// The plan comes first, or last under --fail-fast, which may stop the run
+// before every test ran
+static void tap_run_start(TestReporter *reporter,
+                          size_t suite_count,
+                          size_t test_count) {
+    (void)suite_count;
+    fputs("TAP version 13\n", reporter->out);
+    if (!test_config.fail_fast) {
+        fprintf(reporter->out, "1..%zu\n", test_count);
+    }
+}
+
+static void tap_test_failure(TestReporter *reporter,
+                             TestResult kind,
+                             const char *file,
+                             int line,
+                             const char *message) {
+    FILE *out = reporter->failures.file;
+
+    fprintf(out,
+            "    - severity: %s\n      file: ",
+            kind == TEST_ERROR ? "error" : "fail");
+    write_json_string(out, file, strlen(file));
+    fprintf(out, "\n      line: %d\n      message: ", line);
+    write_json_string(out, message, strlen(message));
+    fputc('\n', out);
+    reporter->failure_count++;
+}
+
+static void tap_test_end(TestReporter *reporter,
+                         const TestCase *test,
+                         TestResult result,
+                         uint64_t duration_ns,
+                         const TestAllocStats *allocs) {
+    FILE *out = reporter->out;
+    size_t length;
+
+    (void)allocs;
+    fprintf(out,
+            "%s %zu - %s.%s%s\n",
+            result == TEST_PASS || result == TEST_SKIP ? "ok" : "not ok",
+            ++reporter->test_number,
+            test->suite_name,
+            test->name,
+            result == TEST_SKIP ? " # SKIP" : "");
+    if (result == TEST_PASS || result == TEST_SKIP) {
+        return;
+    }
+
+    fprintf(out, "  ---\n  duration_ms: %.3f\n", (double)duration_ns / 1e6);
+    if (reporter->failure_count > 0) {
+        fputs("  failures:\n", out);
+        flush_test_buffer(&reporter->failures, out);
+    }
+    if ((length = test_buffer_length(&reporter->output)) > 0) {
+        fputs("  output: ", out);
+        write_json_string(out, reporter->output.data, length);
+        fputc('\n', out);
+    }
+    fputs("  ...\n", out);
+}
+
+static void tap_run_end(TestReporter *reporter,
+                        const TestCounts *totals,
+                        const uint64_t *durations,
+                        uint64_t duration_ns) {
+    (void)durations;
+    (void)duration_ns;
+    if (test_config.fail_fast) {
+        fprintf(reporter->out, "1..%zu\n", totals->tests);
+    }
+}
+
+// JSON Lines reporter, one object per test, per suite and per run
+static void jsonl_run_start(TestReporter *reporter,
+                            size_t suite_count,
+                            size_t test_count) {
+    fprintf(reporter->out,
+            "{\"event\":\"run_start\",\"suites\":%zu,\"tests\":%zu}\n",
+            suite_count,
+            test_count);
+}
+
+static void jsonl_test_failure(TestReporter *reporter,
+                               TestResult kind,
+                               const char *file,
+                               int line,
+                               const char *message) {
+    FILE *out = reporter->failures.file;
+
+    fprintf(out,
+            "%s{\"kind\":\"%s\",\"file\":",
+            reporter->failure_count++ > 0 ? "," : "",
+            kind == TEST_ERROR ? "error" : "fail");
+    write_json_string(out, file, strlen(file));
+    fprintf(out, ",\"line\":%d,\"message\":", line);
+    write_json_string(out, message, strlen(message));
+    fputc('}', out);
+}
+
+static void jsonl_suite_start(TestReporter *reporter, const TestSuite *suite) {
+    (void)suite;
+    memset(&reporter->counts, 0, sizeof(reporter->counts));
+}
+
+static void jsonl_test_end(TestReporter *reporter,
+                           const TestCase *test,
+                           TestResult result,
+                           uint64_t duration_ns,
+                           const TestAllocStats *allocs) {
+    FILE *out = reporter->out;
+
+    count_test_result(&reporter->counts, result);
+    fputs("{\"event\":\"test\",\"suite\":", out);
+    write_json_string(out, test->suite_name, strlen(test->suite_name));
+    fputs(",\"name\":", out);
+    write_json_string(out, test->name, strlen(test->name));
+    fputs(",\"file\":", out);
+    write_json_string(out, test->file, strlen(test->file));
+    fprintf(out,
+            ",\"line\":%d,\"result\":\"%s\",\"duration_ms\":%.3f,"
+            "\"failures\":[",
+            test->line,
+            test_result_names[result],
+            (double)duration_ns / 1e6);
+    flush_test_buffer(&reporter->failures, out);
+    fputs("],\"output\":", out);
+    write_json_string(out,
+                      reporter->output.data,
+                      test_buffer_length(&reporter->output));
+    if (allocs->tracked) {
+        fprintf(out,
+                ",\"allocs\":{\"count\":%zu,\"bytes\":%zu,\"peak\":%zu,"
+                "\"leaked_blocks\":%zu,\"leaked_bytes\":%zu,"
+                "\"untracked\":%zu}",
+                allocs->count,
+                allocs->bytes,
+                allocs->peak,
+                allocs->leaked_blocks,
+                allocs->leaked_bytes,
+                allocs->untracked);
+    }
+    fputs("}\n", out);
+}
+
+static void jsonl_suite_end(TestReporter *reporter,
+                            const TestSuite *suite,
+                            uint64_t duration_ns) {
+    FILE *out = reporter->out;
+
+    fputs("{\"event\":\"suite\",\"suite\":", out);
+    write_json_string(out, suite->name, strlen(suite->name));
+    // Tests that ran, fewer than the suite's after --fail-fast
+    fprintf(out,
+            ",\"tests\":%zu,\"duration_ms\":%.3f}\n",
+            reporter->counts.tests,
+            (double)duration_ns / 1e6);
+}
+
+static void jsonl_run_end(TestReporter *reporter,
+                          const TestCounts *totals,
+                          const uint64_t *durations,
+                          uint64_t duration_ns) {
+    (void)durations;
+    fprintf(reporter->out,
+            "{\"event\":\"run_end\",\"tests\":%zu,\"passed\":%zu,"
+            "\"failed\":%zu,\"skipped\":%zu,\"errors\":%zu,"
+            "\"duration_ms\":%.3f}\n",
+            totals->tests,
+            totals->passed,
+            totals->failed,
+            totals->skipped,
+            totals->errors,
+            (double)duration_ns / 1e6);
+}
+
+// Active reporters: the console, plus at most one --output format
+#define TEST_MAX_REPORTERS 2
+#define TEST_REPORT_BUFFER_SIZE (1 << 20)
+
+static TestReporter test_reporters[TEST_MAX_REPORTERS];
+static size_t test_reporter_count = 0;
+
+// Call an event handler of every active reporter
+#define REPORT_TEST_EVENT(event, ...)                         \
+    do {                                                      \
+        for (size_t _i = 0; _i < test_reporter_count; _i++) { \
+            TestReporter *_reporter = &test_reporters[_i];    \
+            if (_reporter->event) {                           \
+                _reporter->event(_reporter, __VA_ARGS__);     \
+            }                                                 \
+        }                                                     \
+    } while (0)
+
+// Set up the reporters for --output=FORMAT[:PATH]. Without a path the format
+// replaces the console on stdout; with one it streams to that file through a
+// single large buffer while the console keeps running.
+static int open_test_reporters(void) {
+    const char *spec = test_config.output;
+    const char *path = spec ? strchr(spec, ':') : NULL;
+    TestReporter *reporter;
+
+    memset(test_reporters, 0, sizeof(test_reporters));
+    test_reporter_count = 0;
+
+    if (!spec || path) {
+        reporter = &test_reporters[test_reporter_count++];
+        reporter->run_start = console_run_start;
+        reporter->suite_start = console_suite_start;
+        reporter->test_start = console_test_start;
+        reporter->test_output = console_test_output;
+        reporter->test_failure = console_test_failure;
+        reporter->test_end = console_test_end;
+        reporter->suite_end = console_suite_end;
+        reporter->run_end = console_run_end;
+        reporter->out = stdout;
+    }
+    if (!spec) {
+        return 0;
+    }
+
+    reporter = &test_reporters[test_reporter_count++];
+    reporter->test_start = buffered_test_start;
+    reporter->test_output = buffered_test_output;
+    switch ((TestOutput)parse_test_output(spec)) {
+    case TEST_OUTPUT_JUNIT:
+        reporter->run_start = junit_run_start;
+        reporter->suite_start = junit_suite_start;
+        reporter->test_failure = junit_test_failure;
+        reporter->test_end = junit_test_end;
+        reporter->suite_end = junit_suite_end;
+        reporter->run_end = junit_run_end;
+        break;
+    case TEST_OUTPUT_TAP:
+        reporter->run_start = tap_run_start;
+        reporter->test_failure = tap_test_failure;
+        reporter->test_end = tap_test_end;
+        reporter->run_end = tap_run_end;
+        break;
+    case TEST_OUTPUT_JSONL:
+        reporter->run_start = jsonl_run_start;
+        reporter->suite_start = jsonl_suite_start;
+        reporter->test_failure = jsonl_test_failure;
+        reporter->test_end = jsonl_test_end;
+        reporter->suite_end = jsonl_suite_end;
+        reporter->run_end = jsonl_run_end;
+        break;
+    }
+
+    reporter->out = stdout;
+    if (path) {
+        if (!(reporter->out = fopen(path + 1, "w"))) {
+            return -1;
+        }
+        reporter->out_buffer = (char *)malloc(TEST_REPORT_BUFFER_SIZE);
+        if (reporter->out_buffer) {
+            setvbuf(reporter->out,
+                    reporter->out_buffer,
+                    _IOFBF,
+                    TEST_REPORT_BUFFER_SIZE);
+        }
+    }
+    if (open_test_buffer(&reporter->suite) != 0 ||
+        open_test_buffer(&reporter->failures) != 0 ||
+        open_test_buffer(&reporter->output) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// Flush and close the reporters, returns -1 if a report could not be written
+static int close_test_reporters(void) {
+    int status = 0;
+
+    for (size_t i = 0; i < test_reporter_count; i++) {
+        TestReporter *reporter = &test_reporters[i];
+
+        close_test_buffer(&reporter->suite);
+        close_test_buffer(&reporter->failures);
+        close_test_buffer(&reporter->output);
+        if (reporter->out && reporter->out != stdout) {
+            if (fclose(reporter->out) != 0) {
+                status = -1;
+            }
+        } else if (fflush(stdout) != 0) {
+            status = -1;
+        }
+        free(reporter->out_buffer);
+    }
+    test_reporter_count = 0;
+    return status;
+}
+
+// Failures of a test running in a forked child are appended to this file as
+// records, the parent replays them to the reporters once the test is done
+static int test_failure_fd = -1;
+
+// Failures the running test recorded, in the process running it
+static size_t test_failure_count = 0;
+
+// Set while property cases are searched and shrunk, failures are then only
+// counted
+static int test_failures_muted = 0;
+
+static void record_test_failure(TestResult kind,
+                                const char *file,
+                                int line,
+                                const char *message) {
+    test_failure_count++;
+    if (test_failures_muted) {
+        return;
+    }
+    pause_test_allocs(1);
+    if (test_failure_fd >= 0) {
+        dprintf(test_failure_fd,
+                "%c%d%c%s%c%s%c",
+                kind == TEST_ERROR ? 'E' : 'F',
+                line,
+                0,
+                file,
+                0,
+                message,
+                0);
+    } else if (test_reporter_count > 0) {
+        REPORT_TEST_EVENT(test_failure, kind, file, line, message);
+    } else {
+        // Outside RUN_ALL_TESTS, e.g. an assertion in a benchmark
+        fprintf(stderr, "%s:%d: %s\n", file, line, message);
+    }
+    pause_test_allocs(0);
+}
+
+NUTEST_API void test_failure(const char *file,
+                             int line,
+                             const char *format,
+                             ...) {
+    char message[4096];
+    va_list args;
+
+    va_start(args, format);
+    vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+    record_test_failure(TEST_FAIL, file, line, message);
+}
+
+NUTEST_API void test_fail_compare(const char *file,
+                                  int line,
+                                  const char *lhs,
+                                  const char *op,
+                                  const char *rhs,
+                                  double lhs_value,
+                                  double rhs_value) {
+    if (strcmp(op, "!=") == 0) {
+        test_failure(file,
+                     line,
+                     "Expected: %s != %s (both are %g)",
+                     lhs,
+                     rhs,
+                     lhs_value);
+    } else {
+        test_failure(file,
+                     line,
+                     "Expected: %s %s %s (%g vs %g)",
+                     lhs,
+                     op,
+                     rhs,
+                     lhs_value,
+                     rhs_value);
+    }
+}
+
+// Per-test bump arena. Chunks are mapped outside malloc so allocation
+// tracking does not count them; a reset rewinds to the first chunk and keeps
+// the others for the next test.
+#define TEST_ARENA_CHUNK ((size_t)64 << 10)
+#define TEST_ARENA_ALIGN 16
+
+typedef struct TestArenaChunk {
+    struct TestArenaChunk *next;
+    size_t size;
+    size_t used;
+} TestArenaChunk;
+
+#define TEST_ARENA_HEADER                              \
+    ((sizeof(TestArenaChunk) + TEST_ARENA_ALIGN - 1) & \
+     ~(size_t)(TEST_ARENA_ALIGN - 1))
+
+static TestArenaChunk *test_arena_first = NULL;
+static TestArenaChunk *test_arena_current = NULL;
+
+NUTEST_API void *test_arena_alloc(size_t size) {
+    size_t need =
+        (size + TEST_ARENA_ALIGN - 1) & ~(size_t)(TEST_ARENA_ALIGN - 1);
+    TestArenaChunk *chunk = test_arena_current;
+    TestArenaChunk *last = NULL;
+    void *block;
+
+    if (need < size) {
+        return NULL;
+    }
+    // Chunks past the current one are empty
+    while (chunk && chunk->size - chunk->used < need) {
+        last = chunk;
+        chunk = chunk->next;
+    }
+    if (!chunk) {
+        size_t length = TEST_ARENA_CHUNK;
+
+        while (length - TEST_ARENA_HEADER < need) {
+            if (length > SIZE_MAX / 2) {
+                return NULL;
+            }
+            length *= 2;
+        }
+        chunk = (TestArenaChunk *)mmap(NULL,
+                                       length,
+                                       PROT_READ | PROT_WRITE,
+                                       MAP_PRIVATE | MAP_ANONYMOUS,
+                                       -1,
+                                       0);
+        if (chunk == MAP_FAILED) {
+            return NULL;
+        }
+        chunk->next = NULL;
+        chunk->size = length;
+        chunk->used = TEST_ARENA_HEADER;
+        if (last) {
+            last->next = chunk;
+        } else {
+            test_arena_first = chunk;
+        }
+    }
+    test_arena_current = chunk;
+    block = (char *)chunk + chunk->used;
+    chunk->used += need;
+    return block;
+}
+
+// Position in the arena; rewinding to it releases everything allocated
+// since, at the end of a test, a property case or a fuzz input
+typedef struct {
+    TestArenaChunk *chunk;
+    size_t used;
+} TestArenaMark;
+
+static TestArenaMark mark_test_arena(void) {
+    TestArenaMark mark = {test_arena_current, 0};
+
+    if (mark.chunk) {
+        mark.used = mark.chunk->used;
+    }
+    return mark;
+}
+
+static void rewind_test_arena(TestArenaMark mark) {
+    TestArenaChunk *chunk = mark.chunk ? mark.chunk : test_arena_first;
+
+    for (; chunk; chunk = chunk->next) {
+        chunk->used = chunk == mark.chunk ? mark.used : TEST_ARENA_HEADER;
+        if (chunk == test_arena_current) {
+            break;
+        }
+    }
+    test_arena_current = mark.chunk ? mark.chunk : test_arena_first;
+}
+
+// Run a test body between the TEST_SETUP and TEST_TEARDOWN of its suite; a
+// test that recorded failures fails even if it returned TEST_PASS, which is
+// how EXPECT_* failures end up in its result
+static TestResult call_test_function(const TestSuite *suite,
+                                     const TestCase *test,
+                                     TestAllocStats *allocs) {
+    const TestFixture *setup = suite->fixtures[FIXTURE_TEST_SETUP];
+    const TestFixture *teardown = suite->fixtures[FIXTURE_TEST_TEARDOWN];
+    TestArenaMark arena = mark_test_arena();
+    TestResult result = TEST_PASS;
+
+    test_failure_count = 0;
+    begin_test_allocs();
+    if (setup) {
+        result = setup->function();
+    }
+    if (result == TEST_PASS) {
+        if (test_failure_count == 0) {
+            result = test->function();
+        }
+        if (teardown && teardown->function() != TEST_PASS &&
+            result != TEST_ERROR) {
+            result = TEST_FAIL;
+        }
+    }
+    end_test_allocs(test, allocs);
+    rewind_test_arena(arena);
+    if (test_failure_count > 0 && result != TEST_ERROR) {
+        result = TEST_FAIL;
+    }
+    return result;
+}
+
+// Run a fixture hook on its own, it fails if it recorded failures
+static TestResult call_test_fixture(const TestFixture *fixture) {
+    TestResult result;
+
+    if (!fixture) {
+        return TEST_PASS;
+    }
+    test_failure_count = 0;
+    result = fixture->function();
+    if (test_failure_count > 0 && result != TEST_ERROR) {
+        result = TEST_FAIL;
+    }
+    return result;
+}
+
+// Pass the failure records a forked test wrote to the reporters
+static void replay_test_failures(int fd, long begin, long end) {
+    size_t size = (size_t)(end - begin);
+    char *records;
+
+    if (end <= begin || !(records = (char *)malloc(size + 1))) {
+        return;
+    }
+    if (pread(fd, records, size, (off_t)begin) == (ssize_t)size) {
+        char *limit = records + size;
+        char *record = records;
+
+        records[size] = '\0';
+        // A record cut short by a crash is dropped
+        while (record < limit) {
+            char *file = record + strlen(record) + 1;
+            char *message = file < limit ? file + strlen(file) + 1 : limit;
+
+            if (message >= limit) {
+                break;
+            }
+            REPORT_TEST_EVENT(test_failure,
+                              record[0] == 'E' ? TEST_ERROR : TEST_FAIL,
+                              file,
+                              atoi(record + 1),
+                              message);
+            record = message + strlen(message) + 1;
+        }
+    }
+    free(records);
+}
+
+// Pass output captured from a forked test to the reporters
+static void replay_test_output(int fd, long begin, long end) {
+    char buffer[4096];
+
+    while (begin < end) {
+        size_t want = (size_t)(end - begin) < sizeof(buffer)
+                          ? (size_t)(end - begin)
+                          : sizeof(buffer);
+        ssize_t got = pread(fd, buffer, want, (off_t)begin);
+        if (got <= 0) {
+            break;
+        }
+        REPORT_TEST_EVENT(test_output, buffer, (size_t)got);
+        begin += got;
+    }
+}
+
+// Outcome of a test run in a forked child, lives in shared memory
+typedef struct {
+    int done;
+    TestResult result;
+    size_t worker;
+    uint64_t duration_ns;
+    long output_begin;
+    long output_end;
+    long failures_begin;
+    long failures_end;
+    int crashed;
+    int status;
+    int timed_out;
+    TestAllocStats allocs;
+} TestSlot;
+
+// Report the failures of a forked test, including why its process ended
+// without a result
+static void report_test_failures(const TestCase *test,
+                                 const TestSlot *slot,
+                                 int failures_fd) {
+    char message[256];
+
+    if (failures_fd >= 0) {
+        replay_test_failures(
+            failures_fd, slot->failures_begin, slot->failures_end);
+    }
+    if (!slot->crashed) {
+        return;
+    }
+
+    if (slot->timed_out) {
+        snprintf(message,
+                 sizeof(message),
+                 "timed out after %lu ms (limit %ld ms)",
+                 (unsigned long)(slot->duration_ns / 1000000u),
+                 test_timeout_ms(test, 1));
+    } else if (WIFSIGNALED(slot->status)) {
+        snprintf(message,
+                 sizeof(message),
+                 "killed by signal %d (%s)",
+                 WTERMSIG(slot->status),
+                 strsignal(WTERMSIG(slot->status)));
+    } else {
+        snprintf(message,
+                 sizeof(message),
+                 "exited with status %d",
+                 WIFEXITED(slot->status) ? WEXITSTATUS(slot->status) : -1);
+    }
+    REPORT_TEST_EVENT(
+        test_failure, TEST_ERROR, test->file, test->line, message);
+}
+
+// Failure records of SUITE_SETUP hooks, replayed with the suite's first test
+static FILE *test_suite_failures = NULL;
+
+// Run the SUITE_SETUP of a suite before its first test starts, keeping the
+// failures it records until that test is reported
+static void setup_test_suite(TestSuite *suite) {
+    const TestFixture *setup = suite->fixtures[FIXTURE_SUITE_SETUP];
+    int fd = test_failure_fd;
+
+    if (!setup) {
+        suite->setup_result = TEST_PASS;
+        return;
+    }
+    if (!test_suite_failures) {
+        test_suite_failures = tmpfile();
+    }
+    if (test_suite_failures) {
+        test_failure_fd = fileno(test_suite_failures);
+        suite->failures_begin = (long)lseek(test_failure_fd, 0, SEEK_END);
+    }
+    suite->setup_result = call_test_fixture(setup);
+    if (test_suite_failures) {
+        suite->failures_end = (long)lseek(test_failure_fd, 0, SEEK_END);
+    }
+    test_failure_fd = fd;
+}
+
+// Stand in for a test of a suite whose SUITE_SETUP did not pass, the first
+// one reports what the setup recorded
+static TestResult report_suite_setup(const TestSuite *suite,
+                                     const TestCase *test) {
+    const TestFixture *setup = suite->fixtures[FIXTURE_SUITE_SETUP];
+    char message[256];
+
+    if (suite->setup_result == TEST_SKIP) {
+        return TEST_SKIP;
+    }
+    if (test == &suite->tests[0] && test_suite_failures) {
+        replay_test_failures(fileno(test_suite_failures),
+                             suite->failures_begin,
+                             suite->failures_end);
+    }
+    snprintf(message,
+             sizeof(message),
+             "SUITE_SETUP(%s) failed, the test was not run",
+             suite->name);
+    REPORT_TEST_EVENT(
+        test_failure, TEST_ERROR, setup->file, setup->line, message);
+    return TEST_ERROR;
+}
+
+// Run the SUITE_TEARDOWN of a suite once its last test is done, before that
+// test is reported; what it records is reported with the test, which fails
+static TestResult teardown_test_suite(const TestSuite *suite,
+                                      TestResult result) {
+    if (suite->setup_result != TEST_PASS ||
+        call_test_fixture(suite->fixtures[FIXTURE_SUITE_TEARDOWN]) ==
+            TEST_PASS) {
+        return result;
+    }
+    return result == TEST_ERROR ? TEST_ERROR : TEST_FAIL;
+}
+
+// Failure records of the tests the serial runner forks
+static FILE *test_isolated_failures = NULL;
+
+// Run one test in a forked child so the serial runner survives a hang or a
+// crash; the child writes its result to shared memory
+static TestResult run_test_isolated(const TestSuite *suite,
+                                    const TestCase *test,
+                                    long timeout_ms,
+                                    uint64_t *duration_ns,
+                                    TestAllocStats *allocs) {
+    TestSlot *slot = (TestSlot *)map_test_shared(sizeof(TestSlot));
+    TestResult result;
+    uint64_t start, pause_ns = 10000;
+    int status = 0, fd = -1;
+    pid_t pid;
+
+    if (!test_isolated_failures) {
+        test_isolated_failures = tmpfile();
+    }
+    if (test_isolated_failures) {
+        fd = fileno(test_isolated_failures);
+    }
+
+    if (slot && fd >= 0) {
+        slot->failures_begin = (long)lseek(fd, 0, SEEK_END);
+    }
+
+    fflush(NULL);
+    start = test_now_ns();
+    if (!slot || fd < 0 || (pid = fork()) < 0) {
+        if (slot) {
+            munmap(slot, sizeof(TestSlot));
+        }
+        result = call_test_function(suite, test, allocs);
+        *duration_ns = test_now_ns() - start;
+        return result;
+    }
+    if (pid == 0) {
+        test_failure_fd = fd;
+        slot->result = call_test_function(suite, test, &slot->allocs);
+        __atomic_store_n(&slot->done, 1, __ATOMIC_RELEASE);
+        fflush(stdout);
+        fflush(stderr);
+        _exit(EXIT_SUCCESS);
+    }
+
+    // Back off from 10 us to 1 ms so short tests are not padded
+    while (waitpid(pid, &status, WNOHANG) == 0) {
+        if (test_now_ns() - start > (uint64_t)timeout_ms * 1000000u) {
+            slot->timed_out = 1;
+            kill(pid, SIGKILL);
+            waitpid(pid, &status, 0);
+            break;
+        }
+        struct timespec pause = {0, (long)pause_ns};
+        nanosleep(&pause, NULL);
+        pause_ns = pause_ns < 1000000 ? pause_ns * 2 : pause_ns;
+    }
+    *duration_ns = slot->duration_ns = test_now_ns() - start;
+    slot->failures_end = (long)lseek(fd, 0, SEEK_END);
+
+    if (slot->timed_out || !__atomic_load_n(&slot->done, __ATOMIC_ACQUIRE)) {
+        slot->result = TEST_ERROR;
+        slot->crashed = 1;
+        slot->status = status;
+    }
+    result = slot->result;
+    *allocs = slot->allocs;
+    report_test_failures(test, slot, fd);
+    munmap(slot, sizeof(TestSlot));
+    return result;
+}
+
+// Output of tests and suite fixtures run in the runner's own process while an
+// --output format is active, collected like that of the workers so it cannot
+// garble a report on stdout and goes in a report written to a file
+typedef struct {
+    FILE *file;
+    int saved[2]; // The runner's own stdout and stderr while capturing
+} TestCapture;
+
+static TestCapture test_capture = {NULL, {-1, -1}};
+
+// Send stdout and stderr to the capture file until release_test_output,
+// the console alone needs no capture
+static void capture_test_output(void) {
+    if (!test_config.output ||
+        (!test_capture.file && !(test_capture.file = tmpfile()))) {
+        return;
+    }
+    fflush(stdout);
+    fflush(stderr);
+    test_capture.saved[0] = dup(STDOUT_FILENO);
+    test_capture.saved[1] = dup(STDERR_FILENO);
+    if (test_capture.saved[0] < 0 || test_capture.saved[1] < 0) {
+        close(test_capture.saved[0]);
+        close(test_capture.saved[1]);
+        test_capture.saved[0] = test_capture.saved[1] = -1;
+        return;
+    }
+    dup2(fileno(test_capture.file), STDOUT_FILENO);
+    dup2(fileno(test_capture.file), STDERR_FILENO);
+}
+
+// Give the runner its stdout and stderr back, the captured output stays in
+// the capture file
+static void release_test_output(void) {
+    if (test_capture.saved[0] < 0) {
+        return;
+    }
+    fflush(stdout);
+    fflush(stderr);
+    dup2(test_capture.saved[0], STDOUT_FILENO);
+    dup2(test_capture.saved[1], STDERR_FILENO);
+    close(test_capture.saved[0]);
+    close(test_capture.saved[1]);
+    test_capture.saved[0] = test_capture.saved[1] = -1;
+}
+
+// Offset in the capture file where the next captured output goes
+static long captured_test_output(void) {
+    return test_capture.file
+               ? (long)lseek(fileno(test_capture.file), 0, SEEK_END)
+               : 0;
+}
+
+// Pass the output captured between two offsets to the reporters
+static void replay_captured_output(long begin, long end) {
+    if (test_capture.file) {
+        replay_test_output(fileno(test_capture.file), begin, end);
+    }
+}
+
+// Run every suite in the calling process; tests with a timeout run in a
+// child process each. What suite fixtures print before the first test is
+// reported with it.
+static void run_tests_serial(TestCounts *totals,
+                             uint64_t *durations,
+                             unsigned char *results) {
+    TestSuite view;
+    int stopped = 0;
+
+    memset(&view, 0, sizeof(view));
+    while (!stopped && next_test_suite(&view)) {
+        TestSuite *suite = &view;
+        uint64_t started = test_now_ns();
+        long output = captured_test_output();
+
+        REPORT_TEST_EVENT(suite_start, suite);
+        totals->suites++;
+        capture_test_output();
+        setup_test_suite(suite);
+        release_test_output();
+        for (size_t j = 0; j < suite->test_count && !stopped; j++) {
+            TestCase *test = &suite->tests[j];
+            size_t index = (size_t)(test - test_registry.tests);
+            uint64_t *duration = &durations[index];
+            long timeout_ms = test_timeout_ms(test, 0);
+            TestAllocStats allocs;
+            TestResult result;
+
+            REPORT_TEST_EVENT(test_start, test);
+            capture_test_output();
+            if (suite->setup_result != TEST_PASS) {
+                memset(&allocs, 0, sizeof(allocs));
+                result = report_suite_setup(suite, test);
+            } else if (timeout_ms > 0) {
+                result = run_test_isolated(
+                    suite, test, timeout_ms, duration, &allocs);
+            } else {
+                uint64_t start = test_now_ns();
+                result = call_test_function(suite, test, &allocs);
+                *duration = test_now_ns() - start;
+            }
+            // --fail-fast ends the suite here
+            stopped = stop_after_test(result);
+            if (stopped || j + 1 == suite->test_count) {
+                result = teardown_test_suite(suite, result);
+                stopped = stop_after_test(result);
+            }
+            release_test_output();
+            replay_captured_output(output, captured_test_output());
+            output = captured_test_output();
+            REPORT_TEST_EVENT(test_end, test, result, *duration, &allocs);
+            count_test_result(totals, result);
+            results[index] = (unsigned char)result;
+        }
+        REPORT_TEST_EVENT(suite_end, suite, test_now_ns() - started);
+    }
+}
+
+// Per-worker deque of test indices, lives in shared memory
+typedef struct {
+    int lock;
+    size_t head;
+    size_t tail;
+    size_t current;
+    uint64_t started_ns;
+} TestQueue;
+
+// Worker process bookkeeping, parent side only
+typedef struct {
+    pid_t pid;
+    FILE *output;
+    FILE *failures;
+    int timed_out;
+} TestWorker;
+
+// Forked worker pool state
+typedef struct {
+    TestCase *tests;
+    TestSuite *suites;
+    size_t *suite_of;
+    size_t test_count;
+    TestSlot *slots;
+    TestQueue *queues;
+    size_t *items;
+    TestWorker *workers;
+    size_t worker_count;
+    long *setup_output; // Where each suite's setup output begins and ends
+} TestPool;
+
+#define TEST_NONE SIZE_MAX
+
+// Queue locks record their owner so a dead worker's lock can be released
+static void lock_test_queue(TestQueue *queue, int owner) {
+    int unlocked = 0;
+    while (!__atomic_compare_exchange_n(&queue->lock,
+                                        &unlocked,
+                                        owner,
+                                        0,
+                                        __ATOMIC_ACQUIRE,
+                                        __ATOMIC_RELAXED)) {
+        unlocked = 0;
+        sched_yield();
+    }
+}
+
+static void unlock_test_queue(TestQueue *queue) {
+    __atomic_store_n(&queue->lock, 0, __ATOMIC_RELEASE);
+}
+
+// Pop from the front of our own queue, otherwise steal from the back of
+// the fullest other queue
+static size_t take_test(TestPool *pool, size_t worker) {
+    TestQueue *own = &pool->queues[worker];
+    int owner = (int)worker + 1;
+    size_t index = TEST_NONE;
+
+    lock_test_queue(own, owner);
+    if (own->head < own->tail) {
+        index = pool->items[own->head++];
+    }
+    unlock_test_queue(own);
+
+    while (index == TEST_NONE) {
+        size_t victim = TEST_NONE;
+        size_t most = 0;
+
+        for (size_t i = 0; i < pool->worker_count; i++) {
+            TestQueue *queue = &pool->queues[i];
+            size_t head = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+            size_t tail = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+            if (i != worker && tail > head && tail - head > most) {
+                most = tail - head;
+                victim = i;
+            }
+        }
+        if (victim == TEST_NONE) {
+            break;
+        }
+
+        TestQueue *queue = &pool->queues[victim];
+        lock_test_queue(queue, owner);
+        if (queue->head < queue->tail) {
+            index = pool->items[--queue->tail];
+        }
+        unlock_test_queue(queue);
+    }
+    return index;
+}
+
+// Worker process main loop, never returns
+static void run_test_worker(TestPool *pool, size_t worker) {
+    TestQueue *queue = &pool->queues[worker];
+    int fd = fileno(pool->workers[worker].output);
+
+    test_failure_fd = fileno(pool->workers[worker].failures);
+    dup2(fd, STDOUT_FILENO);
+    dup2(fd, STDERR_FILENO);
+    // Line buffering keeps output ordered and survives a crash, glibc
+    // ignores _IOLBF without an explicit buffer once stdout has been used
+    static char line_buffer[BUFSIZ];
+    setvbuf(stdout, line_buffer, _IOLBF, sizeof(line_buffer));
+
+    for (;;) {
+        size_t index = take_test(pool, worker);
+        if (index == TEST_NONE) {
+            break;
+        }
+
+        TestSlot *slot = &pool->slots[index];
+        TestSuite *suite = &pool->suites[pool->suite_of[index]];
+        slot->worker = worker;
+        slot->output_begin = (long)lseek(fd, 0, SEEK_END);
+        slot->failures_begin = (long)lseek(test_failure_fd, 0, SEEK_END);
+        queue->started_ns = test_now_ns();
+        __atomic_store_n(&queue->current, index, __ATOMIC_RELEASE);
+
+        if (suite->setup_result == TEST_PASS) {
+            slot->result =
+                call_test_function(suite, &pool->tests[index], &slot->allocs);
+        } else {
+            slot->result = suite->setup_result == TEST_SKIP ? TEST_SKIP
+                                                            : TEST_ERROR;
+        }
+        slot->duration_ns = test_now_ns() - queue->started_ns;
+
+        fflush(stdout);
+        fflush(stderr);
+        slot->output_end = (long)lseek(fd, 0, SEEK_END);
+        slot->failures_end = (long)lseek(test_failure_fd, 0, SEEK_END);
+        __atomic_store_n(&slot->done, 1, __ATOMIC_RELEASE);
+        __atomic_store_n(&queue->current, TEST_NONE, __ATOMIC_RELEASE);
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+    _exit(EXIT_SUCCESS);
+}
+
+// Fork a worker for the given queue
+static int spawn_test_worker(TestPool *pool, size_t worker) {
+    // Report files too, or a test calling exit() would write their buffers
+    // a second time
+    fflush(NULL);
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        return -1;
+    }
+    if (pid == 0) {
+        run_test_worker(pool, worker);
+    }
+    pool->workers[worker].pid = pid;
+    pool->workers[worker].timed_out = 0;
+    return 0;
+}
+
+// Whether any queue still holds tests
+static int pending_tests(const TestPool *pool) {
+    for (size_t i = 0; i < pool->worker_count; i++) {
+        const TestQueue *queue = &pool->queues[i];
+        if (__atomic_load_n(&queue->head, __ATOMIC_ACQUIRE) <
+            __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Record the test a worker was running when it died
+static void reap_test_worker(TestPool *pool, size_t worker, int status) {
+    TestWorker *proc = &pool->workers[worker];
+    TestQueue *queue = &pool->queues[worker];
+    size_t index = __atomic_load_n(&queue->current, __ATOMIC_ACQUIRE);
+    int owner = (int)worker + 1;
+
+    // A worker killed while holding a queue lock must not wedge the pool
+    for (size_t i = 0; i < pool->worker_count; i++) {
+        __atomic_compare_exchange_n(&pool->queues[i].lock,
+                                    &owner,
+                                    0,
+                                    0,
+                                    __ATOMIC_RELEASE,
+                                    __ATOMIC_RELAXED);
+        owner = (int)worker + 1;
+    }
+
+    if (index != TEST_NONE &&
+        !__atomic_load_n(&pool->slots[index].done, __ATOMIC_ACQUIRE)) {
+        TestSlot *slot = &pool->slots[index];
+
+        slot->output_end = (long)lseek(fileno(proc->output), 0, SEEK_END);
+        slot->failures_end =
+            (long)lseek(fileno(proc->failures), 0, SEEK_END);
+        slot->duration_ns = test_now_ns() - queue->started_ns;
+        slot->result = TEST_ERROR;
+        slot->crashed = 1;
+        slot->status = status;
+        slot->timed_out = proc->timed_out;
+        queue->current = TEST_NONE;
+        __atomic_store_n(&slot->done, 1, __ATOMIC_RELEASE);
+    }
+    proc->pid = 0;
+}
+
+// Kill and reap every live worker
+static void stop_test_workers(TestPool *pool) {
+    for (size_t w = 0; w < pool->worker_count; w++) {
+        if (pool->workers[w].pid > 0) {
+            kill(pool->workers[w].pid, SIGKILL);
+            waitpid(pool->workers[w].pid, NULL, 0);
+            pool->workers[w].pid = 0;
+        }
+    }
+}
+
+// Run every suite on a pool of forked workers, reporting in registry order
+static int run_tests_parallel(TestCounts *totals,
+                              uint64_t *durations,
+                              unsigned char *results) {
+    TestPool pool;
+    uint64_t suite_ns = 0;
+    size_t reported = 0;
+    size_t live = 0;
+    int stopped = 0;
+    int ok = 0;
+
+    memset(&pool, 0, sizeof(pool));
+    pool.tests = test_registry.tests;
+    pool.test_count = test_registry.test_count;
+    pool.worker_count = test_config.jobs < pool.test_count
+                            ? test_config.jobs
+                            : pool.test_count;
+    if (pool.worker_count < 2) {
+        return -1;
+    }
+
+    pool.suites =
+        (TestSuite *)calloc(test_registry.suite_count, sizeof(TestSuite));
+    pool.suite_of = (size_t *)malloc(pool.test_count * sizeof(size_t));
+    pool.workers =
+        (TestWorker *)calloc(pool.worker_count, sizeof(TestWorker));
+    pool.slots =
+        (TestSlot *)map_test_shared(pool.test_count * sizeof(TestSlot));
+    pool.queues =
+        (TestQueue *)map_test_shared(pool.worker_count * sizeof(TestQueue));
+    pool.items = (size_t *)map_test_shared(pool.test_count * sizeof(size_t));
+    pool.setup_output =
+        (long *)malloc((test_registry.suite_count + 1) * sizeof(long));
+    if (!pool.suites || !pool.suite_of || !pool.workers || !pool.slots ||
+        !pool.queues || !pool.items || !pool.setup_output) {
+        goto cleanup;
+    }
+
+    for (size_t i = 0, k = 0; i < test_registry.suite_count; i++) {
+        if (i > 0) {
+            pool.suites[i] = pool.suites[i - 1];
+        }
+        next_test_suite(&pool.suites[i]);
+        for (size_t j = 0; j < pool.suites[i].test_count; j++) {
+            pool.suite_of[k++] = i;
+        }
+    }
+
+    for (size_t k = 0; k < pool.test_count; k++) {
+        pool.slots[k].worker = TEST_NONE;
+    }
+
+    // Deal tests round-robin so early results arrive early
+    for (size_t w = 0, base = 0; w < pool.worker_count; w++) {
+        TestQueue *queue = &pool.queues[w];
+        queue->head = queue->tail = base;
+        queue->current = TEST_NONE;
+        for (size_t k = w; k < pool.test_count; k += pool.worker_count) {
+            pool.items[queue->tail++] = k;
+        }
+        base = queue->tail;
+
+        pool.workers[w].output = tmpfile();
+        pool.workers[w].failures = tmpfile();
+        if (!pool.workers[w].output || !pool.workers[w].failures) {
+            goto cleanup;
+        }
+    }
+
+    // Suites are set up before the workers fork, so every worker shares
+    // what their SUITE_SETUP built; what they print goes with their first test
+    pool.setup_output[0] = captured_test_output();
+    capture_test_output();
+    for (size_t i = 0; i < test_registry.suite_count; i++) {
+        setup_test_suite(&pool.suites[i]);
+        fflush(stdout);
+        pool.setup_output[i + 1] = captured_test_output();
+    }
+    release_test_output();
+    for (size_t w = 0; w < pool.worker_count; w++) {
+        if (spawn_test_worker(&pool, w) == 0) {
+            live++;
+        }
+    }
+    if (live == 0) {
+        capture_test_output();
+        for (size_t i = 0; i < test_registry.suite_count; i++) {
+            teardown_test_suite(&pool.suites[i], TEST_PASS);
+        }
+        release_test_output();
+        goto cleanup;
+    }
+    ok = 1;
+
+    while (!stopped && reported < pool.test_count) {
+        int status;
+        pid_t pid;
+
+        while (live > 0 && (pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            for (size_t w = 0; w < pool.worker_count; w++) {
+                if (pool.workers[w].pid != pid) {
+                    continue;
+                }
+                reap_test_worker(&pool, w, status);
+                live--;
+                if (pending_tests(&pool) && spawn_test_worker(&pool, w) == 0) {
+                    live++;
+                }
+                break;
+            }
+        }
+
+        // Watchdog for hung tests
+        uint64_t now = test_now_ns();
+        for (size_t w = 0; w < pool.worker_count; w++) {
+            TestQueue *queue = &pool.queues[w];
+            size_t index = __atomic_load_n(&queue->current, __ATOMIC_ACQUIRE);
+            long timeout_ms;
+
+            if (pool.workers[w].pid <= 0 || pool.workers[w].timed_out ||
+                index == TEST_NONE) {
+                continue;
+            }
+            timeout_ms = test_timeout_ms(&pool.tests[index], 1);
+            if (timeout_ms > 0 &&
+                now - queue->started_ns > (uint64_t)timeout_ms * 1000000u) {
+                pool.workers[w].timed_out = 1;
+                kill(pool.workers[w].pid, SIGKILL);
+            }
+        }
+
+        // Report finished tests in registry order
+        int progressed = 0;
+        while (!stopped && reported < pool.test_count &&
+               __atomic_load_n(&pool.slots[reported].done, __ATOMIC_ACQUIRE)) {
+            TestSuite *suite = &pool.suites[pool.suite_of[reported]];
+            TestCase *test = &pool.tests[reported];
+            TestSlot *slot = &pool.slots[reported];
+
+            if (test == &suite->tests[0]) {
+                suite_ns = 0;
+                REPORT_TEST_EVENT(suite_start, suite);
+                totals->suites++;
+            }
+            REPORT_TEST_EVENT(test_start, test);
+            if (test == &suite->tests[0]) {
+                size_t i = pool.suite_of[reported];
+                replay_captured_output(pool.setup_output[i],
+                                       pool.setup_output[i + 1]);
+            }
+            if (suite->setup_result != TEST_PASS) {
+                report_suite_setup(suite, test);
+            } else if (slot->worker != TEST_NONE) {
+                TestWorker *worker = &pool.workers[slot->worker];
+                replay_test_output(fileno(worker->output),
+                                   slot->output_begin,
+                                   slot->output_end);
+                report_test_failures(test, slot, fileno(worker->failures));
+            }
+            // --fail-fast stops the workers before the suite's teardown
+            if ((stopped = stop_after_test(slot->result))) {
+                stop_test_workers(&pool);
+            }
+            if (stopped || test == &suite->tests[suite->test_count - 1]) {
+                long output = captured_test_output();
+
+                capture_test_output();
+                slot->result = teardown_test_suite(suite, slot->result);
+                release_test_output();
+                replay_captured_output(output, captured_test_output());
+                if (!stopped && (stopped = stop_after_test(slot->result))) {
+                    stop_test_workers(&pool);
+                }
+            }
+            REPORT_TEST_EVENT(test_end,
+                              test,
+                              slot->result,
+                              slot->duration_ns,
+                              &slot->allocs);
+            count_test_result(totals, slot->result);
+            results[reported] = (unsigned char)slot->result;
+            durations[reported] = slot->duration_ns;
+            suite_ns += slot->duration_ns;
+
+            // Tests overlap, so a suite's total is its tests' CPU time
+            if (stopped || test == &suite->tests[suite->test_count - 1]) {
+                REPORT_TEST_EVENT(suite_end, suite, suite_ns);
+                suite_ns = 0;
+            }
+            if (stopped) {
+                // Later suites were set up before the workers forked, they
+                // are torn down unreported
+                capture_test_output();
+                for (size_t i = pool.suite_of[reported] + 1;
+                     i < test_registry.suite_count;
+                     i++) {
+                    teardown_test_suite(&pool.suites[i], TEST_PASS);
+                }
+                release_test_output();
+            }
+            reported++;
+            progressed = 1;
+        }
+
+        if (live == 0 && !progressed) {
+            // No worker could be respawned, whatever is left cannot run
+            for (size_t k = reported; k < pool.test_count; k++) {
+                if (!pool.slots[k].done) {
+                    pool.slots[k].result = TEST_ERROR;
+                    pool.slots[k].done = 1;
+                }
+            }
+            continue;
+        }
+        if (!progressed) {
+            struct timespec pause = {0, 1000000};
+            nanosleep(&pause, NULL);
+        }
+    }
+
+cleanup:
+    if (pool.workers) {
+        stop_test_workers(&pool);
+        for (size_t w = 0; w < pool.worker_count; w++) {
+            if (pool.workers[w].output) {
+                fclose(pool.workers[w].output);
+            }
+            if (pool.workers[w].failures) {
+                fclose(pool.workers[w].failures);
+            }
+        }
+    }
+    if (pool.items) {
+        munmap(pool.items, pool.test_count * sizeof(size_t));
+    }
+    if (pool.queues) {
+        munmap(pool.queues, pool.worker_count * sizeof(TestQueue));
+    }
+    if (pool.slots) {
+        munmap(pool.slots, pool.test_count * sizeof(TestSlot));
+    }
+    free(pool.workers);
+    free(pool.setup_output);
+    free(pool.suite_of);
+    free(pool.suites);
+    return ok ? 0 : -1;
+}
+
+// Fuzzing
+//
+// The corpus of a FUZZ_TEST lives in <corpus>/Suite.name, one input per
+// file. --fuzz forks --jobs workers (at least one) per target that mutate
+// the corpus and share a map of the coverage reached so far. An input that
+// reaches new coverage is saved to the corpus, where the other workers pick
+// it up. An input that fails, crashes or outlives the timeout is saved under
+// <corpus>/crashes and ends the target's run.
+typedef struct {
+    uint8_t *data;
+    size_t size;
+    uint64_t name;
+} FuzzInput;
+
+typedef struct {
+    FuzzInput *inputs;
+    size_t count;
+    size_t capacity;
+} FuzzCorpus;
+
+// State shared by the workers of a target and the parent
+typedef struct {
+    int stop;
+    uint64_t generation;
+    size_t corpus;
+    size_t features;
+    uint8_t seen[FUZZ_MAP_SIZE];
+} FuzzShared;
+
+// Input a worker is running, so the parent can save the one it died on
+typedef struct {
+    uint64_t started_ns;
+    uint64_t runs;
+    size_t size;
+} FuzzSlot;
+
+typedef struct {
+    const TestCase *target;
+    char name[256];
+    char dir[4096];
+    FuzzShared *shared;
+    FuzzSlot *slots;
+    uint8_t *inputs;
+    size_t workers;
+    size_t worker;
+    size_t max_len;
+    size_t mapped;
+    uint64_t random;
+} FuzzRun;
+
+// Exit status of a worker whose input failed an assertion
+#define FUZZ_EXIT_FAILED 86
+
+// FNV-1a of an input, names the file it is saved to
+static uint64_t hash_fuzz_input(const uint8_t *data, size_t size) {
+    uint64_t hash = UINT64_C(14695981039346656037);
+
+    for (size_t i = 0; i < size; i++) {
+        hash ^= data[i];
+        hash *= UINT64_C(1099511628211);
+    }
+    return hash;
+}
+
+static int make_fuzz_dir(const char *path) {
+    return mkdir(path, 0777) == 0 || errno == EEXIST ? 0 : -1;
+}
+
+// Read a file, at most limit bytes of it unless limit is 0; NULL on error
+static uint8_t *read_fuzz_file(const char *path, size_t limit, size_t *size) {
+    FILE *file = fopen(path, "rb");
+    struct stat info;
+    uint8_t *data = NULL;
+
+    if (!file) {
+        return NULL;
+    }
+    if (fstat(fileno(file), &info) == 0 && S_ISREG(info.st_mode)) {
+        *size = (size_t)info.st_size;
+        if (limit && *size > limit) {
+            *size = limit;
+        }
+        data = (uint8_t *)malloc(*size ? *size : 1);
+        if (data && fread(data, 1, *size, file) != *size) {
+            free(data);
+            data = NULL;
+        }
+    }
+    fclose(file);
+    return data;
+}
+
+static int write_fuzz_file(const char *path, const uint8_t *data, size_t size) {
+    FILE *file = fopen(path, "wb");
+    int status = 0;
+
+    if (!file) {
+        return -1;
+    }
+    if (size > 0 && fwrite(data, 1, size, file) != size) {
+        status = -1;
+    }
+    if (fclose(file) != 0) {
+        status = -1;
+    }
+    return status;
+}
+
+static int compare_fuzz_names(const void *a, const void *b) {
+    return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+static void free_fuzz_names(char **names, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        free(names[i]);
+    }
+    free(names);
+}
+
+// Names of the inputs in a corpus directory, sorted; hidden files are left
+// out, which covers inputs still being written. A missing directory is an
+// empty corpus. Returns the count, -1 on error.
+static long list_fuzz_corpus(const char *dir, char ***names) {
+    DIR *handle = opendir(dir);
+    struct dirent *entry;
+    char **list = NULL;
+    size_t count = 0, capacity = 0;
+
+    *names = NULL;
+    if (!handle) {
+        return errno == ENOENT ? 0 : -1;
+    }
+    while ((entry = readdir(handle))) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        if (count == capacity) {
+            char **grown;
+
+            capacity = capacity ? capacity * 2 : 64;
+            grown = (char **)realloc(list, capacity * sizeof(char *));
+            if (!grown) {
+                break;
+            }
+            list = grown;
+        }
+        if (!(list[count] = strdup(entry->d_name))) {
+            break;
+        }
+        count++;
+    }
+    closedir(handle);
+    if (entry) {
+        free_fuzz_names(list, count);
+        errno = ENOMEM;
+        return -1;
+    }
+    if (count > 1) {
+        qsort(list, count, sizeof(char *), compare_fuzz_names);
+    }
+    *names = list;
+    return (long)count;
+}
+
+// Run a target on one input, -1 if it failed
+static int run_fuzz_target(FuzzFunc fuzz, const uint8_t *data, size_t size) {
+    size_t failures = test_failure_count;
+    TestArenaMark arena = mark_test_arena();
+    TestResult result = fuzz(data, size);
+
+    rewind_test_arena(arena);
+    return result == TEST_FAIL || result == TEST_ERROR ||
+                   test_failure_count > failures
+               ? -1
+               : 0;
+}
+
+// Test body of a FUZZ_TEST: run the target on the empty input, then on
+// every input of its corpus in name order
+NUTEST_API TestResult run_fuzz_corpus(const char *name,
+                                      FuzzFunc fuzz,
+                                      const char *file,
+                                      int line) {
+    static const uint8_t empty[1] = {0};
+    TestResult result = TEST_PASS;
+    char dir[4096], path[4352];
+    char **names;
+    long count;
+
+    snprintf(dir, sizeof(dir), "%s/%s", test_config.corpus, name);
+    if ((count = list_fuzz_corpus(dir, &names)) < 0) {
+        test_failure(
+            file, line, "Cannot read corpus %s: %s", dir, strerror(errno));
+        return TEST_FAIL;
+    }
+    if (run_fuzz_target(fuzz, empty, 0) != 0) {
+        test_failure(file, line, "Failed on the empty input");
+        result = TEST_FAIL;
+    }
+    for (long i = 0; i < count; i++) {
+        uint8_t *data;
+        size_t size;
+
+        snprintf(path, sizeof(path), "%s/%s", dir, names[i]);
+        if (!(data = read_fuzz_file(path, 0, &size))) {
+            test_failure(file, line, "Cannot read input %s", path);
+            result = TEST_FAIL;
+            continue;
+        }
+        if (run_fuzz_target(fuzz, data, size) != 0) {
+            test_failure(file,
+                         line,
+                         "Failed on corpus input %s (%zu bytes)",
+                         path,
+                         size);
+            result = TEST_FAIL;
+        }
+        free(data);
+    }
+    free_fuzz_names(names, (size_t)count);
+    return result;
+}
+
+static int has_fuzz_input(const FuzzCorpus *corpus, uint64_t name) {
+    for (size_t i = 0; i < corpus->count; i++) {
+        if (corpus->inputs[i].name == name) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Add a copy of an input to a worker's corpus
+static int add_fuzz_input(FuzzCorpus *corpus,
+                          const uint8_t *data,
+                          size_t size,
+                          uint64_t name) {
+    FuzzInput *input;
+
+    if (corpus->count == corpus->capacity) {
+        size_t capacity = corpus->capacity ? corpus->capacity * 2 : 64;
+        FuzzInput *grown = (FuzzInput *)realloc(
+            corpus->inputs, capacity * sizeof(FuzzInput));
+        if (!grown) {
+            return -1;
+        }
+        corpus->inputs = grown;
+        corpus->capacity = capacity;
+    }
+    input = &corpus->inputs[corpus->count];
+    if (!(input->data = (uint8_t *)malloc(size ? size : 1))) {
+        return -1;
+    }
+    memcpy(input->data, data, size);
+    input->size = size;
+    input->name = name;
+    corpus->count++;
+    return 0;
+}
+
+// xorshift64*, seeded per worker
+static uint64_t next_fuzz_random(FuzzRun *run) {
+    run->random ^= run->random >> 12;
+    run->random ^= run->random << 25;
+    run->random ^= run->random >> 27;
+    return run->random * UINT64_C(2685821657736338717);
+}
+
+static size_t fuzz_below(FuzzRun *run, size_t limit) {
+    return (size_t)(next_fuzz_random(run) % limit);
+}
+
+// Apply one random mutation to an input of *size bytes, which never grows
+// past capacity
+static void mutate_fuzz_input(FuzzRun *run,
+                              uint8_t *data,
+                              size_t *size,
+                              size_t capacity,
+                              const FuzzCorpus *corpus) {
+    static const int64_t interesting[] = {0,
+                                          1,
+                                          -1,
+                                          16,
+                                          32,
+                                          64,
+                                          100,
+                                          127,
+                                          -128,
+                                          255,
+                                          256,
+                                          1024,
+                                          4096,
+                                          32767,
+                                          -32768,
+                                          65535,
+                                          INT32_MAX,
+                                          INT32_MIN};
+    const FuzzInput *other;
+    size_t n = *size;
+    size_t at = n ? fuzz_below(run, n) : 0;
+    size_t length, from;
+    uint64_t value;
+
+    switch (n ? fuzz_below(run, 8) : 2) {
+    case 0: // Flip a bit
+        data[at] ^= (uint8_t)(1u << fuzz_below(run, 8));
+        break;
+    case 1: // Replace a byte
+        data[at] = (uint8_t)next_fuzz_random(run);
+        break;
+    case 2: // Insert a few random bytes
+        length = 1 + fuzz_below(run, 4);
+        length = length < capacity - n ? length : capacity - n;
+        at = fuzz_below(run, n + 1);
+        memmove(data + at + length, data + at, n - at);
+        for (size_t i = 0; i < length; i++) {
+            data[at + i] = (uint8_t)next_fuzz_random(run);
+        }
+        *size = n + length;
+        break;
+    case 3: // Erase a run of bytes
+        length = 1 + fuzz_below(run, n - at < 16 ? n - at : 16);
+        memmove(data + at, data + at + length, n - at - length);
+        *size = n - length;
+        break;
+    case 4: // Add or subtract a small number
+        value = 1 + fuzz_below(run, 35);
+        data[at] = (uint8_t)(next_fuzz_random(run) & 1 ? data[at] + value
+                                                        : data[at] - value);
+        break;
+    case 5: // Store a boundary value, 1, 2 or 4 bytes little endian
+        value = (uint64_t)interesting[fuzz_below(
+            run, sizeof(interesting) / sizeof(interesting[0]))];
+        length = (size_t)1 << fuzz_below(run, 3);
+        length = length < n - at ? length : n - at;
+        for (size_t i = 0; i < length; i++) {
+            data[at + i] = (uint8_t)(value >> (8 * i));
+        }
+        break;
+    case 6: // Copy a run of bytes elsewhere in the input
+        from = fuzz_below(run, n);
+        length = 1 + fuzz_below(run, n - (from > at ? from : at));
+        memmove(data + at, data + from, length);
+        break;
+    default: // Splice in a run of another input
+        other = &corpus->inputs[fuzz_below(run, corpus->count)];
+        if (other->size == 0) {
+            break;
+        }
+        from = fuzz_below(run, other->size);
+        length = 1 + fuzz_below(run, other->size - from);
+        length = length < capacity - at ? length : capacity - at;
+        memcpy(data + at, other->data + from, length);
+        if (at + length > n) {
+            *size = at + length;
+        }
+        break;
+    }
+}
+
+// Fold the counters of the last input into the shared map, returns how
+// many (edge, hit count bucket) pairs no worker had reached before
+NUTEST_NO_COVERAGE static size_t collect_fuzz_features(
+    FuzzShared *shared, const FuzzCoverage *coverage) {
+    size_t found = 0;
+
+    for (size_t i = 0; i < FUZZ_MAP_SIZE; i += 8) {
+        uint64_t word;
+
+        memcpy(&word, &coverage->hits[i], sizeof(word));
+        if (!word) {
+            continue;
+        }
+        for (size_t j = i; j < i + 8; j++) {
+            uint8_t hits = coverage->hits[j];
+            uint8_t bucket = hits >= 128  ? 128
+                             : hits >= 32 ? 64
+                             : hits >= 16 ? 32
+                             : hits >= 8  ? 16
+                             : hits >= 4  ? 8
+                             : hits == 3  ? 4
+                                          : hits;
+
+            if (bucket && !(shared->seen[j] & bucket) &&
+                !(__atomic_fetch_or(
+                      &shared->seen[j], bucket, __ATOMIC_RELAXED) &
+                  bucket)) {
+                found++;
+            }
+        }
+    }
+    if (found) {
+        __atomic_add_fetch(&shared->features, found, __ATOMIC_RELAXED);
+    }
+    return found;
+}
+
+// Run the target on one input as the worker's current input; returns the
+// number of new features it reached, -1 if it failed
+static long run_fuzz_input(FuzzRun *run, const uint8_t *data, size_t size) {
+    FuzzCoverage *coverage = fuzz_coverage();
+    FuzzSlot *slot = &run->slots[run->worker];
+    uint8_t *copy;
+    int failed;
+
+    // An exact size copy lets sanitizers catch reads past the end
+    if (!(copy = (uint8_t *)malloc(size ? size : 1))) {
+        return 0;
+    }
+    memcpy(copy, data, size);
+    memcpy(run->inputs + run->worker * run->max_len, data, size);
+    slot->size = size;
+    if (coverage) {
+        memset(coverage->hits, 0, sizeof(coverage->hits));
+        coverage->previous = 0;
+    }
+    __atomic_store_n(&slot->started_ns, test_now_ns(), __ATOMIC_RELEASE);
+    failed = run_fuzz_target(run->target->fuzz, copy, size);
+    __atomic_store_n(&slot->started_ns, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&slot->runs, slot->runs + 1, __ATOMIC_RELAXED);
+    free(copy);
+    if (failed) {
+        return -1;
+    }
+    return coverage ? (long)collect_fuzz_features(run->shared, coverage) : 0;
+}
+
+// Save an input that reached new coverage and tell the other workers
+static void save_fuzz_input(FuzzRun *run,
+                            FuzzCorpus *corpus,
+                            const uint8_t *data,
+                            size_t size) {
+    unsigned long long hash = hash_fuzz_input(data, size);
+    char file[32], path[4352], temp[4352];
+
+    snprintf(file, sizeof(file), "%016llx", hash);
+    if (has_fuzz_input(corpus, hash_test_name(file))) {
+        return;
+    }
+    add_fuzz_input(corpus, data, size, hash_test_name(file));
+    snprintf(path, sizeof(path), "%s/%s", run->dir, file);
+    snprintf(temp, sizeof(temp), "%s/.%s.%d", run->dir, file, (int)getpid());
+    if (write_fuzz_file(temp, data, size) == 0 && rename(temp, path) == 0) {
+        __atomic_add_fetch(&run->shared->corpus, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&run->shared->generation, 1, __ATOMIC_RELEASE);
+    } else {
+        remove(temp);
+    }
+}
+
+// Add the corpus files a worker does not have yet. On the first load each
+// worker runs its share of them, which fills in the shared coverage map.
+static int load_fuzz_corpus(FuzzRun *run, FuzzCorpus *corpus, int first) {
+    char path[4352];
+    char **names;
+    long count = list_fuzz_corpus(run->dir, &names);
+
+    if (count < 0) {
+        return -1;
+    }
+    for (long i = 0; i < count; i++) {
+        uint64_t name = hash_test_name(names[i]);
+        uint8_t *data;
+        size_t size;
+
+        if (has_fuzz_input(corpus, name)) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", run->dir, names[i]);
+        if (!(data = read_fuzz_file(path, run->max_len, &size))) {
+            continue;
+        }
+        if (first && (size_t)i % run->workers == run->worker &&
+            run_fuzz_input(run, data, size) < 0) {
+            _exit(FUZZ_EXIT_FAILED);
+        }
+        add_fuzz_input(corpus, data, size, name);
+        free(data);
+    }
+    free_fuzz_names(names, (size_t)count);
+    return 0;
+}
+
+// Worker process main loop, never returns
+static void run_fuzz_worker(FuzzRun *run) {
+    static const uint8_t empty[1] = {0};
+    FuzzCorpus corpus = {NULL, 0, 0};
+    uint64_t generation = 0;
+    uint8_t *input = (uint8_t *)malloc(run->max_len);
+
+    run->random = (test_now_ns() ^ ((uint64_t)getpid() << 32)) | 1;
+    if (!input || add_fuzz_input(&corpus, empty, 0, 0) != 0) {
+        _exit(EXIT_FAILURE);
+    }
+    if (run_fuzz_input(run, empty, 0) < 0) {
+        _exit(FUZZ_EXIT_FAILED);
+    }
+    generation = __atomic_load_n(&run->shared->generation, __ATOMIC_ACQUIRE);
+    if (load_fuzz_corpus(run, &corpus, 1) != 0) {
+        _exit(EXIT_FAILURE);
+    }
+
+    while (!__atomic_load_n(&run->shared->stop, __ATOMIC_ACQUIRE)) {
+        uint64_t current =
+            __atomic_load_n(&run->shared->generation, __ATOMIC_ACQUIRE);
+        const FuzzInput *base;
+        size_t size;
+        long found;
+
+        if (current != generation) {
+            generation = current;
+            load_fuzz_corpus(run, &corpus, 0);
+        }
+        base = &corpus.inputs[fuzz_below(run, corpus.count)];
+        size = base->size < run->max_len ? base->size : run->max_len;
+        memcpy(input, base->data, size);
+        for (size_t i = 1 + fuzz_below(run, 5); i > 0; i--) {
+            mutate_fuzz_input(run, input, &size, run->max_len, &corpus);
+        }
+        if ((found = run_fuzz_input(run, input, size)) < 0) {
+            _exit(FUZZ_EXIT_FAILED);
+        }
+        if (found > 0) {
+            save_fuzz_input(run, &corpus, input, size);
+        }
+    }
+    fflush(stdout);
+    fflush(stderr);
+    _exit(EXIT_SUCCESS);
+}
+
+// Smallest first, ties in name order; name holds the index of the file
+static int compare_fuzz_sizes(const void *a, const void *b) {
+    const FuzzInput *x = (const FuzzInput *)a;
+    const FuzzInput *y = (const FuzzInput *)b;
+
+    if (x->size != y->size) {
+        return x->size < y->size ? -1 : 1;
+    }
+    return (x->name > y->name) - (x->name < y->name);
+}
+
+// Minimizing worker, never returns: run the corpus smallest input first
+// and delete every file that reaches no coverage a smaller one did not.
+// Nothing is deleted if no coverage was recorded at all.
+static void minimize_fuzz_corpus(FuzzRun *run) {
+    FuzzCorpus corpus = {NULL, 0, 0};
+    char path[4352];
+    char **names;
+    long count = list_fuzz_corpus(run->dir, &names);
+    size_t kept = 0;
+
+    if (count < 0) {
+        _exit(EXIT_FAILURE);
+    }
+    for (long i = 0; i < count; i++) {
+        uint8_t *data;
+        size_t size;
+
+        snprintf(path, sizeof(path), "%s/%s", run->dir, names[i]);
+        if (!(data = read_fuzz_file(path, run->max_len, &size)) ||
+            add_fuzz_input(&corpus, data, size, (uint64_t)i) != 0) {
+            _exit(EXIT_FAILURE);
+        }
+        free(data);
+    }
+    qsort(corpus.inputs, corpus.count, sizeof(FuzzInput), compare_fuzz_sizes);
+    for (size_t i = 0; i < corpus.count; i++) {
+        long found = run_fuzz_input(
+            run, corpus.inputs[i].data, corpus.inputs[i].size);
+
+        if (found < 0) {
+            _exit(FUZZ_EXIT_FAILED);
+        }
+        if (found > 0) {
+            corpus.inputs[i].name = UINT64_MAX;
+            kept++;
+        }
+    }
+    if (run->shared->features == 0) {
+        _exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < corpus.count; i++) {
+        if (corpus.inputs[i].name != UINT64_MAX) {
+            snprintf(path,
+                     sizeof(path),
+                     "%s/%s",
+                     run->dir,
+                     names[corpus.inputs[i].name]);
+            remove(path);
+        }
+    }
+    run->shared->corpus = kept;
+    _exit(EXIT_SUCCESS);
+}
+
+static void print_fuzz_status(const FuzzRun *run, uint64_t elapsed_ns) {
+    unsigned long long runs = 0;
+    double seconds = (double)elapsed_ns / 1e9;
+
+    for (size_t w = 0; w < run->workers; w++) {
+        runs += __atomic_load_n(&run->slots[w].runs, __ATOMIC_RELAXED);
+    }
+    print_test_label(stdout, COLOR_CYAN, "FUZZ");
+    printf("%s: %llu runs in %.1f s (%.0f/s), %zu features, %zu inputs\n",
+           run->name,
+           runs,
+           seconds,
+           seconds > 0 ? (double)runs / seconds : 0.0,
+           __atomic_load_n(&run->shared->features, __ATOMIC_RELAXED),
+           __atomic_load_n(&run->shared->corpus, __ATOMIC_RELAXED));
+    fflush(stdout);
+}
+
+// Save the input a worker died on under <corpus>/crashes and report it
+static void report_fuzz_failure(const FuzzRun *run,
+                                size_t worker,
+                                int status,
+                                int timed_out) {
+    const uint8_t *data = run->inputs + worker * run->max_len;
+    size_t size = run->slots[worker].size;
+    unsigned long long hash = hash_fuzz_input(data, size);
+    char reason[128], dir[4096], path[4608];
+
+    if (timed_out) {
+        snprintf(reason,
+                 sizeof(reason),
+                 "timed out after %ld ms",
+                 test_timeout_ms(run->target, 1));
+    } else if (WIFSIGNALED(status)) {
+        snprintf(reason,
+                 sizeof(reason),
+                 "killed by signal %d (%s)",
+                 WTERMSIG(status),
+                 strsignal(WTERMSIG(status)));
+    } else if (WEXITSTATUS(status) == FUZZ_EXIT_FAILED) {
+        snprintf(reason, sizeof(reason), "failed");
+    } else {
+        snprintf(reason,
+                 sizeof(reason),
+                 "exited with status %d",
+                 WEXITSTATUS(status));
+    }
+
+    snprintf(dir, sizeof(dir), "%s/crashes", test_config.corpus);
+    snprintf(path,
+             sizeof(path),
+             "%s/%s-%s-%016llx",
+             dir,
+             run->name,
+             timed_out ? "timeout" : "crash",
+             hash);
+    print_test_label(stdout, COLOR_RED, "FAIL");
+    if (make_fuzz_dir(dir) == 0 && write_fuzz_file(path, data, size) == 0) {
+        printf("%s: %s on a %zu byte input, saved to %s\n",
+               run->name,
+               reason,
+               size,
+               path);
+    } else {
+        printf("%s: %s on a %zu byte input, cannot save it to %s: %s\n",
+               run->name,
+               reason,
+               size,
+               path,
+               strerror(errno));
+    }
+    fflush(stdout);
+}
+
+// Fuzz one target on forked workers until time runs out or an input fails,
+// or minimize its corpus; returns -1 if an input failed or it could not run
+static int fuzz_target(const TestCase *target) {
+    long timeout_ms = test_timeout_ms(target, 1);
+    uint64_t start, printed_ns;
+    size_t printed_features = 0, live = 0;
+    pid_t *pids = NULL;
+    int *timed_out = NULL;
+    int failed = 0, broken = 0;
+    char **names;
+    long count;
+    FuzzRun run;
+
+    memset(&run, 0, sizeof(run));
+    run.target = target;
+    format_test_name(target, run.name, sizeof(run.name));
+    snprintf(run.dir, sizeof(run.dir), "%s/%s", test_config.corpus, run.name);
+    run.workers = test_config.jobs > 1 && !test_config.fuzz_minimize
+                      ? test_config.jobs
+                      : 1;
+    run.max_len = test_config.fuzz_max_len;
+    if (make_fuzz_dir(test_config.corpus) != 0 ||
+        make_fuzz_dir(run.dir) != 0 ||
+        (count = list_fuzz_corpus(run.dir, &names)) < 0) {
+        fprintf(stderr,
+                "nutest: cannot open corpus %s: %s\n",
+                run.dir,
+                strerror(errno));
+        return -1;
+    }
+    free_fuzz_names(names, (size_t)count);
+
+    run.mapped = sizeof(FuzzShared) +
+                 run.workers * (sizeof(FuzzSlot) + run.max_len);
+    run.shared = (FuzzShared *)map_test_shared(run.mapped);
+    pids = (pid_t *)calloc(run.workers, sizeof(pid_t));
+    timed_out = (int *)calloc(run.workers, sizeof(int));
+    if (!run.shared || !pids || !timed_out) {
+        fprintf(stderr, "nutest: out of memory\n");
+        failed = 1;
+        goto cleanup;
+    }
+    run.slots = (FuzzSlot *)(run.shared + 1);
+    run.inputs = (uint8_t *)(run.slots + run.workers);
+    run.shared->corpus = (size_t)count;
+
+    fflush(NULL);
+    for (size_t w = 0; w < run.workers; w++) {
+        pid_t pid = fork();
+
+        if (pid == 0) {
+            run.worker = w;
+            if (test_config.fuzz_minimize) {
+                minimize_fuzz_corpus(&run);
+            }
+            run_fuzz_worker(&run);
+        }
+        if (pid > 0) {
+            pids[w] = pid;
+            live++;
+        }
+    }
+
+    start = printed_ns = test_now_ns();
+    while (live > 0) {
+        struct timespec pause = {0, 10000000};
+        uint64_t now;
+        int status;
+        pid_t pid;
+
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            for (size_t w = 0; w < run.workers; w++) {
+                if (pids[w] != pid) {
+                    continue;
+                }
+                pids[w] = 0;
+                live--;
+                // The input in flight, or one that failed an assertion
+                if (__atomic_load_n(&run.slots[w].started_ns,
+                                    __ATOMIC_ACQUIRE) ||
+                    (WIFEXITED(status) &&
+                     WEXITSTATUS(status) == FUZZ_EXIT_FAILED)) {
+                    if (!failed) {
+                        report_fuzz_failure(&run, w, status, timed_out[w]);
+                    }
+                    failed = 1;
+                } else if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                    broken = 1;
+                }
+                break;
+            }
+        }
+
+        // One failure is enough, stop the other workers
+        if (failed || broken) {
+            __atomic_store_n(&run.shared->stop, 1, __ATOMIC_RELEASE);
+            for (size_t w = 0; w < run.workers; w++) {
+                if (pids[w] > 0) {
+                    kill(pids[w], SIGKILL);
+                }
+            }
+        }
+
+        now = test_now_ns();
+        for (size_t w = 0; w < run.workers; w++) {
+            uint64_t started =
+                __atomic_load_n(&run.slots[w].started_ns, __ATOMIC_ACQUIRE);
+
+            if (pids[w] > 0 && !timed_out[w] && started && timeout_ms > 0 &&
+                now > started &&
+                now - started > (uint64_t)timeout_ms * 1000000u) {
+                timed_out[w] = 1;
+                kill(pids[w], SIGKILL);
+            }
+        }
+        if (!test_config.fuzz_minimize && test_config.fuzz_time_s > 0 &&
+            now - start >= (uint64_t)test_config.fuzz_time_s * 1000000000u) {
+            __atomic_store_n(&run.shared->stop, 1, __ATOMIC_RELEASE);
+        }
+        if (!test_config.fuzz_minimize && now - printed_ns >= 1000000000u &&
+            run.shared->features != printed_features) {
+            printed_features = run.shared->features;
+            printed_ns = now;
+            print_fuzz_status(&run, now - start);
+        }
+        nanosleep(&pause, NULL);
+    }
+
+    if (broken && !failed) {
+        print_test_label(stdout, COLOR_MAGENTA, "ERROR");
+        printf("%s: fuzz worker failed%s\n",
+               run.name,
+               test_config.fuzz_minimize ? ", corpus left as is" : "");
+    } else if (test_config.fuzz_minimize && !failed) {
+        print_test_label(stdout, COLOR_CYAN, "FUZZ");
+        printf("%s: kept %zu of %ld inputs, %zu features\n",
+               run.name,
+               run.shared->corpus,
+               count,
+               run.shared->features);
+    } else if (!failed) {
+        print_fuzz_status(&run, test_now_ns() - start);
+    }
+    if (!failed && fuzz_coverage() && run.shared->features == 0) {
+        print_test_label(stderr, COLOR_YELLOW, "WARN");
+        fprintf(stderr,
+                "no coverage recorded, build the code under test with "
+                "-fsanitize-coverage=trace-pc-guard (clang) or trace-pc "
+                "(gcc)\n");
+    }
+
+cleanup:
+    if (run.shared) {
+        munmap(run.shared, run.mapped);
+    }
+    free(timed_out);
+    free(pids);
+    return failed || broken ? -1 : 0;
+}
+
+// Fuzz every FUZZ_TEST matching the --fuzz filter, one after another
+static int run_fuzz_targets(void) {
+    const char *filter = test_config.fuzz ? test_config.fuzz : "";
+    size_t targets = 0;
+    int failed = 0;
+    char name[256];
+
+    if (!fuzz_coverage()) {
+        print_test_label(stderr, COLOR_YELLOW, "WARN");
+        fprintf(stderr,
+                "no source file defines NUTEST_FUZZ, inputs are mutated "
+                "without coverage feedback\n");
+        if (test_config.fuzz_minimize) {
+            fprintf(stderr, "nutest: minimizing a corpus needs coverage\n");
+            return EXIT_FAILURE;
+        }
+    }
+    for (size_t i = 0; i < test_registry.test_count; i++) {
+        const TestCase *test = &test_registry.tests[i];
+        TestSuite suite;
+        TestResult result;
+
+        if (!test->fuzz ||
+            !match_test_filter(filter,
+                               format_test_name(test, name, sizeof(name)))) {
+            continue;
+        }
+        targets++;
+
+        // Workers fork from here, in the state the fixtures set up for a
+        // test of the suite
+        memset(&suite, 0, sizeof(suite));
+        suite.name = test->suite_name;
+        find_test_fixtures(&suite);
+        result = call_test_fixture(suite.fixtures[FIXTURE_SUITE_SETUP]);
+        if (result == TEST_PASS) {
+            result = call_test_fixture(suite.fixtures[FIXTURE_TEST_SETUP]);
+            if (result == TEST_PASS) {
+                if (fuzz_target(test) != 0) {
+                    failed = 1;
+                }
+                result =
+                    call_test_fixture(suite.fixtures[FIXTURE_TEST_TEARDOWN]);
+            }
+            if (call_test_fixture(suite.fixtures[FIXTURE_SUITE_TEARDOWN]) !=
+                TEST_PASS) {
+                result = TEST_FAIL;
+            }
+        }
+        if (result != TEST_PASS && result != TEST_SKIP) {
+            failed = 1;
+        }
+    }
+    if (targets == 0) {
+        fprintf(stderr, "nutest: no fuzz target matches '%s'\n", filter);
+        return EXIT_FAILURE;
+    }
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+// Property tests
+//
+// Case i of a property draws from xoshiro256**, seeded through splitmix64
+// from --seed, the test's name and i, so a seed reproduces every case.
+// Generators turn recorded choices into values, smaller choices giving
+// simpler values. A failing case is shrunk by deleting runs of its choices
+// and lowering each one for as long as it still fails.
+#define PROP_MAX_SHRINKS 10000
+
+static uint64_t splitmix64(uint64_t *state) {
+    uint64_t z = (*state += UINT64_C(0x9e3779b97f4a7c15));
+
+    z = (z ^ (z >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+    z = (z ^ (z >> 27)) * UINT64_C(0x94d049bb133111eb);
+    return z ^ (z >> 31);
+}
+
+static uint64_t rotate_prop_bits(uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
+}
+
+// xoshiro256**
+static uint64_t next_prop_random(PropState *prop) {
+    uint64_t *s = prop->random;
+    uint64_t result = rotate_prop_bits(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotate_prop_bits(s[3], 45);
+    return result;
+}
+
+// Next choice in [0, bound]. Replayed while shrinking, otherwise random
+// with a lean towards 0, bound and small values, where bugs cluster.
+static uint64_t prop_choice(PropState *prop, uint64_t bound) {
+    uint64_t value;
+
+    if (prop->replay) {
+        value = prop->choice_count < prop->replay_count
+                    ? prop->replay[prop->choice_count]
+                    : 0;
+        value = value < bound ? value : bound;
+    } else {
+        uint64_t random = next_prop_random(prop);
+
+        switch (random & 15) {
+        case 0:
+            value = 0;
+            break;
+        case 1:
+            value = bound;
+            break;
+        case 2:
+        case 3:
+            value = (random >> 4) & 15;
+            value = value < bound ? value : bound;
+            break;
+        default:
+            random = next_prop_random(prop);
+            value = bound == UINT64_MAX ? random : random % (bound + 1);
+            break;
+        }
+    }
+
+    if (prop->choice_count == prop->choice_capacity) {
+        size_t capacity =
+            prop->choice_capacity ? prop->choice_capacity * 2 : 64;
+        uint64_t *grown = (uint64_t *)realloc(prop->choices,
+                                              capacity * sizeof(uint64_t));
+        if (!grown) {
+            return value;
+        }
+        prop->choices = grown;
+        prop->choice_capacity = capacity;
+    }
+    prop->choices[prop->choice_count++] = value;
+    return value;
+}
+
+// Append a generated value to the counterexample being printed
+__attribute__((format(printf, 2, 3))) static void
+log_prop_value(PropState *prop, const char *format, ...) {
+    va_list args;
+
+    if (!prop->log) {
+        return;
+    }
+    if (ftell(prop->log) > 0) {
+        fputs(", ", prop->log);
+    }
+    va_start(args, format);
+    vfprintf(prop->log, format, args);
+    va_end(args);
+}
+
+// Memory for a generated buffer, freed when the case ends
+static void *alloc_prop_block(PropState *prop, size_t size) {
+    void *block;
+
+    if (prop->block_count == prop->block_capacity) {
+        size_t capacity = prop->block_capacity ? prop->block_capacity * 2 : 16;
+        void **grown =
+            (void **)realloc(prop->blocks, capacity * sizeof(void *));
+        if (!grown) {
+            return NULL;
+        }
+        prop->blocks = grown;
+        prop->block_capacity = capacity;
+    }
+    if ((block = malloc(size ? size : 1))) {
+        prop->blocks[prop->block_count++] = block;
+    }
+    return block;
+}
+
+// Integer in [min, max], shrinks towards 0 or the bound nearest to it
+NUTEST_API int64_t prop_int(PropState *prop, int64_t min, int64_t max) {
+    uint64_t choice;
+    int64_t value;
+
+    if (min > max) {
+        value = min;
+        min = max;
+        max = value;
+    }
+    if (min >= 0) {
+        choice = prop_choice(prop, (uint64_t)max - (uint64_t)min);
+        value = (int64_t)((uint64_t)min + choice);
+    } else if (max <= 0) {
+        choice = prop_choice(prop, (uint64_t)max - (uint64_t)min);
+        value = (int64_t)((uint64_t)max - choice);
+    } else if (prop_choice(prop, 1)) {
+        // Sign and magnitude apart, so both shrink on their own
+        choice = prop_choice(prop, 0 - (uint64_t)min);
+        value = (int64_t)(0 - choice);
+    } else {
+        value = (int64_t)prop_choice(prop, (uint64_t)max);
+    }
+    log_prop_value(prop, "%lld", (long long)value);
+    return value;
+}
+
+// Unsigned integer in [min, max], shrinks towards min
+NUTEST_API uint64_t prop_uint(PropState *prop, uint64_t min, uint64_t max) {
+    uint64_t value;
+
+    if (min > max) {
+        value = min;
+        min = max;
+        max = value;
+    }
+    value = min + prop_choice(prop, max - min);
+    log_prop_value(prop, "%llu", (unsigned long long)value);
+    return value;
+}
+
+NUTEST_API int prop_bool(PropState *prop) {
+    int value = (int)prop_choice(prop, 1);
+
+    log_prop_value(prop, "%s", value ? "true" : "false");
+    return value;
+}
+
+// Double in [min, max], shrinks towards min
+NUTEST_API double prop_double(PropState *prop, double min, double max) {
+    uint64_t steps = UINT64_C(1) << 53;
+    double value =
+        min + (max - min) * ((double)prop_choice(prop, steps) / (double)steps);
+
+    log_prop_value(prop, "%.17g", value);
+    return value;
+}
+
+// Index below count, to pick from a table of values
+NUTEST_API size_t prop_pick(PropState *prop, size_t count) {
+    size_t value = count ? (size_t)prop_choice(prop, count - 1) : 0;
+
+    log_prop_value(prop, "[%zu]", value);
+    return value;
+}
+
+// Between min and max random bytes, shrinks towards fewer and zero bytes;
+// NULL if out of memory
+NUTEST_API const uint8_t *prop_bytes(PropState *prop,
+                                     size_t min,
+                                     size_t max,
+                                     size_t *size) {
+    size_t length = min + (size_t)prop_choice(prop, max > min ? max - min : 0);
+    uint8_t *data = (uint8_t *)alloc_prop_block(prop, length);
+
+    *size = 0;
+    if (!data) {
+        return NULL;
+    }
+    for (size_t i = 0; i < length; i++) {
+        data[i] = (uint8_t)prop_choice(prop, UINT8_MAX);
+    }
+    if (prop->log) {
+        log_prop_value(prop, "{");
+        for (size_t i = 0; i < length && i < 32; i++) {
+            fprintf(prop->log, i ? " %02x" : "%02x", data[i]);
+        }
+        fputs(length > 32 ? " ...}" : "}", prop->log);
+    }
+    *size = length;
+    return data;
+}
+
+// NUL-terminated string of between min and max printable characters,
+// shrinks towards fewer characters and "a"; NULL if out of memory
+NUTEST_API const char *prop_string(PropState *prop, size_t min, size_t max) {
+    static const char alphabet[] = "abcdefghijklmnopqrstuvwxyz"
+                                   "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+                                   "0123456789 !\"#$%&'()*+,-./"
+                                   ":;<=>?@[\\]^_`{|}~";
+    size_t length = min + (size_t)prop_choice(prop, max > min ? max - min : 0);
+    char *text = (char *)alloc_prop_block(prop, length + 1);
+
+    if (!text) {
+        return NULL;
+    }
+    for (size_t i = 0; i < length; i++) {
+        text[i] = alphabet[prop_choice(prop, sizeof(alphabet) - 2)];
+    }
+    text[length] = '\0';
+    log_prop_value(prop, "\"%s\"", text);
+    return text;
+}
+
+// Run one case on the choices in replay, or drawn from seed if replay is
+// NULL; -1 if it failed
+static int run_prop_case(PropFunc body,
+                         PropState *prop,
+                         uint64_t seed,
+                         const uint64_t *replay,
+                         size_t replay_count) {
+    size_t failures = test_failure_count;
+    TestArenaMark arena = mark_test_arena();
+    TestResult result;
+
+    for (int i = 0; i < 4; i++) {
+        prop->random[i] = splitmix64(&seed);
+    }
+    prop->replay = replay;
+    prop->replay_count = replay_count;
+    prop->choice_count = 0;
+    result = body(prop);
+    rewind_test_arena(arena);
+    for (size_t i = 0; i < prop->block_count; i++) {
+        free(prop->blocks[i]);
+    }
+    prop->block_count = 0;
+    return result == TEST_FAIL || result == TEST_ERROR ||
+                   test_failure_count > failures
+               ? -1
+               : 0;
+}
+
+// Shortlex order of choice sequences, shorter is simpler
+static int compare_prop_choices(const uint64_t *a,
+                                size_t a_count,
+                                const uint64_t *b,
+                                size_t b_count) {
+    if (a_count != b_count) {
+        return a_count < b_count ? -1 : 1;
+    }
+    for (size_t i = 0; i < a_count; i++) {
+        if (a[i] != b[i]) {
+            return a[i] < b[i] ? -1 : 1;
+        }
+    }
+    return 0;
+}
+
+// Replay a candidate, it replaces best if it still fails and what it drew
+// is simpler
+static int try_prop_candidate(PropFunc body,
+                              PropState *prop,
+                              const uint64_t *candidate,
+                              size_t count,
+                              uint64_t *best,
+                              size_t *best_count) {
+    if (run_prop_case(body, prop, 0, candidate, count) == 0 ||
+        compare_prop_choices(
+            prop->choices, prop->choice_count, best, *best_count) >= 0) {
+        return 0;
+    }
+    memcpy(best, prop->choices, prop->choice_count * sizeof(uint64_t));
+    *best_count = prop->choice_count;
+    return 1;
+}
+
+// Shrink the choices of a failing case in place, returns how many simpler
+// failing cases were found on the way
+static size_t shrink_prop_case(PropFunc body,
+                               PropState *prop,
+                               uint64_t *best,
+                               size_t *best_count) {
+    uint64_t *candidate =
+        (uint64_t *)malloc((*best_count + 1) * sizeof(uint64_t));
+    size_t shrinks = 0, runs = 0;
+    int improved = 1;
+
+    if (!candidate) {
+        return 0;
+    }
+    while (improved && runs < PROP_MAX_SHRINKS) {
+        improved = 0;
+
+        // Delete runs of choices, longest first. When the choice before a
+        // run is the length of a buffer, it has to shrink along with it.
+        for (size_t chunk = 8; chunk > 0; chunk /= 2) {
+            for (size_t i = 0;
+                 i + chunk <= *best_count && runs < PROP_MAX_SHRINKS;) {
+                size_t count = *best_count - chunk;
+                int found;
+
+                memcpy(candidate, best, i * sizeof(uint64_t));
+                memcpy(candidate + i,
+                       best + i + chunk,
+                       (count - i) * sizeof(uint64_t));
+                runs++;
+                found = try_prop_candidate(
+                    body, prop, candidate, count, best, best_count);
+                if (!found && i > 0 && candidate[i - 1] >= chunk) {
+                    candidate[i - 1] -= chunk;
+                    runs++;
+                    found = try_prop_candidate(
+                        body, prop, candidate, count, best, best_count);
+                }
+                if (found) {
+                    shrinks++;
+                    improved = 1;
+                } else {
+                    i++;
+                }
+            }
+        }
+
+        // Lower each choice to the smallest that still fails
+        for (size_t i = 0; i < *best_count && runs < PROP_MAX_SHRINKS; i++) {
+            uint64_t low = 0;
+
+            while (i < *best_count && low < best[i] &&
+                   runs < PROP_MAX_SHRINKS) {
+                uint64_t middle = low + (best[i] - low) / 2;
+
+                memcpy(candidate, best, *best_count * sizeof(uint64_t));
+                candidate[i] = middle;
+                runs++;
+                if (try_prop_candidate(
+                        body, prop, candidate, *best_count, best, best_count)) {
+                    shrinks++;
+                    improved = 1;
+                } else {
+                    low = middle + 1;
+                }
+            }
+        }
+    }
+    free(candidate);
+    return shrinks;
+}
+
+// Run a failing case once more with its failures reported, and return the
+// values it drew as text to free
+static char *replay_prop_case(PropFunc body,
+                              PropState *prop,
+                              uint64_t seed,
+                              const uint64_t *replay,
+                              size_t replay_count,
+                              int *failed) {
+    char *text = NULL;
+    size_t length = 0;
+
+    prop->log = open_memstream(&text, &length);
+    *failed = run_prop_case(body, prop, seed, replay, replay_count) != 0;
+    if (prop->log) {
+        fclose(prop->log);
+        prop->log = NULL;
+    }
+    return text;
+}
+
+// Test body of a PROPERTY or TEST_P
+NUTEST_API TestResult run_property(const char *name,
+                                   PropFunc body,
+                                   size_t cases,
+                                   int table,
+                                   const char *file,
+                                   int line) {
+    uint64_t seed = test_config.seed ^ hash_test_name(name);
+    TestResult result = TEST_PASS;
+    PropState prop;
+
+    memset(&prop, 0, sizeof(prop));
+    prop.cases = table ? cases : test_config.prop_cases;
+    for (prop.index = 0; prop.index < prop.cases; prop.index++) {
+        uint64_t *best;
+        size_t best_count, shrinks;
+        char *values;
+        int failed;
+
+        test_failures_muted = 1;
+        failed = run_prop_case(body, &prop, seed + prop.index, NULL, 0);
+        test_failures_muted = 0;
+        if (!failed) {
+            continue;
+        }
+        result = TEST_FAIL;
+
+        if (table) {
+            values = replay_prop_case(
+                body, &prop, seed + prop.index, NULL, 0, &failed);
+            test_failure(file,
+                         line,
+                         "Case %zu of %zu failed%s%s%s",
+                         prop.index,
+                         prop.cases,
+                         values && *values ? " with (" : "",
+                         values && *values ? values : "",
+                         values && *values ? ")" : "");
+            free(values);
+            continue;
+        }
+
+        best_count = prop.choice_count;
+        best = (uint64_t *)malloc((best_count + 1) * sizeof(uint64_t));
+        if (best) {
+            memcpy(best, prop.choices, best_count * sizeof(uint64_t));
+            test_failures_muted = 1;
+            shrinks = shrink_prop_case(body, &prop, best, &best_count);
+            test_failures_muted = 0;
+            values = replay_prop_case(
+                body, &prop, 0, best, best_count, &failed);
+        } else {
+            shrinks = 0;
+            values = replay_prop_case(
+                body, &prop, seed + prop.index, NULL, 0, &failed);
+        }
+        if (failed) {
+            test_failure(file,
+                         line,
+                         "Falsified by (%s) after %zu cases and %zu shrinks, "
+                         "reproduce with --seed=%llu",
+                         values ? values : "",
+                         prop.index + 1,
+                         shrinks,
+                         (unsigned long long)test_config.seed);
+        } else {
+            test_failure(file,
+                         line,
+                         "Case %zu failed with --seed=%llu but passed when "
+                         "replayed, the property is flaky",
+                         prop.index,
+                         (unsigned long long)test_config.seed);
+        }
+        free(values);
+        free(best);
+        break;
+    }
+    free(prop.choices);
+    free(prop.blocks);
+    return result;
+}
+
+// Test runner
+NUTEST_API int RUN_ALL_TESTS(void) {
+    TestCounts totals = {0, 0, 0, 0, 0, 0};
+    unsigned char *results;
+    uint64_t *durations;
+    uint64_t start;
+
+    load_test_config();
+    if (test_config.total_shards > 0 &&
+        test_config.shard_index >= test_config.total_shards) {
+        fprintf(stderr,
+                "nutest: shard index %zu out of range for %zu shards\n",
+                test_config.shard_index,
+                test_config.total_shards);
+        return EXIT_FAILURE;
+    }
+    if (prepare_test_registry() != 0) {
+        fprintf(stderr, "nutest: out of memory\n");
+        return EXIT_FAILURE;
+    }
+    if (test_allocs_sanitized()) {
+        print_test_label(stderr, COLOR_YELLOW, "WARN");
+        fprintf(stderr,
+                "allocation tracking is off, the sanitizer replaces malloc\n");
+    }
+    if (test_config.fuzz || test_config.fuzz_minimize) {
+        return run_fuzz_targets();
+    }
+    if (load_test_history() != 0 || select_test_cases() != 0) {
+        fprintf(stderr, "nutest: out of memory\n");
+        return EXIT_FAILURE;
+    }
+    durations = (uint64_t *)calloc(
+        test_registry.test_count ? test_registry.test_count : 1,
+        sizeof(uint64_t));
+    results = (unsigned char *)malloc(
+        test_registry.test_count ? test_registry.test_count : 1);
+    if (!durations || !results) {
+        fprintf(stderr, "nutest: out of memory\n");
+        free(results);
+        free(durations);
+        return EXIT_FAILURE;
+    }
+    memset(results, TEST_NOT_RUN, test_registry.test_count);
+    if (open_test_reporters() != 0) {
+        fprintf(stderr,
+                "nutest: cannot open report %s: %s\n",
+                test_config.output,
+                strerror(errno));
+        close_test_reporters();
+        free(results);
+        free(durations);
+        return EXIT_FAILURE;
+    }
+
+    start = test_now_ns();
+    REPORT_TEST_EVENT(
+        run_start, test_registry.suite_count, test_registry.test_count);
+
+    if (test_config.jobs < 2 ||
+        run_tests_parallel(&totals, durations, results) != 0) {
+        run_tests_serial(&totals, durations, results);
+    }
+    if (totals.tests < test_registry.test_count) {
+        fprintf(stderr,
+                "nutest: stopped after the first failure, %zu tests not run\n",
+                test_registry.test_count - totals.tests);
+    }
+
+    REPORT_TEST_EVENT(run_end, &totals, durations, test_now_ns() - start);
+    if (test_config.save_durations &&
+        save_test_durations(test_config.save_durations, durations) != 0) {
+        fprintf(stderr,
+                "nutest: cannot write durations %s: %s\n",
+                test_config.save_durations,
+                strerror(errno));
+        totals.errors++;
+    }
+    // The history is a convenience, failing to keep it fails no run
+    if (save_test_history(results, durations) != 0) {
+        print_test_label(stderr, COLOR_YELLOW, "WARN");
+        fprintf(stderr,
+                "cannot write history %s: %s\n",
+                test_config.history,
+                strerror(errno));
+    }
+    free(results);
+    free(durations);
+
+    if (close_test_reporters() != 0) {
+        fprintf(stderr, "nutest: cannot write report %s\n", test_config.output);
+        return EXIT_FAILURE;
+    }
+    return (totals.failed == 0 && totals.errors == 0) ? EXIT_SUCCESS
+                                                      : EXIT_FAILURE;
+}
+
+// Collect registered benchmarks, done once on the first run
+static void prepare_bench_registry(void) {
+    if (bench_registry.prepared) {
+        return;
+    }
+    bench_registry.prepared = 1;
+
+#if NUTEST_USE_SECTIONS
+    BenchCase *begin = __start_nutest_benches;
+    BenchCase *end = __stop_nutest_benches;
+    if (begin && end > begin) {
+        bench_registry.benches = begin;
+        bench_registry.bench_count = (size_t)(end - begin);
+    }
+#endif
+
+    order_records(bench_registry.benches,
+                  bench_registry.bench_count,
+                  sizeof(BenchCase),
+                  offsetof(BenchCase, file),
+                  offsetof(BenchCase, line));
+}
+
+#define BENCH_MAX_ITERATIONS 1000000000u
+
+// CPU affinity masks of up to 1024 CPUs, set through the raw system calls
+#define BENCH_MAX_CPUS 1024
+#define BENCH_CPU_WORD (8 * sizeof(unsigned long))
+
+typedef struct {
+    unsigned long bits[BENCH_MAX_CPUS / BENCH_CPU_WORD];
+} BenchCpus;
+
+static int get_bench_affinity(BenchCpus *cpus) {
+    memset(cpus, 0, sizeof(*cpus));
+#ifdef __linux__
+    if (syscall(SYS_sched_getaffinity, 0, sizeof(cpus->bits), cpus->bits) >
+        0) {
+        return 0;
+    }
+#endif
+    return -1;
+}
+
+static int set_bench_affinity(const BenchCpus *cpus) {
+#ifdef __linux__
+    if (syscall(SYS_sched_setaffinity, 0, sizeof(cpus->bits), cpus->bits) ==
+        0) {
+        return 0;
+    }
+#else
+    (void)cpus;
+#endif
+    return -1;
+}
+
+static int has_bench_cpu(const BenchCpus *cpus, size_t cpu) {
+    unsigned long word = cpus->bits[cpu / BENCH_CPU_WORD];
+
+    return (int)(word >> (cpu % BENCH_CPU_WORD) & 1);
+}
+
+// Number of CPUs in a mask
+static size_t count_bench_cpus(const BenchCpus *cpus) {
+    size_t count = 0;
+
+    for (size_t word = 0; word < BENCH_MAX_CPUS / BENCH_CPU_WORD; word++) {
+        count += (size_t)__builtin_popcountl(cpus->bits[word]);
+    }
+    return count;
+}
+
+// The index-th CPU of a mask, wrapping around; -1 if the mask is empty
+static int nth_bench_cpu(const BenchCpus *cpus, size_t index) {
+    size_t count = count_bench_cpus(cpus);
+
+    if (count == 0) {
+        return -1;
+    }
+    index %= count;
+    for (size_t cpu = 0; cpu < BENCH_MAX_CPUS; cpu++) {
+        if (has_bench_cpu(cpus, cpu) && index-- == 0) {
+            return (int)cpu;
+        }
+    }
+    return -1;
+}
+
+static int pin_bench_thread(int cpu) {
+    BenchCpus cpus;
+
+    if (cpu < 0 || cpu >= BENCH_MAX_CPUS) {
+        return -1;
+    }
+    memset(&cpus, 0, sizeof(cpus));
+    cpus.bits[cpu / BENCH_CPU_WORD] |= 1ul << (cpu % BENCH_CPU_WORD);
+    return set_bench_affinity(&cpus);
+}
+
+// Warn once per CPU whose frequency governor is not "performance"; CPUs
+// without cpufreq, as in most VMs, are left alone
+static void check_bench_governor(int cpu) {
+    static BenchCpus checked;
+    char path[96], governor[64] = "";
+    FILE *file;
+
+    if (cpu < 0 || cpu >= BENCH_MAX_CPUS || has_bench_cpu(&checked, cpu)) {
+        return;
+    }
+    checked.bits[cpu / BENCH_CPU_WORD] |= 1ul << (cpu % BENCH_CPU_WORD);
+    snprintf(path,
+             sizeof(path),
+             "/sys/devices/system/cpu/cpu%d/cpufreq/scaling_governor",
+             cpu);
+    if (!(file = fopen(path, "r"))) {
+        return;
+    }
+    if (fgets(governor, sizeof(governor), file)) {
+        governor[strcspn(governor, "\n")] = '\0';
+    }
+    fclose(file);
+    if (*governor && strcmp(governor, "performance") != 0) {
+        print_test_label(stderr, COLOR_YELLOW, "WARN");
+        fprintf(stderr,
+                "cpu %d frequency governor is '%s', not 'performance'; "
+                "timings will vary with its clock\n",
+                cpu,
+                governor);
+    }
+}
+
+// Pin the calling benchmark thread to a CPU, call it before the loop; the
+// runner restores the affinity after the benchmark. Returns -1 if the CPU
+// is not available.
+NUTEST_API int bench_pin_cpu(int cpu) {
+    static int warned = -1;
+
+    if (pin_bench_thread(cpu) != 0) {
+        // The body runs many times, tell once
+        if (warned != cpu) {
+            warned = cpu;
+            print_test_label(stderr, COLOR_YELLOW, "WARN");
+            fprintf(stderr, "cannot pin benchmark to cpu %d\n", cpu);
+        }
+        return -1;
+    }
+    check_bench_governor(cpu);
+    return 0;
+}
+
+// Size of the largest CPU cache, from sysfs, 32 MiB if unknown
+static size_t largest_bench_cache(void) {
+    size_t largest = 0;
+
+    for (int index = 0; index < 16; index++) {
+        char path[96];
+        unsigned long size;
+        char unit = 'K';
+        FILE *file;
+
+        snprintf(path,
+                 sizeof(path),
+                 "/sys/devices/system/cpu/cpu0/cache/index%d/size",
+                 index);
+        if (!(file = fopen(path, "r"))) {
+            break;
+        }
+        if (fscanf(file, "%lu%c", &size, &unit) >= 1) {
+            size *= unit == 'M' ? 1024ul * 1024 : unit == 'K' ? 1024ul : 1ul;
+            largest = size > largest ? size : largest;
+        }
+        fclose(file);
+    }
+    return largest ? largest : (size_t)32 << 20;
+}
+
+// Buffer streamed through by bench_evict_caches, twice the largest cache
+static char *bench_evict_buffer = NULL;
+static size_t bench_evict_size = 0;
+
+// Evict the CPU caches by writing to every line of a buffer twice the size
+// of the last-level cache. Call it before the loop for a cold-cache sample,
+// the eviction itself is then not timed.
+NUTEST_API void bench_evict_caches(void) {
+    if (!bench_evict_buffer) {
+        bench_evict_size = 2 * largest_bench_cache();
+        if (!(bench_evict_buffer = (char *)malloc(bench_evict_size))) {
+            return;
+        }
+        memset(bench_evict_buffer, 0, bench_evict_size);
+    }
+    for (size_t i = 0; i < bench_evict_size; i += 64) {
+        bench_evict_buffer[i]++;
+    }
+    CLOBBER_MEMORY();
+}
+
+#define BENCH_HUGE_PAGE ((size_t)2 << 20)
+
+// Allocate size bytes of benchmark input aligned to a 2 MiB huge page,
+// prefaulted so page faults stay out of the timed loop; NULL on failure.
+// Release with bench_free_huge.
+NUTEST_API void *bench_alloc_huge(size_t size, BenchPages pages) {
+    size_t length = (size + BENCH_HUGE_PAGE - 1) & ~(BENCH_HUGE_PAGE - 1);
+    char *mapping, *aligned;
+
+    if (length == 0) {
+        return NULL;
+    }
+    if (pages == BENCH_PAGES_EXPLICIT) {
+#if defined(MAP_HUGETLB) && defined(MAP_POPULATE)
+        mapping = (char *)mmap(NULL,
+                               length,
+                               PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB |
+                                   MAP_POPULATE,
+                               -1,
+                               0);
+        return mapping == MAP_FAILED ? NULL : mapping;
+#else
+        return NULL;
+#endif
+    }
+
+    // Over-allocate by a page, then trim to an aligned run of pages
+    mapping = (char *)mmap(NULL,
+                           length + BENCH_HUGE_PAGE,
+                           PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS,
+                           -1,
+                           0);
+    if (mapping == MAP_FAILED) {
+        return NULL;
+    }
+    aligned = (char *)(((uintptr_t)mapping + BENCH_HUGE_PAGE - 1) &
+                       ~(uintptr_t)(BENCH_HUGE_PAGE - 1));
+    if (aligned > mapping) {
+        munmap(mapping, (size_t)(aligned - mapping));
+    }
+    if (aligned + length < mapping + length + BENCH_HUGE_PAGE) {
+        munmap(aligned + length,
+               (size_t)(mapping + length + BENCH_HUGE_PAGE -
+                        (aligned + length)));
+    }
+#ifdef MADV_HUGEPAGE
+    madvise(aligned, length, MADV_HUGEPAGE);
+#endif
+    for (size_t i = 0; i < length; i += 4096) {
+        aligned[i] = 0;
+    }
+    return aligned;
+}
+
+NUTEST_API void bench_free_huge(void *ptr, size_t size) {
+    if (ptr) {
+        munmap(ptr, (size + BENCH_HUGE_PAGE - 1) & ~(BENCH_HUGE_PAGE - 1));
+    }
+}
+
+// Whether the cycle counter ticks at a constant rate and can be read
+static int bench_cycles_constant(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned int eax, ebx, ecx, edx;
+
+    // Invariant TSC, then RDTSCP
+    if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) ||
+        !(edx & (1u << 8))) {
+        return 0;
+    }
+    return __get_cpuid(0x80000001, &eax, &ebx, &ecx, &edx) &&
+           (edx & (1u << 27));
+#elif defined(__aarch64__)
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+// Calibrate the cycle counter against CLOCK_MONOTONIC over 20 ms, then
+// measure the overhead of timing an empty iteration; done once
+static void calibrate_bench_clock(void) {
+    BenchHistogram *histogram;
+    BenchState state;
+
+    if (bench_clock.calibrated) {
+        return;
+    }
+    bench_clock.calibrated = 1;
+
+    if (bench_cycles_constant()) {
+        uint64_t start_ns = test_now_ns(), end_ns;
+        uint64_t start = read_bench_cycles(), end;
+
+        do {
+            end_ns = test_now_ns();
+        } while (end_ns - start_ns < 20000000u);
+        end = read_bench_cycles();
+        if (end > start) {
+            bench_clock.cycles = 1;
+            bench_clock.ns_per_tick =
+                (double)(end_ns - start_ns) / (double)(end - start);
+        }
+    }
+
+    // The fastest empty iteration is the overhead, so none is over-counted
+    if (!(histogram = (BenchHistogram *)calloc(1, sizeof(BenchHistogram)))) {
+        return;
+    }
+    memset(&state, 0, sizeof(state));
+    state.latency = 1;
+    state.latency_left = 10000;
+    state.histogram = histogram;
+    while (bench_keep_running(&state)) {
+    }
+    bench_clock.overhead_ns = (double)histogram->min;
+    bench_clock.overhead_ticks =
+        (uint64_t)((double)histogram->min / bench_clock.ns_per_tick);
+    free(histogram);
+}
+
+// One thread of a threaded benchmark run
+typedef struct {
+    const BenchCase *bench;
+    BenchState state;
+    int cpu;
+    pthread_t thread;
+} BenchThread;
+
+static void *run_bench_thread(void *arg) {
+    BenchThread *thread = (BenchThread *)arg;
+
+    pin_bench_thread(thread->cpu);
+    thread->bench->function(&thread->state);
+    return NULL;
+}
+
+// Run the body once for a fixed iteration count, on the given number of
+// threads for a threaded benchmark; returns -1 if the body left its loop
+// early. The calling thread is the first one, so hardware counters cover
+// it alone. For several threads, elapsed_ns is the time from the common
+// start to the last thread's end, busy_ns the mean time of a thread and
+// the processed counts are summed.
+static int run_bench_iterations(const BenchCase *bench,
+                                int64_t range,
+                                size_t threads,
+                                size_t iterations,
+                                PerfCounters *counters,
+                                BenchHistogram *histogram,
+                                BenchState *state,
+                                uint64_t *busy_ns) {
+    BenchBarrier barrier = {threads, 0, 0, 0};
+    BenchThread *pool;
+    BenchCpus saved, allowed;
+    uint64_t busy = 0;
+    int status = 0;
+    size_t started = 1;
+
+    memset(state, 0, sizeof(*state));
+    state->iterations = iterations;
+    state->range = range;
+    state->remaining = iterations;
+    state->counters = counters;
+    if (bench->latency) {
+        state->latency = 1;
+        state->latency_left = iterations;
+        state->remaining = 0;
+        state->histogram = histogram;
+    }
+    if (!bench->threads) {
+        bench->function(state);
+        *busy_ns = state->elapsed_ns;
+        return !state->started || state->remaining > 0 ||
+                       state->latency_left > 0
+                   ? -1
+                   : 0;
+    }
+
+    if (!(pool = (BenchThread *)calloc(threads, sizeof(BenchThread)))) {
+        return -1;
+    }
+    state->threads = threads;
+    state->barrier = &barrier;
+    get_bench_affinity(&allowed);
+    saved = allowed;
+    for (size_t i = 0; i < threads; i++) {
+        pool[i].bench = bench;
+        pool[i].state = *state;
+        pool[i].state.thread_index = i;
+        pool[i].state.counters = i == 0 ? counters : NULL;
+        pool[i].cpu = nth_bench_cpu(&allowed, i);
+        check_bench_governor(pool[i].cpu);
+    }
+    for (; started < threads; started++) {
+        if (pthread_create(&pool[started].thread,
+                           NULL,
+                           run_bench_thread,
+                           &pool[started]) != 0) {
+            break;
+        }
+    }
+    if (started < threads) {
+        // Release the threads waiting at the start line, the run is void
+        __atomic_store_n(&barrier.count, started, __ATOMIC_RELEASE);
+        status = -1;
+    }
+    pin_bench_thread(pool[0].cpu);
+    bench->function(&pool[0].state);
+    for (size_t i = 1; i < started; i++) {
+        pthread_join(pool[i].thread, NULL);
+    }
+    set_bench_affinity(&saved);
+
+    for (size_t i = 0; i < started; i++) {
+        BenchState *thread = &pool[i].state;
+
+        if (!thread->started || thread->remaining > 0) {
+            status = -1;
+        }
+        busy += thread->elapsed_ns;
+        if (i > 0) {
+            pool[0].state.bytes_processed += thread->bytes_processed;
+            pool[0].state.items_processed += thread->items_processed;
+        }
+    }
+    *state = pool[0].state;
+    state->elapsed_ns = state->wall_ns;
+    state->barrier = NULL;
+    *busy_ns = busy / started;
+    free(pool);
+    return status;
+}
+
+// Largest thread count of a threaded benchmark
+static size_t max_bench_threads(const BenchCase *bench) {
+    BenchCpus allowed;
+    size_t count;
+
+    if (bench->threads > 0) {
+        return (size_t)bench->threads;
+    }
+    if (get_bench_affinity(&allowed) != 0 ||
+        (count = count_bench_cpus(&allowed)) == 0) {
+        return resolve_test_jobs(0);
+    }
+    return count;
+}
+
+// Grow the iteration count until one sample takes the minimum time
+static int calibrate_bench(const BenchCase *bench,
+                           int64_t range,
+                           size_t threads,
+                           size_t *iterations) {
+    uint64_t min_ns = (uint64_t)test_config.bench_min_time_ms * 1000000u;
+    size_t count = 1;
+
+    for (;;) {
+        BenchState state;
+        uint64_t elapsed, busy;
+        double scale;
+        size_t next;
+
+        if (run_bench_iterations(
+                bench, range, threads, count, NULL, NULL, &state, &busy) !=
+            0) {
+            return -1;
+        }
+        elapsed = state.elapsed_ns;
+        if (elapsed >= min_ns || count >= BENCH_MAX_ITERATIONS) {
+            break;
+        }
+
+        // Aim a little past the target, at most 100x per step
+        scale = elapsed ? 1.4 * (double)min_ns / (double)elapsed : 100.0;
+        scale = scale > 100.0 ? 100.0 : scale;
+        next = (size_t)((double)count * scale);
+        count = next > count ? next : count + 1;
+        count = count < BENCH_MAX_ITERATIONS ? count : BENCH_MAX_ITERATIONS;
+    }
+    *iterations = count;
+    return 0;
+}
+
+// The statistics below use these instead of libm, so test programs link
+// without -lm
+
+// Square root by Newton's method from a halved-exponent first guess
+static double bench_sqrt(double x) {
+    uint64_t bits;
+    double y;
+
+    if (!(x > 0.0) || x > DBL_MAX) {
+        return x > 0.0 ? x : 0.0;
+    }
+    memcpy(&bits, &x, sizeof(bits));
+    bits = (bits >> 1) + (UINT64_C(1023) << 51);
+    memcpy(&y, &bits, sizeof(y));
+    for (int i = 0; i < 6; i++) {
+        y = 0.5 * (y + x / y);
+    }
+    return y;
+}
+
+// Base-2 logarithm of a positive number, its exponent plus the atanh series
+// of its mantissa
+static double bench_log2(double x) {
+    double mantissa, s, term, sum = 0.0;
+    uint64_t bits;
+    int exponent;
+
+    if (!(x > 0.0)) {
+        return 0.0;
+    }
+    memcpy(&bits, &x, sizeof(bits));
+    exponent = (int)((bits >> 52) & 0x7ff) - 1023;
+    bits = (bits & ((UINT64_C(1) << 52) - 1)) | (UINT64_C(1023) << 52);
+    memcpy(&mantissa, &bits, sizeof(mantissa));
+    if (mantissa > 1.41421356237309504880) {
+        mantissa /= 2.0;
+        exponent++;
+    }
+    s = (mantissa - 1.0) / (mantissa + 1.0);
+    term = s;
+    for (int k = 1; k < 40; k += 2) {
+        sum += term / k;
+        term *= s * s;
+    }
+    return exponent + 2.0 * sum / 0.69314718055994530942;
+}
+
+// e to the x, 2 to the integer part of x / ln 2 times the Taylor series of
+// the remainder
+static double bench_exp(double x) {
+    const double ln2 = 0.69314718055994530942;
+    double k, r, scale, term = 1.0, sum = 1.0;
+    uint64_t bits;
+
+    if (x < -708.0) {
+        return 0.0;
+    }
+    if (x > 709.0) {
+        return DBL_MAX;
+    }
+    k = (double)(int64_t)(x / ln2);
+    k -= k * ln2 > x;
+    r = x - k * ln2;
+    for (int i = 1; i < 24; i++) {
+        term *= r / i;
+        sum += term;
+    }
+    bits = (uint64_t)(int64_t)(k + 1023.0) << 52;
+    memcpy(&scale, &bits, sizeof(scale));
+    return sum * scale;
+}
+
+// Complementary error function, the Chebyshev fit of Numerical Recipes with
+// a relative error below 1.2e-7, plenty for a p-value
+static double bench_erfc(double x) {
+    static const double fit[] = {-1.26551223,
+                                 1.00002368,
+                                 0.37409196,
+                                 0.09678418,
+                                 -0.18628806,
+                                 0.27886807,
+                                 -1.13520398,
+                                 1.48851587,
+                                 -0.82215223,
+                                 0.17087277};
+    double z = x < 0.0 ? -x : x;
+    double t = 1.0 / (1.0 + 0.5 * z);
+    double poly = 0.0, result;
+
+    for (size_t i = sizeof(fit) / sizeof(fit[0]); i-- > 0;) {
+        poly = fit[i] + t * poly;
+    }
+    result = t * bench_exp(-z * z + poly);
+    return x < 0.0 ? 2.0 - result : result;
+}
+
+static int compare_bench_samples(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Median of a sorted array
+static double median_of(const double *sorted, size_t count) {
+    if (count == 0) {
+        return 0.0;
+    }
+    return count % 2 ? sorted[count / 2]
+                     : (sorted[count / 2 - 1] + sorted[count / 2]) / 2.0;
+}
+
+// Mean, median, standard deviation, MAD and range of the samples
+static void compute_bench_stats(BenchStats *stats) {
+    size_t count = stats->sample_count;
+    double *sorted = (double *)malloc(count * sizeof(double));
+    double sum = 0.0;
+    double squares = 0.0;
+
+    if (!sorted || count == 0) {
+        free(sorted);
+        return;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        sum += stats->samples[i];
+    }
+    stats->mean = sum / (double)count;
+    for (size_t i = 0; i < count; i++) {
+        double delta = stats->samples[i] - stats->mean;
+        squares += delta * delta;
+    }
+    stats->stddev = count > 1 ? bench_sqrt(squares / (double)(count - 1)) : 0.0;
+
+    memcpy(sorted, stats->samples, count * sizeof(double));
+    qsort(sorted, count, sizeof(double), compare_bench_samples);
+    stats->min = sorted[0];
+    stats->max = sorted[count - 1];
+    stats->median = median_of(sorted, count);
+
+    for (size_t i = 0; i < count; i++) {
+        sorted[i] = fabs(sorted[i] - stats->median);
+    }
+    qsort(sorted, count, sizeof(double), compare_bench_samples);
+    stats->mad = median_of(sorted, count);
+    free(sorted);
+}
+
+// Format a duration in nanoseconds with a readable unit
+static const char *format_bench_time(double ns, char *buffer, size_t size) {
+    if (ns < 1e3) {
+        snprintf(buffer, size, "%.2f ns", ns);
+    } else if (ns < 1e6) {
+        snprintf(buffer, size, "%.2f us", ns / 1e3);
+    } else if (ns < 1e9) {
+        snprintf(buffer, size, "%.2f ms", ns / 1e6);
+    } else {
+        snprintf(buffer, size, "%.2f s", ns / 1e9);
+    }
+    return buffer;
+}
+
+// Format a rate per second with a decimal prefix taken from units
+static const char *format_bench_rate(double per_second,
+                                     const char *const units[5],
+                                     char *buffer,
+                                     size_t size) {
+    size_t unit = 0;
+
+    while (per_second >= 1000.0 && unit < 4) {
+        per_second /= 1000.0;
+        unit++;
+    }
+    snprintf(buffer, size, "%.2f %s/s", per_second, units[unit]);
+    return buffer;
+}
+
+// Calibrate, warm up and sample one benchmark at one range value, counting
+// hardware events over the measured samples only
+static int run_bench_case(const BenchCase *bench,
+                          int64_t range,
+                          size_t threads,
+                          BenchStats *stats,
+                          PerfCounters *counters) {
+    BenchState state;
+    size_t iterations;
+    uint64_t busy;
+
+    memset(stats, 0, sizeof(*stats));
+    stats->threads = threads;
+    if (bench->latency) {
+        calibrate_bench_clock();
+        stats->histogram =
+            (BenchHistogram *)calloc(1, sizeof(BenchHistogram));
+        if (!stats->histogram) {
+            return -1;
+        }
+    }
+    if (calibrate_bench(bench, range, threads, &iterations) != 0) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < test_config.bench_warmup; i++) {
+        if (run_bench_iterations(bench,
+                                 range,
+                                 threads,
+                                 iterations,
+                                 NULL,
+                                 NULL,
+                                 &state,
+                                 &busy) != 0) {
+            return -1;
+        }
+    }
+
+    stats->iterations = iterations;
+    stats->samples =
+        (double *)malloc(test_config.bench_samples * sizeof(double));
+    if (!stats->samples) {
+        return -1;
+    }
+    for (size_t i = 0; i < test_config.bench_samples; i++) {
+        if (run_bench_iterations(bench,
+                                 range,
+                                 threads,
+                                 iterations,
+                                 counters->count ? counters : NULL,
+                                 stats->histogram,
+                                 &state,
+                                 &busy) != 0) {
+            return -1;
+        }
+        stats->samples[stats->sample_count++] =
+            (double)state.elapsed_ns / (double)iterations;
+        stats->busy_ns += (double)busy / (double)iterations /
+                          (double)test_config.bench_samples;
+    }
+    stats->bytes_per_iter =
+        (double)state.bytes_processed / (double)iterations;
+    stats->items_per_iter =
+        (double)state.items_processed / (double)iterations;
+
+    compute_bench_stats(stats);
+    return 0;
+}
+
+// Print the statistics line of a benchmark
+static void print_bench_stats(const char *name, const BenchStats *stats) {
+    char mean[32], median[32], stddev[32], mad[32], min[32], max[32];
+
+    print_test_label(stdout, COLOR_CYAN, "BENCH");
+    printf("%s: %s/iter (median %s, stddev %s, mad %s, "
+           "min %s, max %s, %zu x %zu iters)\n",
+           name,
+           format_bench_time(stats->mean, mean, sizeof(mean)),
+           format_bench_time(stats->median, median, sizeof(median)),
+           format_bench_time(stats->stddev, stddev, sizeof(stddev)),
+           format_bench_time(stats->mad, mad, sizeof(mad)),
+           format_bench_time(stats->min, min, sizeof(min)),
+           format_bench_time(stats->max, max, sizeof(max)),
+           stats->sample_count,
+           stats->iterations);
+
+    if (stats->median > 0.0 &&
+        (stats->bytes_per_iter > 0.0 || stats->items_per_iter > 0.0)) {
+        static const char *const bytes[] = {"B", "kB", "MB", "GB", "TB"};
+        static const char *const items[] = {
+            "items", "k items", "M items", "G items", "T items"};
+        double per_second = 1e9 / stats->median;
+        char rate[32];
+
+        print_test_label(stdout, COLOR_CYAN, "BENCH");
+        printf("%s: median throughput", name);
+        if (stats->bytes_per_iter > 0.0) {
+            printf(" %s",
+                   format_bench_rate(stats->bytes_per_iter * per_second,
+                                     bytes,
+                                     rate,
+                                     sizeof(rate)));
+        }
+        if (stats->items_per_iter > 0.0) {
+            printf("%s%s",
+                   stats->bytes_per_iter > 0.0 ? ", " : " ",
+                   format_bench_rate(stats->items_per_iter * per_second,
+                                     items,
+                                     rate,
+                                     sizeof(rate)));
+        }
+        putchar('\n');
+    }
+}
+
+// Smallest value at or above the given percentile of a histogram
+static uint64_t bench_percentile(const BenchHistogram *histogram,
+                                 double percentile) {
+    double total = (double)histogram->total;
+    double target = percentile / 100.0 * total;
+    uint64_t rank = (uint64_t)target;
+    uint64_t seen = 0;
+
+    rank += (double)rank < target;
+    rank = rank < 1 ? 1 : rank;
+    for (size_t i = 0; i < BENCH_HISTOGRAM_BUCKETS; i++) {
+        if ((seen += histogram->counts[i]) >= rank) {
+            uint64_t upper = bench_histogram_upper(i);
+            return upper < histogram->max ? upper : histogram->max;
+        }
+    }
+    return histogram->max;
+}
+
+// Print the latency percentiles of a benchmark
+static void print_bench_latency(const char *name,
+                                const BenchHistogram *histogram) {
+    static const double percentiles[] = {50.0, 90.0, 99.0, 99.9, 99.99};
+    static const char *const labels[] = {
+        "p50", "p90", "p99", "p99.9", "p99.99"};
+    char value[32];
+
+    if (histogram->total == 0) {
+        return;
+    }
+    print_test_label(stdout, COLOR_CYAN, "LATENCY");
+    printf("%s:", name);
+    for (size_t i = 0; i < 5; i++) {
+        printf(" %s %s,",
+               labels[i],
+               format_bench_time((double)bench_percentile(histogram,
+                                                          percentiles[i]),
+                                 value,
+                                 sizeof(value)));
+    }
+    printf(" max %s",
+           format_bench_time((double)histogram->max, value, sizeof(value)));
+    printf(" (%llu ops, %s, ",
+           (unsigned long long)histogram->total,
+           bench_clock.cycles ? NUTEST_CYCLE_COUNTER : "clock_gettime");
+    printf("%s timer overhead subtracted)\n",
+           format_bench_time(bench_clock.overhead_ns, value, sizeof(value)));
+}
+
+// Histogram file of --bench-histogram, open while benchmarks run
+static FILE *bench_histogram_file = NULL;
+
+// Append the non-empty buckets of a histogram as tab-separated rows
+static void write_bench_histogram(FILE *file,
+                                  const char *name,
+                                  const BenchHistogram *histogram) {
+    uint64_t seen = 0;
+
+    for (size_t i = 0; i < BENCH_HISTOGRAM_BUCKETS; i++) {
+        if (histogram->counts[i] == 0) {
+            continue;
+        }
+        seen += histogram->counts[i];
+        fprintf(file,
+                "%s\t%llu\t%llu\t%llu\t%.6f\n",
+                name,
+                (unsigned long long)bench_histogram_lower(i),
+                (unsigned long long)bench_histogram_upper(i),
+                (unsigned long long)histogram->counts[i],
+                100.0 * (double)seen / (double)histogram->total);
+    }
+}
+
+// Median times of one benchmark over its range, for the complexity fit
+#define BENCH_MAX_RANGES 64
+
+typedef struct {
+    double n[BENCH_MAX_RANGES];
+    double ns[BENCH_MAX_RANGES];
+    size_t count;
+} BenchFit;
+
+// Value after range in a benchmark's geometric range, the last one is the
+// limit itself
+static int64_t next_bench_range(const BenchCase *bench, int64_t range) {
+    int64_t multiplier =
+        bench->range_multiplier < 2 ? 2 : bench->range_multiplier;
+
+    if (range < 1) {
+        return 1;
+    }
+    if (range > bench->range_limit / multiplier) {
+        return bench->range_limit;
+    }
+    return range * multiplier;
+}
+
+// Number of runs of a benchmark, one per range value and thread count
+static size_t count_bench_runs(const BenchCase *bench) {
+    size_t ranges = 1, thread_counts = 1;
+
+    if (bench->range_multiplier) {
+        for (int64_t range = bench->range_start; range < bench->range_limit;
+             range = next_bench_range(bench, range)) {
+            ranges++;
+        }
+    }
+    if (bench->threads) {
+        size_t max_threads = max_bench_threads(bench);
+
+        for (size_t threads = 1; threads < max_threads; threads *= 2) {
+            thread_counts++;
+        }
+    }
+    return ranges * thread_counts;
+}
+
+// "Suite.name", then "/range" for a range value and "/threads:N" for a
+// thread count
+static void format_bench_name(char *buffer,
+                              size_t size,
+                              const BenchCase *bench,
+                              int64_t range,
+                              size_t threads) {
+    int length =
+        snprintf(buffer, size, "%s.%s", bench->suite_name, bench->name);
+
+    if (bench->range_multiplier && length >= 0 && (size_t)length < size) {
+        length += snprintf(
+            buffer + length, size - (size_t)length, "/%lld", (long long)range);
+    }
+    if (threads && length >= 0 && (size_t)length < size) {
+        snprintf(
+            buffer + length, size - (size_t)length, "/threads:%zu", threads);
+    }
+}
+
+static double bench_complexity(int curve, double n) {
+    switch (curve) {
+    case 0:
+        return 1.0;
+    case 1:
+        return bench_log2(n);
+    case 2:
+        return n;
+    case 3:
+        return n * bench_log2(n);
+    default:
+        return n * n;
+    }
+}
+
+// Fit the medians to c * f(n) for each curve by least squares and print the
+// one with the lowest RMS error, relative to the mean time
+static void print_bench_complexity(const char *name, const BenchFit *fit) {
+    static const char *const curves[] = {
+        "1", "log n", "n", "n log n", "n^2"};
+    double mean = 0.0, best_rms = 0.0, best_coefficient = 0.0;
+    int best = -1;
+    char coefficient[32];
+
+    for (size_t i = 0; i < fit->count; i++) {
+        mean += fit->ns[i] / (double)fit->count;
+    }
+    for (int curve = 0; curve < 5; curve++) {
+        double fx = 0.0, ff = 0.0, squares = 0.0, c, rms;
+
+        for (size_t i = 0; i < fit->count; i++) {
+            double f = bench_complexity(curve, fit->n[i]);
+            fx += f * fit->ns[i];
+            ff += f * f;
+        }
+        if (ff == 0.0) {
+            continue;
+        }
+        c = fx / ff;
+        for (size_t i = 0; i < fit->count; i++) {
+            double error =
+                fit->ns[i] - c * bench_complexity(curve, fit->n[i]);
+            squares += error * error;
+        }
+        rms = mean > 0.0
+                  ? bench_sqrt(squares / (double)fit->count) / mean
+                  : 0.0;
+        if (best < 0 || rms < best_rms) {
+            best = curve;
+            best_rms = rms;
+            best_coefficient = c;
+        }
+    }
+    if (best < 0) {
+        return;
+    }
+
+    print_test_label(stdout, COLOR_CYAN, "BIG-O");
+    format_bench_time(best_coefficient, coefficient, sizeof(coefficient));
+    printf("%s: O(%s), %s * %s, RMS %.0f%%\n",
+           name,
+           curves[best],
+           coefficient,
+           curves[best],
+           best_rms * 100.0);
+}
+
+#if defined(__clang__)
+#define NUTEST_COMPILER "clang " __clang_version__
+#elif defined(__GNUC__)
+#define NUTEST_COMPILER "gcc " __VERSION__
+#else
+#define NUTEST_COMPILER "unknown"
+#endif
+
+#ifdef __OPTIMIZE__
+#define NUTEST_BUILD_MODE "optimized"
+#else
+#define NUTEST_BUILD_MODE "unoptimized"
+#endif
+
+// Describe the machine: OS, architecture, CPU model and CPU count
+static void fingerprint_machine(char *buffer, size_t size) {
+    struct utsname host;
+    char model[128] = "unknown cpu";
+    char line[256];
+    FILE *file;
+
+    if (uname(&host) != 0) {
+        strcpy(host.sysname, "unknown");
+        strcpy(host.machine, "unknown");
+    }
+    if ((file = fopen("/proc/cpuinfo", "r"))) {
+        while (fgets(line, sizeof(line), file)) {
+            char *colon = strchr(line, ':');
+            if (colon && strncmp(line, "model name", 10) == 0) {
+                snprintf(model, sizeof(model), "%s", colon + 2);
+                model[strcspn(model, "\n")] = '\0';
+                break;
+            }
+        }
+        fclose(file);
+    }
+    snprintf(buffer,
+             size,
+             "%s %s, %s, %ld cpus",
+             host.sysname,
+             host.machine,
+             model,
+             sysconf(_SC_NPROCESSORS_ONLN));
+}
+
+static void fingerprint_baseline(BenchBaseline *baseline) {
+    fingerprint_machine(baseline->machine, sizeof(baseline->machine));
+    snprintf(baseline->compiler,
+             sizeof(baseline->compiler),
+             "%s, %s",
+             NUTEST_COMPILER,
+             NUTEST_BUILD_MODE);
+}
+
+static BenchRecord *find_bench_record(const BenchBaseline *baseline,
+                                      const char *name) {
+    for (size_t i = 0; i < baseline->record_count; i++) {
+        if (strcmp(baseline->records[i].name, name) == 0) {
+            return &baseline->records[i];
+        }
+    }
+    return NULL;
+}
+
+// Append a copy of the samples, returns -1 on allocation failure
+static int add_bench_record(BenchBaseline *baseline,
+                            const char *name,
+                            const double *samples,
+                            size_t sample_count) {
+    BenchRecord *record;
+
+    if (baseline->record_count == baseline->capacity) {
+        size_t capacity = baseline->capacity ? baseline->capacity * 2 : 16;
+        BenchRecord *records = (BenchRecord *)realloc(
+            baseline->records, capacity * sizeof(BenchRecord));
+        if (!records) {
+            return -1;
+        }
+        baseline->records = records;
+        baseline->capacity = capacity;
+    }
+
+    record = &baseline->records[baseline->record_count];
+    record->name = (char *)malloc(strlen(name) + 1);
+    record->samples = (double *)malloc(
+        (sample_count ? sample_count : 1) * sizeof(double));
+    if (!record->name || !record->samples) {
+        free(record->name);
+        free(record->samples);
+        return -1;
+    }
+    strcpy(record->name, name);
+    memcpy(record->samples, samples, sample_count * sizeof(double));
+    record->sample_count = sample_count;
+    baseline->record_count++;
+    return 0;
+}
+
+static void free_bench_baseline(BenchBaseline *baseline) {
+    for (size_t i = 0; i < baseline->record_count; i++) {
+        free(baseline->records[i].name);
+        free(baseline->records[i].samples);
+    }
+    free(baseline->records);
+    memset(baseline, 0, sizeof(*baseline));
+}
+
+// Baseline file format, one line each:
+//
+//     nutest-baseline 1
+//     machine <fingerprint>
+//     compiler <fingerprint>
+//     bench <name> <count> <ns per iteration>...
+static int load_bench_baseline(const char *path, BenchBaseline *baseline) {
+    char line[256];
+    char name[256];
+    FILE *file = fopen(path, "r");
+
+    memset(baseline, 0, sizeof(*baseline));
+    if (!file) {
+        return -1;
+    }
+    if (!fgets(line, sizeof(line), file) ||
+        strcmp(line, "nutest-baseline 1\n") != 0) {
+        fclose(file);
+        return -1;
+    }
+
+    while (fscanf(file, "%255s", line) == 1) {
+        if (strcmp(line, "machine") == 0 || strcmp(line, "compiler") == 0) {
+            char *field = line[0] == 'm' ? baseline->machine
+                                         : baseline->compiler;
+            if (fscanf(file, " %255[^\n]", field) != 1) {
+                break;
+            }
+        } else if (strcmp(line, "bench") == 0) {
+            size_t count;
+            double *samples;
+
+            if (fscanf(file, "%255s %zu", name, &count) != 2 || count == 0 ||
+                count > 1000000) {
+                break;
+            }
+            samples = (double *)malloc(count * sizeof(double));
+            if (!samples) {
+                break;
+            }
+            for (size_t i = 0; i < count; i++) {
+                if (fscanf(file, "%lf", &samples[i]) != 1) {
+                    count = i;
+                    break;
+                }
+            }
+            add_bench_record(baseline, name, samples, count);
+            free(samples);
+        } else {
+            break;
+        }
+    }
+
+    fclose(file);
+    return 0;
+}
+
+// Write through a temporary file so a crash never leaves half a baseline
+static int save_bench_baseline(const char *path,
+                               const BenchBaseline *baseline) {
+    char temp[4096];
+    FILE *file;
+
+    if (!(file = open_test_temp(path, temp, sizeof(temp)))) {
+        return -1;
+    }
+    fprintf(file, "nutest-baseline 1\n");
+    fprintf(file, "machine %s\n", baseline->machine);
+    fprintf(file, "compiler %s\n", baseline->compiler);
+    for (size_t i = 0; i < baseline->record_count; i++) {
+        const BenchRecord *record = &baseline->records[i];
+        fprintf(file, "bench %s %zu", record->name, record->sample_count);
+        for (size_t j = 0; j < record->sample_count; j++) {
+            fprintf(file, " %.9g", record->samples[j]);
+        }
+        fprintf(file, "\n");
+    }
+    if (fclose(file) != 0 || rename(temp, path) != 0) {
+        remove(temp);
+        return -1;
+    }
+    return 0;
+}
+
+// Ranked sample for the Mann-Whitney U test
+typedef struct {
+    double value;
+    int group;
+} BenchRank;
+
+static int compare_bench_ranks(const void *a, const void *b) {
+    double x = ((const BenchRank *)a)->value;
+    double y = ((const BenchRank *)b)->value;
+    return (x > y) - (x < y);
+}
+
+// Two-sided p-value of the Mann-Whitney U test that both sample sets come
+// from the same distribution, normal approximation with tie correction
+static double mann_whitney_p(const double *a,
+                             size_t a_count,
+                             const double *b,
+                             size_t b_count) {
+    size_t n = a_count + b_count;
+    BenchRank *ranks = (BenchRank *)malloc(n * sizeof(BenchRank));
+    double rank_sum = 0.0;
+    double ties = 0.0;
+    double u, mean, sigma, z;
+
+    if (!ranks || a_count == 0 || b_count == 0) {
+        free(ranks);
+        return 1.0;
+    }
+    for (size_t i = 0; i < a_count; i++) {
+        ranks[i].value = a[i];
+        ranks[i].group = 0;
+    }
+    for (size_t i = 0; i < b_count; i++) {
+        ranks[a_count + i].value = b[i];
+        ranks[a_count + i].group = 1;
+    }
+    qsort(ranks, n, sizeof(BenchRank), compare_bench_ranks);
+
+    for (size_t i = 0, j; i < n; i = j) {
+        double average, t;
+        for (j = i + 1; j < n && ranks[j].value == ranks[i].value; j++) {
+        }
+        average = (double)(i + j + 1) / 2.0;
+        t = (double)(j - i);
+        ties += t * t * t - t;
+        for (size_t k = i; k < j; k++) {
+            if (ranks[k].group == 0) {
+                rank_sum += average;
+            }
+        }
+    }
+    free(ranks);
+
+    u = rank_sum - (double)a_count * (double)(a_count + 1) / 2.0;
+    mean = (double)a_count * (double)b_count / 2.0;
+    sigma = bench_sqrt(
+        (double)a_count * (double)b_count / 12.0 *
+        ((double)(n + 1) - ties / ((double)n * (double)(n - 1))));
+    if (sigma == 0.0) {
+        return 1.0;
+    }
+    z = (fabs(u - mean) - 0.5) / sigma;
+    return z > 0.0 ? bench_erfc(z * 0.70710678118654752440) : 1.0;
+}
+
+#define BENCH_SIGNIFICANCE 0.05
+
+// Compare samples to a baseline record and print the verdict; returns 1
+// when regressed past the threshold, -1 when improved, 0 otherwise
+static int compare_bench_record(const char *name,
+                                const BenchStats *stats,
+                                const BenchRecord *record) {
+    double *sorted = (double *)malloc(record->sample_count * sizeof(double));
+    double base, change, p;
+    int verdict = 0;
+
+    if (!sorted || record->sample_count == 0) {
+        free(sorted);
+        return 0;
+    }
+    memcpy(sorted, record->samples, record->sample_count * sizeof(double));
+    qsort(sorted, record->sample_count, sizeof(double), compare_bench_samples);
+    base = median_of(sorted, record->sample_count);
+    free(sorted);
+
+    change = base > 0.0 ? 100.0 * (stats->median - base) / base : 0.0;
+    p = mann_whitney_p(
+        stats->samples, stats->sample_count, record->samples,
+        record->sample_count);
+
+    if (p < BENCH_SIGNIFICANCE && change > test_config.bench_threshold) {
+        verdict = 1;
+        print_test_label(stdout, COLOR_RED, "SLOWER");
+        printf("%s: regressed, median %+.1f%% vs baseline (p = %.3g)\n",
+               name,
+               change,
+               p);
+    } else if (p < BENCH_SIGNIFICANCE &&
+               change < -test_config.bench_threshold) {
+        verdict = -1;
+        print_test_label(stdout, COLOR_GREEN, "FASTER");
+        printf("%s: improved, median %+.1f%% vs baseline (p = %.3g)\n",
+               name,
+               change,
+               p);
+    } else {
+        print_test_label(stdout, COLOR_CYAN, "SAME");
+        printf("%s: unchanged, median %+.1f%% vs baseline (p = %.3g)\n",
+               name,
+               change,
+               p);
+    }
+    return verdict;
+}
+
+// Run one benchmark at one range value and thread count, print its results
+// and compare them to the baseline; returns -1 on error, 1 when it regressed
+// past the threshold and 0 otherwise. The caller frees stats->samples and
+// stats->histogram.
+static int report_bench_run(const BenchCase *bench,
+                            int64_t range,
+                            size_t threads,
+                            const BenchBaseline *baseline,
+                            BenchBaseline *results,
+                            BenchStats *stats) {
+    PerfCounters counters;
+    BenchRecord *record;
+    BenchCpus affinity;
+    char name[320];
+    int verdict = 0;
+    int saved = get_bench_affinity(&affinity) == 0;
+
+    format_bench_name(name, sizeof(name), bench, range, threads);
+    printf("[ RUN     ] %s\n", name);
+    fflush(stdout);
+
+    perf_counters_open(&counters);
+    if (run_bench_case(bench, range, threads, stats, &counters) != 0) {
+        print_test_label(stdout, COLOR_MAGENTA, "ERROR");
+        printf("%s: body must loop until bench_keep_running() returns 0\n",
+               name);
+        verdict = -1;
+    } else {
+        print_bench_stats(name, stats);
+        if (stats->histogram) {
+            print_bench_latency(name, stats->histogram);
+            if (bench_histogram_file) {
+                write_bench_histogram(
+                    bench_histogram_file, name, stats->histogram);
+            }
+        }
+        print_perf_counters(name,
+                            &counters,
+                            (double)stats->iterations *
+                                (double)stats->sample_count,
+                            "per iter");
+        if ((record = find_bench_record(baseline, name)) &&
+            compare_bench_record(name, stats, record) > 0) {
+            verdict = 1;
+        }
+        add_bench_record(results, name, stats->samples, stats->sample_count);
+    }
+    perf_counters_close(&counters);
+    // Undo a bench_pin_cpu of the body
+    if (saved) {
+        set_bench_affinity(&affinity);
+    }
+    return verdict;
+}
+
+// Median times of one threaded benchmark per thread count
+typedef struct {
+    size_t threads[BENCH_MAX_RANGES];
+    double wall_ns[BENCH_MAX_RANGES];
+    double busy_ns[BENCH_MAX_RANGES];
+    size_t count;
+} BenchScaling;
+
+// Print aggregate and per-thread iterations per second for each thread
+// count, and the aggregate as a share of one thread's times the count
+static void print_bench_scaling(const BenchCase *bench,
+                                int64_t range,
+                                const BenchScaling *scaling) {
+    static const char *const iters[] = {
+        "iters", "k iters", "M iters", "G iters", "T iters"};
+    double single = 0.0;
+    char name[256];
+
+    format_bench_name(name, sizeof(name), bench, range, 0);
+    print_test_label(stdout, COLOR_CYAN, "SCALING");
+    printf("%s\n", name);
+    printf("            %7s  %18s  %18s  %10s\n",
+           "threads",
+           "aggregate",
+           "per thread",
+           "efficiency");
+    for (size_t i = 0; i < scaling->count; i++) {
+        double aggregate = scaling->wall_ns[i] > 0.0
+                               ? (double)scaling->threads[i] * 1e9 /
+                                     scaling->wall_ns[i]
+                               : 0.0;
+        double per_thread =
+            scaling->busy_ns[i] > 0.0 ? 1e9 / scaling->busy_ns[i] : 0.0;
+        char aggregate_rate[32], thread_rate[32];
+
+        if (i == 0) {
+            single = aggregate / (double)scaling->threads[0];
+        }
+        printf("            %7zu  %18s  %18s  %9.0f%%\n",
+               scaling->threads[i],
+               format_bench_rate(
+                   aggregate, iters, aggregate_rate, sizeof(aggregate_rate)),
+               format_bench_rate(
+                   per_thread, iters, thread_rate, sizeof(thread_rate)),
+               single > 0.0 ? 100.0 * aggregate /
+                                  ((double)scaling->threads[i] * single)
+                            : 0.0);
+    }
+}
+
+// Benchmark runner
+NUTEST_API int RUN_ALL_BENCHMARKS(void) {
+    BenchBaseline baseline;
+    BenchBaseline results;
+    size_t errors = 0;
+    size_t regressions = 0;
+    size_t run_count = 0;
+    size_t run_total = 0;
+    int gating = 0;
+
+    load_test_config();
+    prepare_bench_registry();
+
+    memset(&baseline, 0, sizeof(baseline));
+    memset(&results, 0, sizeof(results));
+    fingerprint_baseline(&results);
+
+    if (test_config.bench_baseline) {
+        if (load_bench_baseline(test_config.bench_baseline, &baseline) != 0) {
+            print_test_label(stdout, COLOR_YELLOW, "WARN");
+            printf("no baseline in %s, nothing to compare against\n",
+                   test_config.bench_baseline);
+        } else if (strcmp(baseline.machine, results.machine) != 0 ||
+                   strcmp(baseline.compiler, results.compiler) != 0) {
+            print_test_label(stdout, COLOR_YELLOW, "WARN");
+            printf("baseline from a different machine or compiler, "
+                   "comparing without gating\n"
+                   "            baseline: %s; %s\n"
+                   "            current:  %s; %s\n",
+                   baseline.machine,
+                   baseline.compiler,
+                   results.machine,
+                   results.compiler);
+        } else {
+            gating = 1;
+        }
+    }
+
+    for (size_t i = 0; i < bench_registry.bench_count; i++) {
+        run_total += count_bench_runs(&bench_registry.benches[i]);
+    }
+    printf("[=========] Running %zu benchmarks\n", run_total);
+
+    if (test_config.bench_histogram) {
+        if ((bench_histogram_file = fopen(test_config.bench_histogram, "w"))) {
+            fputs("benchmark\tlow_ns\thigh_ns\tcount\tpercentile\n",
+                  bench_histogram_file);
+        } else {
+            fprintf(stderr,
+                    "nutest: cannot write histogram %s: %s\n",
+                    test_config.bench_histogram,
+                    strerror(errno));
+            errors++;
+        }
+    }
+
+    for (size_t i = 0; i < bench_registry.bench_count; i++) {
+        BenchCase *bench = &bench_registry.benches[i];
+        size_t max_threads = bench->threads ? max_bench_threads(bench) : 0;
+        int64_t range = bench->range_start;
+        BenchFit fit;
+
+        fit.count = 0;
+        for (;;) {
+            BenchScaling scaling;
+            size_t threads = bench->threads ? 1 : 0;
+
+            scaling.count = 0;
+            for (;;) {
+                BenchStats stats;
+                int verdict = report_bench_run(
+                    bench, range, threads, &baseline, &results, &stats);
+
+                run_count++;
+                if (verdict < 0) {
+                    errors++;
+                } else {
+                    regressions += verdict > 0 && gating;
+                    if (!bench->threads && range >= 1 &&
+                        fit.count < BENCH_MAX_RANGES) {
+                        fit.n[fit.count] = (double)range;
+                        fit.ns[fit.count++] = stats.median;
+                    }
+                    if (bench->threads && scaling.count < BENCH_MAX_RANGES) {
+                        scaling.threads[scaling.count] = threads;
+                        scaling.wall_ns[scaling.count] = stats.median;
+                        scaling.busy_ns[scaling.count++] = stats.busy_ns;
+                    }
+                }
+                free(stats.samples);
+                free(stats.histogram);
+
+                if (threads >= max_threads) {
+                    break;
+                }
+                threads = threads * 2 < max_threads ? threads * 2 : max_threads;
+            }
+            if (scaling.count > 0) {
+                print_bench_scaling(bench, range, &scaling);
+            }
+
+            if (!bench->range_multiplier || range >= bench->range_limit) {
+                break;
+            }
+            range = next_bench_range(bench, range);
+        }
+
+        if (fit.count >= 2) {
+            char name[256];
+
+            snprintf(
+                name, sizeof(name), "%s.%s", bench->suite_name, bench->name);
+            print_bench_complexity(name, &fit);
+        }
+    }
+
+    printf("[=========] %zu benchmarks ran.\n", run_count);
+    if (regressions > 0) {
+        print_test_label(stdout, COLOR_RED, "SLOWER");
+        printf("%zu benchmarks regressed by more than %.0f%%.\n",
+               regressions,
+               test_config.bench_threshold);
+    }
+    if (errors > 0) {
+        print_test_label(stdout, COLOR_MAGENTA, "ERRORS");
+        printf("%zu benchmarks.\n", errors);
+    }
+
+    if (bench_histogram_file) {
+        if (fclose(bench_histogram_file) != 0) {
+            fprintf(stderr,
+                    "nutest: cannot write histogram %s: %s\n",
+                    test_config.bench_histogram,
+                    strerror(errno));
+            errors++;
+        }
+        bench_histogram_file = NULL;
+    }
+    if (test_config.bench_out &&
+        save_bench_baseline(test_config.bench_out, &results) != 0) {
+        fprintf(stderr,
+                "nutest: cannot write baseline %s: %s\n",
+                test_config.bench_out,
+                strerror(errno));
+        errors++;
+    }
+    free_bench_baseline(&results);
+    free_bench_baseline(&baseline);
+    free(bench_evict_buffer);
+    bench_evict_buffer = NULL;
+
+    return errors == 0 && regressions == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+#endif // NUTEST_RUNNER
+
 #endif // !__NUTEST_H__